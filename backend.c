@@ -18,110 +18,988 @@
  *
  */
 
+/*
+ * Queries are answered by a pool of worker threads, each holding its
+ * own handle on the zone store, so that a slow disk or a locked
+ * database never stalls the main loop.  Finished requests are queued
+ * back to the main loop, which is woken through a pipe.  Zone
+ * transfers are built there too, one message per request, each
+ * picking up after the last owner the previous one read in full.
+ *
+ * The DNS logic lives here; the store (backend_ops: SQLite, or LMDB
+ * where built with it) only finds records by name.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "dvdns-config.h"
+#endif
+
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <syslog.h>
-#include <sqlite3.h>
 #include "dnsd.h"
 
-enum sql_stmt_indices {
-	st_name,
+enum {
+	BACKEND_MAX_WORKERS	= 64,
 
-	st_last = st_name
+	ANY_HINFO_TTL		= 3600,
 };
 
-static const char *sql_stmt_text[] = {
-	/* st_name */
-	"select labels.name, rrs.* from labels, rrs where "
-	"labels.id = rrs.domain and "
-	"rrs.domain in "
-	"(select labels.id from labels where labels.name = ?)",
+/* a record read ahead of sending, with copies of what it points to */
+struct xfr_rr {
+	struct backend_rr	rr;
+	char			*domain;
+	void			*rdata;
+};
+
+struct backend_xfr {
+	char			*zone;
+	struct xfr_rr		*soa;		/* as of the first message */
+
+	/* during a message only */
+	struct backend_cursor	*cur;
+	unsigned long		*n_q;
+	struct xfr_rr		*next;		/* first of the next owner */
+	bool			eof;
+
+	GQueue			*held;		/* an owner's, not yet sent */
+	struct xfr_rr		*out;		/* last handed out */
+	char			*after;		/* last owner read in full */
+
+	char			*cut;		/* delegation we are below */
+	GHashTable		*glue;		/* ... and its servers' names */
 };
 
-static sqlite3_stmt *prep_stmts[st_last + 1];
-static sqlite3 *db;
+struct backend_worker {
+	GThread			*thread;
+	struct backend_db	*db;
+	unsigned int		node;		/* NUMA node, if pinned */
+};
+
+struct backend_req {
+	struct dnsres		*res;
+	void			*data;
+	backend_job_fn		job;		/* instead of a lookup */
+	backend_job_done_fn	job_done;
+	unsigned long		sql_q;		/* database reads */
+	GTimeVal		queued;
+
+	unsigned int		node;
+	int			pg_hit;		/* page cache, this request */
+	int			pg_miss;
+};
+
+/* records of one type at a name, for backend_rrset() */
+struct rrset_push {
+	struct dnsres		*res;
+	unsigned int		type;
+	unsigned int		class;
+	enum dns_section	sect;
+	unsigned int		n;		/* of 'type' pushed */
+
+	int			view_type;	/* RRset being pushed */
+	unsigned int		view;		/* ... and the view it is from */
+};
+
+static const struct backend_ops *store;
+static struct backend_worker workers[BACKEND_MAX_WORKERS];
+static unsigned int n_workers;
+
+static GAsyncQueue *work_q;		/* to workers */
+static GAsyncQueue *done_q;		/* back to the main loop */
+static int done_pipe[2];
+static unsigned int n_pending;		/* submitted, not yet done */
+static struct backend_req stop_req;	/* tells a worker to exit */
+static GHashTable *any_zones;		/* apex -> enum any_mode */
+
+static const struct backend_ops *stores[] = {
+	&backend_sqlite,
+#ifdef HAVE_LMDB
+	&backend_lmdb,
+#endif
+};
+
+/* RFC 8482 HINFO: CPU "RFC8482", empty OS */
+static const unsigned char any_hinfo_rdata[] = {
+	7, 'R', 'F', 'C', '8', '4', '8', '2', 0,
+};
+
+/* type covered by an RRSIG */
+static unsigned int rrsig_covers(const struct backend_rr *rr)
+{
+	const unsigned char *p = rr->rdata;
+
+	return rr->rdata_len >= 2 ? (p[0] << 8) | p[1] : 0;
+}
+
+/* negative answers are cached for the lesser of SOA TTL and MINIMUM */
+static int soa_neg_ttl(const struct backend_rr *rr)
+{
+	const unsigned char *p = rr->rdata;
+	int minimum;
+
+	if (rr->rdata_len < 4)
+		return rr->ttl;
+
+	p += rr->rdata_len - 4;
+	minimum = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+
+	return MIN(rr->ttl, minimum);
+}
+
+/*
+ * An RRset comes from the requester's view if that holds records of
+ * the type, or else from view 0.  With --views, records arrive highest
+ * view first within a type, so the first one let through decides.  An
+ * answer that another view's records bear on differs by view.
+ */
+static bool rrset_view_ok(struct rrset_push *p, const struct backend_rr *rr)
+{
+	struct dnsres *res = p->res;
+
+	if (rr->view && rr->view != res->view) {
+		if (views_fn[0])
+			res->view_scoped = true;
+		return false;
+	}
+	if (rr->view)
+		res->view_scoped = true;
+
+	if (rr->type != p->view_type) {
+		p->view_type = rr->type;
+		p->view = rr->view;
+	}
+
+	return rr->view == p->view;
+}
+
+static void rrset_push_rr(const struct backend_rr *rr, void *data)
+{
+	struct rrset_push *p = data;
+	struct backend_rr tmp;
+
+	/* filter out non-matching classes and types */
+	if (p->class != rr->class)
+		return;
+
+	if ((p->type == qtype_all) || (p->type == rr->type)) {
+		if (!rrset_view_ok(p, rr))
+			return;
+
+		if (p->sect == sect_auth && rr->type == qtype_soa) {
+			tmp = *rr;
+			tmp.ttl = soa_neg_ttl(rr);
+			rr = &tmp;
+		}
+		dns_push_rr_sect(p->res, rr, p->sect);
+		p->n++;
+	} else if (p->res->dnssec_ok && rr->type == qtype_rrsig &&
+		   rrsig_covers(rr) == p->type && rrset_view_ok(p, rr))
+		dns_push_rr_sect(p->res, rr, p->sect);
+}
+
+/*
+ * Push the records of 'type' at 'name' into 'sect', along with the
+ * RRSIGs covering them if the requester set DO.  *n_rows, if given,
+ * is set to the number of records held at the name, of any type.
+ * Returns the number of 'type' records pushed, -1 on database error.
+ */
+static int backend_rrset(struct backend_db *db, const char *name,
+			 unsigned int type, unsigned int class,
+			 struct dnsres *res, enum dns_section sect,
+			 unsigned int *n_rows, unsigned long *sql_q)
+{
+	struct rrset_push p = { res, type, class, sect, 0, -1, 0 };
+	int rows;
+
+	rows = store->rrs(db, name, type == qtype_all, rrset_push_rr, &p,
+			  sql_q);
+	if (rows < 0)
+		return -1;
+
+	if (n_rows)
+		*n_rows = rows;
+	return p.n;
+}
+
+/* 'name' is 'zone' or below it */
+bool backend_in_zone(const char *name, const char *zone)
+{
+	size_t len = strlen(name), zone_len = strlen(zone);
+
+	if (len == zone_len)
+		return !strcmp(name, zone);
+
+	return len > zone_len && name[len - zone_len - 1] == '.' &&
+	       !strcmp(name + len - zone_len, zone);
+}
+
+/*
+ * DNSSEC canonical order key (RFC 4034, 6.1): labels from right to
+ * left, each followed by a NUL.  Comparing keys bytewise then gives
+ * canonical name order.  import-zone.pl stores the same key.
+ */
+unsigned int backend_canon_key(const char *name, char *key)
+{
+	const char *end = name + strlen(name), *dot;
+	unsigned int len = 0;
+
+	while (end > name) {
+		for (dot = end; dot > name && dot[-1] != '.'; dot--)
+			;
+
+		memcpy(key + len, dot, end - dot);
+		len += end - dot;
+		key[len++] = 0;
+
+		end = (dot > name) ? dot - 1 : name;
+	}
+
+	return len;
+}
+
+/* owner of the NSEC record in 'zone' covering 'name', or NULL */
+static char *backend_nsec_prev(struct backend_db *db, const char *name,
+			       const char *zone, unsigned long *sql_q)
+{
+	char *owner = store->nsec_prev(db, name, sql_q);
+
+	/* a zone nested below ours may sort in between */
+	if (owner && !backend_in_zone(owner, zone)) {
+		g_free(owner);
+		owner = NULL;
+	}
+
+	return owner;
+}
+
+/*
+ * Authority section of a negative answer (RFC 2308): the zone SOA,
+ * and for DNSSEC requests the NSEC records proving the name or type
+ * does not exist (RFC 4035, 3.1.3).  All of it is pre-signed.
+ */
+static int backend_negative(struct backend_db *db, const struct dnsq *q,
+			    struct dnsres *res, bool nxdomain,
+			    unsigned long *sql_q)
+{
+	const char *zone, *ce;
+	char *owner, *wild_owner = NULL, *wild;
+	int rc = 0;
+
+	zone = store->zone(db, q->name, sql_q);
+	if (!zone)
+		return 0;		/* not ours */
+
+	if (backend_rrset(db, zone, qtype_soa, q->class, res, sect_auth,
+			  NULL, sql_q) < 0)
+		return -1;
+
+	if (!res->dnssec_ok)
+		return 0;
+
+	/* NODATA: the NSEC at the name itself lists the types present */
+	if (!nxdomain)
+		return backend_rrset(db, q->name, qtype_nsec, q->class,
+				     res, sect_auth, NULL, sql_q) < 0 ? -1 : 0;
+
+	/* closest encloser: the longest ancestor that exists */
+	ce = strchr(q->name, '.');
+	while (ce && ++ce != zone && !store->exists(db, ce, sql_q))
+		ce = strchr(ce, '.');
+	if (!ce)
+		ce = zone;
+
+	/* NXDOMAIN: NSECs covering the name and the wildcard */
+	owner = backend_nsec_prev(db, q->name, zone, sql_q);
+
+	wild = g_strdup_printf("*.%s", ce);
+	wild_owner = backend_nsec_prev(db, wild, zone, sql_q);
+	g_free(wild);
+
+	if (owner)
+		rc = backend_rrset(db, owner, qtype_nsec, q->class, res,
+				   sect_auth, NULL, sql_q);
+	if (rc >= 0 && wild_owner && (!owner || strcmp(owner, wild_owner)))
+		rc = backend_rrset(db, wild_owner, qtype_nsec, q->class,
+				   res, sect_auth, NULL, sql_q);
+
+	g_free(owner);
+	g_free(wild_owner);
+	return rc < 0 ? -1 : 0;
+}
+
+static enum any_mode any_mode_of(const char *zone)
+{
+	gpointer mode = g_hash_table_lookup(any_zones, zone);
+
+	if (!mode)
+		mode = g_hash_table_lookup(any_zones, "");	/* "." */
+
+	return GPOINTER_TO_UINT(mode);
+}
+
+/*
+ * ANY.  By default every record at the name, RRsets in type order.
+ * A zone given to --minimal-any answers with the lowest-numbered RRset
+ * alone, and one given to --any-hinfo with a made-up HINFO (RFC 8482),
+ * unless DO is set: HINFO has no signature to go with it.
+ */
+static int backend_any(struct backend_db *db, const struct dnsq *q,
+		       struct dnsres *res, unsigned int *rows,
+		       unsigned long *sql_q)
+{
+	enum any_mode mode = any_full;
+	const char *zone;
+	int type;
+
+	if (g_hash_table_size(any_zones)) {
+		zone = store->zone(db, q->name, sql_q);
+		if (zone)
+			mode = any_mode_of(zone);
+	}
+
+	if (mode == any_full)
+		return backend_rrset(db, q->name, qtype_all, q->class, res,
+				     sect_answer, rows, sql_q);
+
+	type = store->any_type(db, q->name, q->class, sql_q);
+	if (type < 0)
+		return -1;
+
+	if (type && mode == any_synth_hinfo && !res->dnssec_ok) {
+		struct backend_rr rr;
+
+		memset(&rr, 0, sizeof(rr));
+		rr.domain = (const unsigned char *) q->name;
+		rr.type = qtype_hinfo;
+		rr.class = q->class;
+		rr.ttl = ANY_HINFO_TTL;
+		rr.rdata = any_hinfo_rdata;
+		rr.rdata_len = sizeof(any_hinfo_rdata);
+
+		dns_push_rr(res, &rr);
+		*rows = 1;
+		return 1;
+	}
+
+	/* type 0 matches nothing, but still tells NODATA from NXDOMAIN */
+	return backend_rrset(db, q->name, type, q->class, res,
+			     sect_answer, rows, sql_q);
+}
+
+static int backend_query(struct backend_db *db, const struct dnsq *q,
+			 struct dnsres *res, unsigned long *sql_q)
+{
+	unsigned int rows = 0;
+	int n;
+
+	if (q->type == qtype_all)
+		n = backend_any(db, q, res, &rows, sql_q);
+	else
+		n = backend_rrset(db, q->name, q->type, q->class,
+				  res, sect_answer, &rows, sql_q);
+	if (n < 0)
+		return -1;
+
+	/* no data found for given domain name */
+	if (rows == 0)
+		dns_set_rcode(res, rcode_nxdomain);
+
+	/* sections must stay in order, so only for a single question */
+	if (n == 0 && !res->queries->next)
+		return backend_negative(db, q, res, rows == 0, sql_q);
+
+	return 0;
+}
+
+static void *backend_worker(void *data)
+{
+	struct backend_worker *w = data;
+	struct backend_req *req;
+	GList *tmp;
+	char c = 0;
+
+	/*
+	 * Open the store once pinned, so that its page cache is
+	 * allocated, and kept, on this worker's node.
+	 */
+	w->node = cpu_bind_worker(w - workers) % cpu_max_nodes;
+	w->db = store->open();
+
+	while ((req = g_async_queue_pop(work_q)) != &stop_req) {
+		if (req->job) {
+			bool ok = store->begin(w->db) == 0;
+
+			req->job(ok ? w->db : NULL, req->data, &req->sql_q);
+			if (ok)
+				store->end(w->db);
+		} else if (store->begin(w->db) < 0)
+			req->res->query_rc = -1;
+		else {
+			for (tmp = req->res->queries; tmp; tmp = tmp->next) {
+				req->res->query_rc =
+					backend_query(w->db, tmp->data,
+						      req->res, &req->sql_q);
+				if (req->res->query_rc)
+					break;
+			}
+
+			store->end(w->db);
+		}
+
+		req->node = w->node;
+		if (store->page_stats)
+			store->page_stats(w->db, &req->pg_hit, &req->pg_miss);
+
+		g_async_queue_push(done_q, req);
+
+		/* pipe full means the main loop is already due to wake */
+		if (write(done_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+			syslog(LOG_ERR, "backend wakeup: %m");
+	}
+
+	return NULL;
+}
+
+static gboolean backend_done(GIOChannel *source, GIOCondition condition,
+			     void *data)
+{
+	struct backend_req *req;
+	char buf[256];
+	GTimeVal now;
+
+	while (read(done_pipe[0], buf, sizeof(buf)) > 0)
+		;
+
+	g_get_current_time(&now);
+
+	while ((req = g_async_queue_try_pop(done_q)) != NULL) {
+		n_pending--;
+		load_backend_time((now.tv_sec - req->queued.tv_sec) * 1000000 +
+				  (now.tv_usec - req->queued.tv_usec));
+
+		srvstat.sql_q += req->sql_q;
+		srvstat.node_jobs[req->node]++;
+		srvstat.node_pg_hit[req->node] += req->pg_hit;
+		srvstat.node_pg_miss[req->node] += req->pg_miss;
+
+		if (req->job)
+			req->job_done(req->data);
+		else
+			dns_query_done(req->res, req->data);
+		g_slice_free(struct backend_req, req);
+	}
+
+	return TRUE;	/* poll again */
+}
+
+/*
+ * Answer the questions in 'res' on a worker thread.  'res' belongs to
+ * the worker until dns_query_done(res, data) is called, from the main
+ * loop.
+ */
+void backend_submit(struct dnsres *res, void *data)
+{
+	struct backend_req *req;
+
+	req = g_slice_new0(struct backend_req);
+	g_assert(req != NULL);
+
+	req->res = res;
+	req->data = data;
+	g_get_current_time(&req->queued);
+
+	n_pending++;
+	g_async_queue_push(work_q, req);
+}
+
+/*
+ * Run 'fn' on a worker, with that worker's store handle, then call
+ * 'done' on the main loop.  'data' belongs to the worker in between.
+ */
+void backend_run(backend_job_fn fn, backend_job_done_fn done, void *data)
+{
+	struct backend_req *req;
+
+	req = g_slice_new0(struct backend_req);
+	g_assert(req != NULL);
+
+	req->job = fn;
+	req->job_done = done;
+	req->data = data;
+	g_get_current_time(&req->queued);
+
+	n_pending++;
+	g_async_queue_push(work_q, req);
+}
+
+/* requests handed to the workers and not yet answered */
+unsigned int backend_pending(void)
+{
+	return n_pending;
+}
+
+static void any_zones_add(GList *zones, enum any_mode mode)
+{
+	GList *tmp;
+
+	for (tmp = zones; tmp; tmp = tmp->next) {
+		char *zone = g_strdup(tmp->data);
+		size_t len = strlen(zone);
+
+		/* "example.com." is "example.com", "." every zone */
+		if (len && zone[len - 1] == '.')
+			zone[len - 1] = 0;
+
+		g_hash_table_replace(any_zones, zone, GUINT_TO_POINTER(mode));
+	}
+}
 
 void backend_init(void)
 {
+	GIOChannel *chan;
 	unsigned int i;
 	int rc;
 
-	rc = sqlite3_open(db_fn, &db);
-	if (rc != SQLITE_OK) {
-		syslog(LOG_ERR, "sqlite3_open failed");
+	for (i = 0; i < G_N_ELEMENTS(stores); i++)
+		if (!strcmp(stores[i]->name, backend_name))
+			store = stores[i];
+	if (!store) {
+		syslog(LOG_ERR, "unknown backend %s", backend_name);
 		exit(1);
 	}
 
-	for (i = 0; i <= st_last; i++) {
-		const char *dummy;
+	store->init();
+
+	any_zones = g_hash_table_new_full(g_str_hash, g_str_equal,
+					  g_free, NULL);
+	g_assert(any_zones != NULL);
+	any_zones_add(minimal_any_zones, any_one_rrset);
+	any_zones_add(any_hinfo_zones, any_synth_hinfo);
+
+	work_q = g_async_queue_new();
+	done_q = g_async_queue_new();
+	g_assert(work_q != NULL && done_q != NULL);
+
+	rc = pipe(done_pipe);
+	g_assert(rc == 0);
+	fcntl(done_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(done_pipe[1], F_SETFL, O_NONBLOCK);
 
-		rc = sqlite3_prepare(db, sql_stmt_text[i],
-				     strlen(sql_stmt_text[i]),
-				     &prep_stmts[i], &dummy);
-		g_assert(rc == SQLITE_OK);
+	chan = g_io_channel_unix_new(done_pipe[0]);
+	g_assert(chan != NULL);
+	g_io_add_watch(chan, G_IO_IN, backend_done, NULL);
+
+	n_workers = CLAMP(backend_workers, 1, BACKEND_MAX_WORKERS);
+	for (i = 0; i < n_workers; i++) {
+		workers[i].thread = g_thread_create(backend_worker,
+						    &workers[i], TRUE, NULL);
+		g_assert(workers[i].thread != NULL);
 	}
 }
 
 void backend_exit(void)
 {
 	unsigned int i;
+
+	for (i = 0; i < n_workers; i++)
+		g_async_queue_push(work_q, &stop_req);
+
+	for (i = 0; i < n_workers; i++) {
+		g_thread_join(workers[i].thread);
+		store->close(workers[i].db);
+	}
+	n_workers = 0;
+
+	store->exit();
+
+	g_hash_table_destroy(any_zones);
+	any_zones = NULL;
+}
+
+/* skip an uncompressed wire-format name; 0 if it runs off the end */
+static unsigned int rdata_skip_name(const unsigned char *p, unsigned int len,
+				    unsigned int off)
+{
+	while (off < len) {
+		unsigned int label_len = p[off];
+
+		if (label_len == 0)
+			return off + 1;
+		if (label_len & 0xc0)
+			return 0;
+		off += label_len + 1;
+	}
+
+	return 0;
+}
+
+static void zone_serial_add(const struct backend_rr *rr, void *data)
+{
+	GHashTable *zones = data;
+	const unsigned char *p = rr->rdata;
+	unsigned int off;
+	uint32_t serial;
+
+	/* serial follows MNAME and RNAME */
+	off = rdata_skip_name(p, rr->rdata_len, 0);
+	if (off)
+		off = rdata_skip_name(p, rr->rdata_len, off);
+	if (!off || (off + 4) > rr->rdata_len)
+		return;
+
+	memcpy(&serial, p + off, 4);
+	g_hash_table_insert(zones, g_strdup((const char *) rr->domain),
+			    GUINT_TO_POINTER(g_ntohl(serial)));
+}
+
+/*
+ * Map each zone apex in the database to its SOA serial.  Used to tell
+ * whether zone data changed between two points in time.  A scan of
+ * every SOA: from a job on a worker, pass its handle; otherwise (at
+ * startup and exit, with no queries being served) pass NULL, and a
+ * handle is opened for the scan only.
+ */
+GHashTable *backend_zone_serials(struct backend_db *db, unsigned long *n_q)
+{
+	struct backend_db *own = NULL;
+	unsigned long own_q = 0;
+	GHashTable *zones;
+
+	zones = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	g_assert(zones != NULL);
+
+	if (!db) {
+		own = db = store->open();
+		n_q = &own_q;
+		if (store->begin(db) < 0)
+			goto out;
+	}
+
+	store->soas(db, zone_serial_add, zones, n_q);
+
+	if (own)
+		store->end(own);
+out:
+	if (own)
+		store->close(own);
+	return zones;
+}
+
+static struct xfr_rr *xfr_rr_new(const struct backend_rr *rr)
+{
+	struct xfr_rr *x = g_slice_new(struct xfr_rr);
+
+	x->rr = *rr;
+	x->domain = g_strdup((const char *) rr->domain);
+	x->rdata = g_memdup(rr->rdata, rr->rdata_len);
+	x->rr.domain = (const unsigned char *) x->domain;
+	x->rr.rdata = x->rdata;
+
+	return x;
+}
+
+static void xfr_rr_free(struct xfr_rr *x)
+{
+	if (!x)
+		return;
+
+	g_free(x->domain);
+	g_free(x->rdata);
+	g_slice_free(struct xfr_rr, x);
+}
+
+struct backend_xfr *backend_xfr_new(const char *zone)
+{
+	struct backend_xfr *xfr;
+
+	xfr = g_slice_new0(struct backend_xfr);
+	g_assert(xfr != NULL);
+
+	xfr->zone = g_strdup(zone);
+	xfr->held = g_queue_new();
+
+	return xfr;
+}
+
+static void xfr_soa_rr(const struct backend_rr *rr, void *data)
+{
+	struct xfr_rr **soa = data;
+
+	if (!*soa && rr->type == qtype_soa && !rr->view)
+		*soa = xfr_rr_new(rr);
+}
+
+/*
+ * Start the next message of a transfer, on a worker.  Each message
+ * reads in a request of its own, rather than holding one open while
+ * the secondary takes its time, so the SOA is checked every time: a
+ * zone that changed part way through cannot be sent consistently.
+ * Returns 1 with *soa set, 0 if the zone is not ours, -1 on error.
+ */
+int backend_xfr_open(struct backend_db *db, struct backend_xfr *xfr,
+		     struct backend_rr *soa, unsigned long *n_q)
+{
+	struct xfr_rr *cur_soa = NULL;
+
+	if (store->rrs(db, xfr->zone, false, xfr_soa_rr, &cur_soa, n_q) < 0)
+		return -1;
+
+	if (!xfr->soa) {
+		if (!cur_soa)
+			return 0;
+		xfr->soa = cur_soa;
+	} else if (!cur_soa ||
+		   cur_soa->rr.rdata_len != xfr->soa->rr.rdata_len ||
+		   memcmp(cur_soa->rdata, xfr->soa->rdata,
+			  cur_soa->rr.rdata_len)) {
+		syslog(LOG_INFO, "zone %s changed during transfer",
+		       xfr->zone);
+		xfr_rr_free(cur_soa);
+		return -1;
+	} else
+		xfr_rr_free(cur_soa);
+
+	xfr->cur = store->xfr_begin(db, xfr->zone, xfr->after);
+	if (!xfr->cur)
+		return -1;
+
+	xfr->n_q = n_q;
+	xfr->eof = false;
+	*soa = xfr->soa->rr;
+	return 1;
+}
+
+/* the next view 0 record from the store into xfr->next */
+static int xfr_read(struct backend_xfr *xfr)
+{
+	struct backend_rr rr;
 	int rc;
 
-	for (i = 0; i <= st_last; i++)
-		sqlite3_finalize(prep_stmts[i]);
+	if (xfr->eof)
+		return 0;
+
+	/* secondaries get view 0, the zone as everyone else sees it */
+	do {
+		(*xfr->n_q)++;
+		rc = store->xfr_next(xfr->cur, &rr);
+	} while (rc > 0 && rr.view);
+
+	if (rc > 0)
+		xfr->next = xfr_rr_new(&rr);
+	else if (rc == 0)
+		xfr->eof = true;
+
+	return rc;
+}
+
+/* an uncompressed wire-format name as lower-case text; false if bad */
+static bool rdata_name_text(const unsigned char *p, unsigned int len,
+			    char *name, unsigned int name_len)
+{
+	unsigned int off = 0, n = 0, i, label_len;
+
+	while (off < len) {
+		label_len = p[off++];
+		if (label_len == 0) {
+			if (n == 0 && name_len)
+				name[n++] = '.';	/* the root */
+			if (n >= name_len)
+				return false;
+			name[n] = 0;
+			return true;
+		}
+		if ((label_len & 0xc0) || off + label_len > len ||
+		    n + label_len + 1 >= name_len)
+			return false;
+
+		if (n)
+			name[n++] = '.';
+		for (i = 0; i < label_len; i++)
+			name[n++] = g_ascii_tolower(p[off + i]);
+		off += label_len;
+	}
+
+	return false;
+}
+
+/*
+ * A delegation, at 'owner' below the zone apex: remember the names of
+ * its servers that lie below it, as their addresses are glue.
+ */
+static void xfr_cut_begin(struct backend_xfr *xfr, const char *owner)
+{
+	struct xfr_rr *x;
+	char name[256];
+	unsigned int n;
+
+	xfr->cut = g_strdup(owner);
+	xfr->glue = g_hash_table_new_full(g_str_hash, g_str_equal,
+					  g_free, NULL);
+	g_assert(xfr->glue != NULL);
+
+	for (n = g_queue_get_length(xfr->held); n > 0; n--) {
+		x = g_queue_pop_head(xfr->held);
+		if (x->rr.type == qtype_ns &&
+		    rdata_name_text(x->rdata, x->rr.rdata_len,
+				    name, sizeof(name)) &&
+		    backend_in_zone(name, owner))
+			g_hash_table_replace(xfr->glue, g_strdup(name),
+					     GINT_TO_POINTER(1));
+		g_queue_push_tail(xfr->held, x);
+	}
+}
+
+static void xfr_cut_end(struct backend_xfr *xfr)
+{
+	if (!xfr->cut)
+		return;
+
+	g_free(xfr->cut);
+	xfr->cut = NULL;
+	g_hash_table_destroy(xfr->glue);
+	xfr->glue = NULL;
+}
+
+/*
+ * Whether a record of the owner just read goes in the transfer.  At a
+ * delegation ('cut'), the zone holds the NS RRset and the DS RRset;
+ * the NSEC too, unless the child's own apex (with its SOA) is kept in
+ * the same store.  Below a delegation, only glue addresses.
+ */
+static bool xfr_rr_ok(struct backend_xfr *xfr, const struct xfr_rr *x,
+		      bool cut, bool child_apex)
+{
+	unsigned int type = x->rr.type;
+	bool glue;
+
+	if (type == qtype_rrsig)
+		type = rrsig_covers(&x->rr);
 
-	rc = sqlite3_close(db);
-	g_assert(rc == SQLITE_OK);
+	glue = (type == qtype_a || type == qtype_aaaa) && xfr->glue &&
+	       x->rr.type != qtype_rrsig &&
+	       g_hash_table_lookup(xfr->glue, x->domain);
+
+	if (cut)
+		return (type == qtype_ns && x->rr.type != qtype_rrsig) ||
+		       type == qtype_ds ||
+		       (type == qtype_nsec && !child_apex) || glue;
+
+	if (xfr->cut)
+		return glue;
+
+	/* the apex SOA goes at the start and end of the transfer */
+	return !(x->rr.type == qtype_soa && !strcmp(x->domain, xfr->zone));
 }
 
-void backend_query(const struct dnsq *q, struct dnsres *res)
+/*
+ * Read all the records of the next owner into xfr->held, leaving out
+ * those the zone does not hold: the apex SOA, which the caller sends
+ * at the start and end of the transfer, and anything at or below a
+ * delegation other than the delegation itself and its glue.
+ */
+static int xfr_read_owner(struct backend_xfr *xfr)
 {
+	struct xfr_rr *x;
+	bool has_ns = false, has_soa = false, cut = false;
+	unsigned int n;
 	int rc;
-	unsigned int idx, rows = 0;
 
-	idx = st_name;
+	if (!xfr->next) {
+		rc = xfr_read(xfr);
+		if (rc <= 0)
+			return rc;
+	}
 
-	rc = sqlite3_bind_text(prep_stmts[idx], 1,
-			      q->name, strlen(q->name),
-			      SQLITE_STATIC);
-	g_assert(rc == SQLITE_OK);
+	g_free(xfr->after);
+	xfr->after = g_strdup(xfr->next->domain);
 
-	while (1) {
-		struct backend_rr rr;
+	do {
+		x = xfr->next;
+		xfr->next = NULL;
 
-		srvstat.sql_q++;
+		if (x->rr.type == qtype_ns)
+			has_ns = true;
+		else if (x->rr.type == qtype_soa)
+			has_soa = true;
+		g_queue_push_tail(xfr->held, x);
 
-		/* execute SQL query */
-		rc = sqlite3_step(prep_stmts[idx]);
-		if (rc == SQLITE_DONE || rc == SQLITE_BUSY)
-			break;
-		g_assert(rc == SQLITE_ROW);
+		rc = xfr_read(xfr);
+	} while (rc > 0 && !strcmp(xfr->next->domain, xfr->after));
 
-		rows++;
+	/* names come in canonical order, so a delegation's are together */
+	if (xfr->cut && !backend_in_zone(xfr->after, xfr->cut))
+		xfr_cut_end(xfr);
 
-		memset(&rr, 0, sizeof(rr));
-		rr.domain = sqlite3_column_text(prep_stmts[idx], 0);
-		/* skip suffix, column #1 */
-		rr.type = sqlite3_column_int(prep_stmts[idx], 2);
-		rr.class = sqlite3_column_int(prep_stmts[idx], 3);
-		rr.ttl = sqlite3_column_int(prep_stmts[idx], 4);
-		rr.rdata = sqlite3_column_blob(prep_stmts[idx], 5);
-		rr.rdata_len = sqlite3_column_bytes(prep_stmts[idx], 5);
-
-		/* filter out non-matching classes and types */
-		if (q->class != rr.class)
-			continue;
-		if ((q->type != qtype_all) && (q->type != rr.type))
-			continue;
+	if (!xfr->cut && (has_ns || has_soa) &&
+	    strcmp(xfr->after, xfr->zone)) {
+		xfr_cut_begin(xfr, xfr->after);
+		cut = true;
+	}
 
-		dns_push_rr(res, &rr);
+	for (n = g_queue_get_length(xfr->held); n > 0; n--) {
+		x = g_queue_pop_head(xfr->held);
+		if (xfr_rr_ok(xfr, x, cut, has_soa))
+			g_queue_push_tail(xfr->held, x);
+		else
+			xfr_rr_free(x);
 	}
 
-	rc = sqlite3_reset(prep_stmts[idx]);
-	g_assert(rc == SQLITE_OK);
+	return rc < 0 ? -1 : 1;
+}
 
-	/* no data found for given domain name */
-	if (rows == 0)
-		dns_set_rcode(res, rcode_nxdomain);
+/*
+ * Fetch the next zone record to send.  The record is valid until the
+ * following call, across messages too.  Returns 1 for a record, 0 at
+ * the end of the zone, -1 if the store could not be read.
+ */
+int backend_xfr_next(struct backend_xfr *xfr, struct backend_rr *rr)
+{
+	int rc;
+
+	xfr_rr_free(xfr->out);
+	xfr->out = NULL;
+
+	while (g_queue_is_empty(xfr->held)) {
+		rc = xfr_read_owner(xfr);
+		if (rc <= 0)
+			return rc;
+	}
+
+	xfr->out = g_queue_pop_head(xfr->held);
+	*rr = xfr->out->rr;
+	return 1;
 }
 
+/* end a message; an owner only partly read is read again next time */
+void backend_xfr_close(struct backend_xfr *xfr)
+{
+	if (xfr->cur)
+		store->xfr_end(xfr->cur);
+	xfr->cur = NULL;
+	xfr->n_q = NULL;
+
+	xfr_rr_free(xfr->next);
+	xfr->next = NULL;
+}
+
+void backend_xfr_free(struct backend_xfr *xfr)
+{
+	struct xfr_rr *x;
+
+	backend_xfr_close(xfr);
+
+	while ((x = g_queue_pop_head(xfr->held)) != NULL)
+		xfr_rr_free(x);
+	g_queue_free(xfr->held);
+	xfr_rr_free(xfr->out);
+	xfr_rr_free(xfr->soa);
+	xfr_cut_end(xfr);
+
+	g_free(xfr->after);
+	g_free(xfr->zone);
+	g_slice_free(struct backend_xfr, xfr);
+}
@@ -0,0 +1,557 @@
+/*
+ * Copyright 2006 Jeff Garzik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * LMDB zone store, as made by dvdns-mkmdb from an SQLite database.
+ *
+ * The whole file is mapped read-only, and records are handed out
+ * straight from the map, without copying or parsing SQL.  Every key
+ * leads with the owner's canonical key (see backend_canon_key()), so
+ * the B-tree holds names in DNSSEC canonical order, a node's records
+ * just ahead of its descendants':
+ *
+ *   rrs	ckey, 0, type (2), ~view (2), index (2)
+ *		  ->  class (2), TTL (4), rdata
+ *   nsec	ckey of each NSEC owner       ->  (empty)
+ *   zones	ckey of each zone apex        ->  (empty)
+ *
+ * Numbers are big-endian, so records of a name come out in type
+ * order, and within a type highest view first (~view is 0xffff less
+ * the view).  A name exists if any key starts with its canonical key,
+ * which takes in empty non-terminals too.
+ *
+ * Each worker renews a read transaction per request, a snapshot of
+ * the database as of that moment.  dvdns-mkmdb replaces the zone data
+ * in a single write transaction, which readers never wait on; they
+ * see the new data from their next request on.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "dvdns-config.h"
+#endif
+
+#ifdef HAVE_LMDB
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <lmdb.h>
+#include "dnsd.h"
+
+enum {
+	LMDB_KEY_MAX		= 511,		/* mdb_env_get_maxkeysize() */
+	LMDB_NAME_MAX		= 256,
+
+	/* class, TTL, ahead of the rdata */
+	LMDB_VAL_HDR		= 6,
+
+	/* after the 0 ending a name: type, ~view, index */
+	LMDB_KEY_TAIL		= 6,
+};
+
+struct backend_db {
+	MDB_txn			*txn;		/* reset between requests */
+	MDB_cursor		*rrs;
+	MDB_cursor		*nsec;
+};
+
+struct backend_cursor {
+	MDB_cursor		*rrs;		/* in the request's txn */
+	char			prefix[LMDB_KEY_MAX];	/* the zone's */
+	unsigned int		prefix_len;
+	char			start[LMDB_KEY_MAX];
+	unsigned int		start_len;
+	bool			started;
+
+	char			name[LMDB_NAME_MAX];
+};
+
+static MDB_env *env;
+static MDB_dbi dbi_rrs, dbi_nsec, dbi_zones;
+
+
+static void lmdb_fail(const char *what, int rc)
+{
+	syslog(LOG_ERR, "%s %s: %s", what, db_fn, mdb_strerror(rc));
+	exit(1);
+}
+
+static void lmdb_init(void)
+{
+	MDB_txn *txn;
+	int rc;
+
+	rc = mdb_env_create(&env);
+	if (rc)
+		lmdb_fail("mdb_env_create", rc);
+
+	mdb_env_set_maxdbs(env, 3);
+
+	/* every worker, the main loop, and some to spare */
+	mdb_env_set_maxreaders(env, backend_workers + 126);
+
+	/*
+	 * MDB_NOTLS, so that reader slots go with handles rather than
+	 * threads.  Lookups hop about the file; reading ahead would only
+	 * fill the page cache with neighbours nobody asked for.
+	 */
+	rc = mdb_env_open(env, db_fn, MDB_RDONLY | MDB_NOSUBDIR | MDB_NOTLS |
+			  MDB_NORDAHEAD, 0);
+	if (rc)
+		lmdb_fail("mdb_env_open", rc);
+
+	rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+	if (rc)
+		lmdb_fail("mdb_txn_begin", rc);
+
+	if ((rc = mdb_dbi_open(txn, "rrs", 0, &dbi_rrs)) ||
+	    (rc = mdb_dbi_open(txn, "nsec", 0, &dbi_nsec)) ||
+	    (rc = mdb_dbi_open(txn, "zones", 0, &dbi_zones)))
+		lmdb_fail("mdb_dbi_open", rc);
+
+	rc = mdb_txn_commit(txn);
+	if (rc)
+		lmdb_fail("mdb_txn_commit", rc);
+}
+
+static void lmdb_exit(void)
+{
+	mdb_env_close(env);
+	env = NULL;
+}
+
+static struct backend_db *lmdb_open(void)
+{
+	struct backend_db *db;
+	int rc;
+
+	db = g_new0(struct backend_db, 1);
+	g_assert(db != NULL);
+
+	rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &db->txn);
+	if (rc)
+		lmdb_fail("mdb_txn_begin", rc);
+
+	rc = mdb_cursor_open(db->txn, dbi_rrs, &db->rrs);
+	g_assert(rc == 0);
+	rc = mdb_cursor_open(db->txn, dbi_nsec, &db->nsec);
+	g_assert(rc == 0);
+
+	/* released until the first request */
+	mdb_txn_reset(db->txn);
+
+	return db;
+}
+
+static void lmdb_close(struct backend_db *db)
+{
+	mdb_cursor_close(db->rrs);
+	mdb_cursor_close(db->nsec);
+	mdb_txn_abort(db->txn);
+	g_free(db);
+}
+
+static int lmdb_begin(struct backend_db *db)
+{
+	int rc;
+
+	rc = mdb_txn_renew(db->txn);
+	if (rc) {
+		/* e.g. MDB_MAP_RESIZED: the file outgrew our mapping */
+		syslog(LOG_ERR, "read of %s failed: %s", db_fn,
+		       mdb_strerror(rc));
+		return -1;
+	}
+
+	mdb_cursor_renew(db->txn, db->rrs);
+	mdb_cursor_renew(db->txn, db->nsec);
+	return 0;
+}
+
+static void lmdb_end(struct backend_db *db)
+{
+	mdb_txn_reset(db->txn);
+}
+
+/* canonical key of 'name', lower-cased as dvdns-mkmdb stores it */
+static unsigned int lmdb_key(const char *name, char *key)
+{
+	unsigned int i, len;
+
+	if (strlen(name) >= LMDB_NAME_MAX)
+		return 0;
+
+	len = backend_canon_key(name, key);
+	for (i = 0; i < len; i++)
+		key[i] = g_ascii_tolower(key[i]);
+
+	return len;
+}
+
+/* presentation form of the owner whose canonical key is 'key' */
+static void lmdb_key_name(const char *key, unsigned int len, char *name)
+{
+	unsigned int n = 0, label_len;
+	const char *end = key + len, *p;
+
+	/* labels run right to left, each ending in a NUL */
+	while (end > key) {
+		for (p = end - 1; p > key && p[-1] != 0; p--)
+			;
+		label_len = end - 1 - p;
+
+		if (n)
+			name[n++] = '.';
+		memcpy(name + n, p, label_len);
+		n += label_len;
+
+		end = p;
+	}
+
+	name[n] = 0;
+}
+
+static bool lmdb_has_prefix(const MDB_val *k, const char *prefix,
+			    unsigned int len)
+{
+	return k->mv_size >= len && !memcmp(k->mv_data, prefix, len);
+}
+
+static void lmdb_fill_rr(const MDB_val *k, const MDB_val *v,
+			 const char *owner, struct backend_rr *rr)
+{
+	const unsigned char *kp = k->mv_data, *vp = v->mv_data;
+
+	memset(rr, 0, sizeof(*rr));
+	rr->domain = (const unsigned char *) owner;
+	rr->type = (kp[k->mv_size - 6] << 8) | kp[k->mv_size - 5];
+	rr->view = 0xffff - ((kp[k->mv_size - 4] << 8) | kp[k->mv_size - 3]);
+	rr->class = (vp[0] << 8) | vp[1];
+	rr->ttl = (vp[2] << 24) | (vp[3] << 16) | (vp[4] << 8) | vp[5];
+	rr->rdata = vp + LMDB_VAL_HDR;
+	rr->rdata_len = v->mv_size - LMDB_VAL_HDR;
+}
+
+/*
+ * Position the cursor at the first record of 'key' (a name's canonical
+ * key, 0, and optionally a type).  The records of the name follow.
+ */
+static bool lmdb_seek(MDB_cursor *cur, const char *key, unsigned int len,
+		      MDB_val *k, MDB_val *v)
+{
+	k->mv_data = (void *) key;
+	k->mv_size = len;
+
+	return mdb_cursor_get(cur, k, v, MDB_SET_RANGE) == 0 &&
+	       lmdb_has_prefix(k, key, len);
+}
+
+static int lmdb_rrs(struct backend_db *db, const char *name, bool by_type,
+		    backend_rr_fn fn, void *data, unsigned long *n_q)
+{
+	char key[LMDB_KEY_MAX];
+	unsigned int len;
+	MDB_val k, v;
+	int rows = 0;
+
+	len = lmdb_key(name, key);
+	if (!len && *name)
+		return 0;
+	key[len++] = 0;
+
+	/* records come out in type order whether asked or not */
+	(*n_q)++;
+	if (!lmdb_seek(db->rrs, key, len, &k, &v))
+		return 0;
+
+	do {
+		struct backend_rr rr;
+
+		if (k.mv_size != len + LMDB_KEY_TAIL ||
+		    v.mv_size < LMDB_VAL_HDR)
+			break;
+
+		rows++;
+
+		lmdb_fill_rr(&k, &v, name, &rr);
+		fn(&rr, data);
+	} while (mdb_cursor_get(db->rrs, &k, &v, MDB_NEXT) == 0 &&
+		 lmdb_has_prefix(&k, key, len));
+
+	return rows;
+}
+
+static bool lmdb_exists(struct backend_db *db, const char *name,
+			unsigned long *n_q)
+{
+	char key[LMDB_KEY_MAX];
+	unsigned int len;
+	MDB_val k, v;
+
+	len = lmdb_key(name, key);
+	if (!len)
+		return !*name;		/* everything is below the root */
+
+	/* the name itself, or a name below it */
+	(*n_q)++;
+	return lmdb_seek(db->rrs, key, len, &k, &v);
+}
+
+static bool lmdb_has_soa(struct backend_db *db, const char *name,
+			 unsigned long *n_q)
+{
+	char key[LMDB_KEY_MAX];
+	unsigned int len;
+	MDB_val k, v;
+
+	len = lmdb_key(name, key);
+	if (!len && *name)
+		return false;
+	key[len++] = 0;
+	key[len++] = 0;
+	key[len++] = qtype_soa;
+	key[len++] = 0xff;		/* view 0 */
+	key[len++] = 0xff;
+
+	(*n_q)++;
+	return lmdb_seek(db->rrs, key, len, &k, &v);
+}
+
+static const char *lmdb_zone(struct backend_db *db, const char *name,
+			     unsigned long *n_q)
+{
+	while (name) {
+		if (lmdb_has_soa(db, name, n_q))
+			return name;
+
+		name = strchr(name, '.');
+		if (name)
+			name++;
+	}
+
+	return NULL;
+}
+
+static char *lmdb_nsec_prev(struct backend_db *db, const char *name,
+			    unsigned long *n_q)
+{
+	char key[LMDB_KEY_MAX], owner[LMDB_NAME_MAX];
+	unsigned int len;
+	MDB_val k, v;
+	int rc;
+
+	len = lmdb_key(name, key);
+	if (!len)
+		return NULL;		/* nothing sorts before the root */
+
+	/* the last NSEC owner sorting before 'name' */
+	(*n_q)++;
+	k.mv_data = key;
+	k.mv_size = len;
+	rc = mdb_cursor_get(db->nsec, &k, &v, MDB_SET_RANGE);
+	if (rc == 0)
+		rc = mdb_cursor_get(db->nsec, &k, &v, MDB_PREV);
+	else if (rc == MDB_NOTFOUND)
+		rc = mdb_cursor_get(db->nsec, &k, &v, MDB_LAST);
+	if (rc || k.mv_size >= LMDB_NAME_MAX)
+		return NULL;
+
+	lmdb_key_name(k.mv_data, k.mv_size, owner);
+	return g_strdup(owner);
+}
+
+static bool lmdb_any_type_rr(int type)
+{
+	return type != qtype_rrsig && type != qtype_nsec &&
+	       type != qtype_nsec3;
+}
+
+static int lmdb_any_type(struct backend_db *db, const char *name,
+			 unsigned int class, unsigned long *n_q)
+{
+	char key[LMDB_KEY_MAX];
+	unsigned int len;
+	MDB_val k, v;
+
+	len = lmdb_key(name, key);
+	if (!len && *name)
+		return 0;
+	key[len++] = 0;
+
+	(*n_q)++;
+	if (!lmdb_seek(db->rrs, key, len, &k, &v))
+		return 0;
+
+	do {
+		struct backend_rr rr;
+
+		if (k.mv_size != len + LMDB_KEY_TAIL ||
+		    v.mv_size < LMDB_VAL_HDR)
+			break;
+
+		lmdb_fill_rr(&k, &v, name, &rr);
+		if (rr.class == class && lmdb_any_type_rr(rr.type))
+			return rr.type;
+	} while (mdb_cursor_get(db->rrs, &k, &v, MDB_NEXT) == 0 &&
+		 lmdb_has_prefix(&k, key, len));
+
+	return 0;
+}
+
+static void lmdb_soas(struct backend_db *db, backend_rr_fn fn, void *data,
+		      unsigned long *n_q)
+{
+	MDB_cursor *zones;
+	MDB_val zk, zv;
+	int rc;
+
+	rc = mdb_cursor_open(db->txn, dbi_zones, &zones);
+	g_assert(rc == 0);
+
+	for (rc = mdb_cursor_get(zones, &zk, &zv, MDB_FIRST); rc == 0;
+	     rc = mdb_cursor_get(zones, &zk, &zv, MDB_NEXT)) {
+		char key[LMDB_KEY_MAX], name[LMDB_NAME_MAX];
+		struct backend_rr rr;
+		unsigned int len = zk.mv_size;
+		MDB_val k, v;
+
+		(*n_q)++;
+
+		if (len + 5 > sizeof(key) || len >= LMDB_NAME_MAX)
+			continue;
+
+		memcpy(key, zk.mv_data, len);
+		key[len++] = 0;
+		key[len++] = 0;
+		key[len++] = qtype_soa;
+		key[len++] = 0xff;	/* view 0 */
+		key[len++] = 0xff;
+
+		if (!lmdb_seek(db->rrs, key, len, &k, &v) ||
+		    v.mv_size < LMDB_VAL_HDR)
+			continue;
+
+		lmdb_key_name(zk.mv_data, zk.mv_size, name);
+		lmdb_fill_rr(&k, &v, name, &rr);
+		fn(&rr, data);
+	}
+
+	mdb_cursor_close(zones);
+}
+
+static struct backend_cursor *lmdb_xfr_begin(struct backend_db *db,
+					     const char *zone,
+					     const char *after)
+{
+	struct backend_cursor *cur;
+	unsigned int len;
+	int rc;
+
+	cur = g_slice_new0(struct backend_cursor);
+	g_assert(cur != NULL);
+
+	len = lmdb_key(zone, cur->prefix);
+	if (!len && *zone)
+		goto err_out;
+	cur->prefix_len = len;
+
+	/* the apex, or just past the records of 'after' */
+	if (after) {
+		len = lmdb_key(after, cur->start);
+		if (!len)
+			goto err_out;
+		cur->start[len++] = 1;
+	} else
+		memcpy(cur->start, cur->prefix, len);
+	cur->start_len = len;
+
+	rc = mdb_cursor_open(db->txn, dbi_rrs, &cur->rrs);
+	if (rc) {
+		syslog(LOG_ERR, "zone transfer of %s failed: %s",
+		       zone, mdb_strerror(rc));
+		goto err_out;
+	}
+
+	return cur;
+
+err_out:
+	g_slice_free(struct backend_cursor, cur);
+	return NULL;
+}
+
+static int lmdb_xfr_next(struct backend_cursor *cur, struct backend_rr *rr)
+{
+	MDB_val k, v;
+	int rc;
+
+	/* every name at or below the apex, in canonical order */
+	if (!cur->started) {
+		cur->started = true;
+		k.mv_data = cur->start;
+		k.mv_size = cur->start_len;
+		rc = mdb_cursor_get(cur->rrs, &k, &v, MDB_SET_RANGE);
+	} else
+		rc = mdb_cursor_get(cur->rrs, &k, &v, MDB_NEXT);
+
+	if (rc == MDB_NOTFOUND ||
+	    (rc == 0 && !lmdb_has_prefix(&k, cur->prefix, cur->prefix_len)))
+		return 0;
+	if (rc) {
+		syslog(LOG_ERR, "zone transfer failed: %s", mdb_strerror(rc));
+		return -1;
+	}
+
+	if (k.mv_size < 1 + LMDB_KEY_TAIL ||
+	    k.mv_size - 1 - LMDB_KEY_TAIL >= LMDB_NAME_MAX ||
+	    v.mv_size < LMDB_VAL_HDR) {
+		syslog(LOG_ERR, "zone transfer: bad record in %s", db_fn);
+		return -1;
+	}
+
+	lmdb_key_name(k.mv_data, k.mv_size - 1 - LMDB_KEY_TAIL, cur->name);
+	lmdb_fill_rr(&k, &v, cur->name, rr);
+	return 1;
+}
+
+static void lmdb_xfr_end(struct backend_cursor *cur)
+{
+	mdb_cursor_close(cur->rrs);
+	g_slice_free(struct backend_cursor, cur);
+}
+
+const struct backend_ops backend_lmdb = {
+	.name		= "lmdb",
+	.init		= lmdb_init,
+	.exit		= lmdb_exit,
+	.open		= lmdb_open,
+	.close		= lmdb_close,
+	.begin		= lmdb_begin,
+	.end		= lmdb_end,
+	.rrs		= lmdb_rrs,
+	.exists		= lmdb_exists,
+	.zone		= lmdb_zone,
+	.nsec_prev	= lmdb_nsec_prev,
+	.any_type	= lmdb_any_type,
+	.soas		= lmdb_soas,
+	.xfr_begin	= lmdb_xfr_begin,
+	.xfr_next	= lmdb_xfr_next,
+	.xfr_end	= lmdb_xfr_end,
+};
+
+#endif /* HAVE_LMDB */
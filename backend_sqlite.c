@@ -0,0 +1,523 @@
+/*
+ * Copyright 2006 Jeff Garzik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * SQLite zone store, as made by mk-dnsdb.sql and import-zone.pl.
+ *
+ * Each thread holds its own read-only connection and prepared
+ * statements.  Names are looked up in the in-memory name table
+ * (names.c) when one has been built, and in the labels table if not,
+ * or if a dynamic update has changed them since.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sqlite3.h>
+#include "dnsd.h"
+
+enum {
+	SQLITE_BUSY_MS		= 2000,	/* wait this long on a locked db */
+};
+
+enum sql_stmt_indices {
+	st_name,
+	st_soa,
+	st_zones,
+	st_exists,
+	st_any,
+	st_any_type,
+	st_nsec_prev,
+
+	st_last = st_nsec_prev
+};
+
+static const char *sql_stmt_text[] = {
+	/* st_name */
+	"select labels.name, rrs.* from labels, rrs where "
+	"labels.id = rrs.domain and "
+	"rrs.domain in "
+	"(select labels.id from labels where labels.name = ?)",
+
+	/* st_soa */
+	"select labels.name, rrs.* from labels, rrs where "
+	"labels.id = rrs.domain and "
+	"labels.name = ? and rrs.type = 6",
+
+	/* st_zones */
+	"select labels.name, rrs.* from labels, rrs where "
+	"labels.id = rrs.domain and rrs.type = 6",
+
+	/* st_exists */
+	"select id from labels where name = ?",
+
+	/* st_any: as st_name, RRsets in type order */
+	"select labels.name, rrs.* from labels, rrs where "
+	"labels.id = rrs.domain and "
+	"rrs.domain in "
+	"(select labels.id from labels where labels.name = ?) "
+	"order by rrs.type, rrs.rowid",
+
+	/* st_any_type: lowest type at a name, DNSSEC records aside */
+	"select rrs.type from labels, rrs where "
+	"labels.id = rrs.domain and labels.name = ? and rrs.class = ? and "
+	"rrs.type not in (46, 47, 50) "
+	"order by rrs.type limit 1",
+
+	/*
+	 * st_nsec_prev: the NSEC record that canonically precedes a name,
+	 * walking the labels.ckey index backwards.  Databases made before
+	 * DNSSEC support lack that column; see sqlite_open().
+	 */
+	"select labels.name, rrs.* from labels, rrs where "
+	"labels.ckey < ? and labels.id = rrs.domain and rrs.type = 47 "
+	"order by labels.ckey desc limit 1",
+};
+
+/*
+ * st_name and st_any under --views: by type, then highest view first,
+ * as backend.c expects.  Databases made before views lack rrs.view.
+ */
+static const char views_stmt_text[] =
+	"select labels.name, rrs.* from labels, rrs where "
+	"labels.id = rrs.domain and "
+	"rrs.domain in "
+	"(select labels.id from labels where labels.name = ?) "
+	"order by rrs.type, rrs.view desc, rrs.rowid";
+
+/*
+ * Every record at or below the zone apex, in canonical order: a range
+ * of the labels.ckey index, from the zone's key (or just past the
+ * owner a message left off after) up to the key of the zone's next
+ * sibling.  Each message of a transfer prepares its own.
+ */
+static const char xfr_stmt_text[] =
+	"select labels.name, rrs.* from labels, rrs where "
+	"labels.ckey >= ?1 and labels.ckey < ?2 and "
+	"labels.id = rrs.domain "
+	"order by labels.ckey";
+
+struct backend_db {
+	sqlite3			*db;
+	sqlite3_stmt		*stmts[st_last + 1];
+
+	struct name_table	*names;		/* this request's; may be NULL */
+};
+
+struct backend_cursor {
+	struct backend_db	*db;
+	sqlite3_stmt		*stmt;
+	char			*zone;
+
+	char			lo[512], hi[512];	/* ckey range */
+	unsigned int		lo_len, hi_len;
+};
+
+
+static void sqlite_init(void)
+{
+	names_init();
+}
+
+static void sqlite_exit(void)
+{
+	names_exit();
+}
+
+static struct backend_db *sqlite_open(void)
+{
+	struct backend_db *db;
+	unsigned int i;
+	int rc;
+
+	db = g_new0(struct backend_db, 1);
+	g_assert(db != NULL);
+
+	rc = sqlite3_open_v2(db_fn, &db->db, SQLITE_OPEN_READONLY, NULL);
+	if (rc != SQLITE_OK) {
+		syslog(LOG_ERR, "sqlite3_open %s failed", db_fn);
+		exit(1);
+	}
+
+	/* ride out imports holding the write lock, rather than failing */
+	sqlite3_busy_timeout(db->db, SQLITE_BUSY_MS);
+
+	for (i = 0; i <= st_last; i++) {
+		const char *text = sql_stmt_text[i], *dummy;
+
+		if (views_fn[0] && (i == st_name || i == st_any))
+			text = views_stmt_text;
+
+		rc = sqlite3_prepare(db->db, text, strlen(text),
+				     &db->stmts[i], &dummy);
+		if (rc != SQLITE_OK && text == views_stmt_text) {
+			syslog(LOG_ERR, "%s has no rrs.view column, "
+			       "re-run import-zone.pl for --views", db_fn);
+			exit(1);
+		}
+		if (rc != SQLITE_OK && i == st_nsec_prev) {
+			syslog(LOG_WARNING, "%s has no labels.ckey column, "
+			       "NXDOMAIN answers will lack NSEC proofs", db_fn);
+			db->stmts[i] = NULL;
+			continue;
+		}
+		g_assert(rc == SQLITE_OK);
+	}
+
+	return db;
+}
+
+static void sqlite_close(struct backend_db *db)
+{
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i <= st_last; i++)
+		sqlite3_finalize(db->stmts[i]);
+
+	rc = sqlite3_close(db->db);
+	g_assert(rc == SQLITE_OK);
+
+	g_free(db);
+}
+
+static int sqlite_begin(struct backend_db *db)
+{
+	db->names = names_get();
+	return 0;
+}
+
+static void sqlite_end(struct backend_db *db)
+{
+	names_put(db->names);
+	db->names = NULL;
+}
+
+/* the name table, if it can be trusted about 'name' */
+static struct name_table *sqlite_names(struct backend_db *db,
+				       const char *name)
+{
+	if (db->names && names_stale(name))
+		return NULL;
+
+	return db->names;
+}
+
+static void sqlite_fill_rr(sqlite3_stmt *stmt, struct backend_rr *rr)
+{
+	memset(rr, 0, sizeof(*rr));
+	rr->domain = sqlite3_column_text(stmt, 0);
+	/* skip suffix, column #1 */
+	rr->type = sqlite3_column_int(stmt, 2);
+	rr->class = sqlite3_column_int(stmt, 3);
+	rr->ttl = sqlite3_column_int(stmt, 4);
+	rr->rdata = sqlite3_column_blob(stmt, 5);
+	rr->rdata_len = sqlite3_column_bytes(stmt, 5);
+	if (sqlite3_column_count(stmt) > 6)
+		rr->view = sqlite3_column_int(stmt, 6);
+}
+
+static int sqlite_rrs(struct backend_db *db, const char *name, bool by_type,
+		      backend_rr_fn fn, void *data, unsigned long *n_q)
+{
+	sqlite3_stmt *stmt = db->stmts[by_type ? st_any : st_name];
+	struct name_table *names = sqlite_names(db, name);
+	int rc, rows = 0;
+
+	/* a name the table lacks has no records to look for */
+	if (names && !names_lookup(names, name, name_exists))
+		return 0;
+
+	rc = sqlite3_bind_text(stmt, 1, name, strlen(name), SQLITE_STATIC);
+	g_assert(rc == SQLITE_OK);
+
+	while (1) {
+		struct backend_rr rr;
+
+		(*n_q)++;
+
+		/* execute SQL query */
+		rc = sqlite3_step(stmt);
+		if (rc == SQLITE_DONE)
+			break;
+		if (rc != SQLITE_ROW) {
+			syslog(LOG_ERR, "query for %s failed: %s",
+			       name, sqlite3_errmsg(db->db));
+			sqlite3_reset(stmt);
+			return -1;
+		}
+
+		rows++;
+
+		sqlite_fill_rr(stmt, &rr);
+		fn(&rr, data);
+	}
+
+	rc = sqlite3_reset(stmt);
+	g_assert(rc == SQLITE_OK);
+
+	return rows;
+}
+
+/* step a single-row statement bound to 'name'; true for a row */
+static bool sqlite_probe(struct backend_db *db, unsigned int idx,
+			 const char *name, unsigned long *n_q)
+{
+	sqlite3_stmt *stmt = db->stmts[idx];
+	int rc;
+
+	rc = sqlite3_bind_text(stmt, 1, name, strlen(name), SQLITE_STATIC);
+	g_assert(rc == SQLITE_OK);
+
+	(*n_q)++;
+	rc = sqlite3_step(stmt);
+	sqlite3_reset(stmt);
+
+	return rc == SQLITE_ROW;
+}
+
+static bool sqlite_exists(struct backend_db *db, const char *name,
+			  unsigned long *n_q)
+{
+	struct name_table *names = sqlite_names(db, name);
+
+	if (names)
+		return names_lookup(names, name, name_exists);
+
+	return sqlite_probe(db, st_exists, name, n_q);
+}
+
+/* the closest ancestor with an SOA */
+static const char *sqlite_zone(struct backend_db *db, const char *name,
+			       unsigned long *n_q)
+{
+	if (db->names)
+		return names_closest(db->names, name, name_soa);
+
+	while (name) {
+		if (sqlite_probe(db, st_soa, name, n_q))
+			return name;
+
+		name = strchr(name, '.');
+		if (name)
+			name++;
+	}
+
+	return NULL;
+}
+
+static char *sqlite_nsec_prev(struct backend_db *db, const char *name,
+			      unsigned long *n_q)
+{
+	sqlite3_stmt *stmt = db->stmts[st_nsec_prev];
+	char key[512];
+	char *owner = NULL;
+	unsigned int key_len;
+	int rc;
+
+	if (db->names)
+		return names_prev(db->names, name, name_nsec);
+
+	if (!stmt || strlen(name) >= (sizeof(key) / 2))
+		return NULL;
+
+	key_len = backend_canon_key(name, key);
+	rc = sqlite3_bind_blob(stmt, 1, key, key_len, SQLITE_STATIC);
+	g_assert(rc == SQLITE_OK);
+
+	(*n_q)++;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		owner = g_strdup((const char *) sqlite3_column_text(stmt, 0));
+
+	sqlite3_reset(stmt);
+	return owner;
+}
+
+static int sqlite_any_type(struct backend_db *db, const char *name,
+			   unsigned int class, unsigned long *n_q)
+{
+	sqlite3_stmt *stmt = db->stmts[st_any_type];
+	struct name_table *names = sqlite_names(db, name);
+	int rc, type = 0;
+
+	if (names && !names_lookup(names, name, name_exists))
+		return 0;
+
+	rc = sqlite3_bind_text(stmt, 1, name, strlen(name), SQLITE_STATIC);
+	g_assert(rc == SQLITE_OK);
+	rc = sqlite3_bind_int(stmt, 2, class);
+	g_assert(rc == SQLITE_OK);
+
+	(*n_q)++;
+	rc = sqlite3_step(stmt);
+	if (rc == SQLITE_ROW)
+		type = sqlite3_column_int(stmt, 0);
+	else if (rc != SQLITE_DONE) {
+		syslog(LOG_ERR, "query for %s failed: %s",
+		       name, sqlite3_errmsg(db->db));
+		type = -1;
+	}
+
+	sqlite3_reset(stmt);
+	return type;
+}
+
+static void sqlite_soas(struct backend_db *db, backend_rr_fn fn, void *data,
+			unsigned long *n_q)
+{
+	sqlite3_stmt *stmt = db->stmts[st_zones];
+	int rc;
+
+	while (1) {
+		struct backend_rr rr;
+
+		(*n_q)++;
+
+		rc = sqlite3_step(stmt);
+		if (rc != SQLITE_ROW)
+			break;
+
+		sqlite_fill_rr(stmt, &rr);
+		fn(&rr, data);
+	}
+
+	if (rc != SQLITE_DONE)
+		syslog(LOG_ERR, "reading zone serials failed: %s",
+		       sqlite3_errmsg(db->db));
+
+	sqlite3_reset(stmt);
+}
+
+/* canonical key of 'name', lower-cased as import-zone.pl stores it */
+static unsigned int sqlite_canon_key(const char *name, char *key)
+{
+	unsigned int i, len = backend_canon_key(name, key);
+
+	for (i = 0; i < len; i++)
+		key[i] = g_ascii_tolower(key[i]);
+
+	return len;
+}
+
+static struct backend_cursor *sqlite_xfr_begin(struct backend_db *db,
+					       const char *zone,
+					       const char *after)
+{
+	struct backend_cursor *xfr;
+	const char *dummy;
+	int rc;
+
+	if (strlen(zone) >= sizeof(xfr->hi) / 2 - 1 ||
+	    (after && strlen(after) >= sizeof(xfr->lo) / 2 - 1))
+		return NULL;
+
+	xfr = g_slice_new0(struct backend_cursor);
+	g_assert(xfr != NULL);
+
+	xfr->db = db;
+	xfr->zone = g_strdup(zone);
+
+	/* past the zone's own key and all that it prefixes */
+	xfr->hi_len = sqlite_canon_key(zone, xfr->hi);
+	if (xfr->hi_len)
+		xfr->hi[xfr->hi_len - 1] = 1;
+	else
+		xfr->hi[xfr->hi_len++] = (char) 0xff;	/* the root */
+
+	/* past 'after' itself, not its descendants */
+	if (after) {
+		xfr->lo_len = sqlite_canon_key(after, xfr->lo);
+		xfr->lo[xfr->lo_len++] = 1;
+	} else
+		xfr->lo_len = sqlite_canon_key(zone, xfr->lo);
+
+	rc = sqlite3_prepare(db->db, xfr_stmt_text, strlen(xfr_stmt_text),
+			     &xfr->stmt, &dummy);
+	if (rc != SQLITE_OK) {
+		syslog(LOG_ERR, "zone transfer of %s: %s has no labels.ckey "
+		       "column, re-run import-zone.pl", zone, db_fn);
+		g_free(xfr->zone);
+		g_slice_free(struct backend_cursor, xfr);
+		return NULL;
+	}
+
+	rc = sqlite3_bind_blob(xfr->stmt, 1, xfr->lo, xfr->lo_len,
+			       SQLITE_STATIC);
+	g_assert(rc == SQLITE_OK);
+	rc = sqlite3_bind_blob(xfr->stmt, 2, xfr->hi, xfr->hi_len,
+			       SQLITE_STATIC);
+	g_assert(rc == SQLITE_OK);
+
+	return xfr;
+}
+
+static int sqlite_xfr_next(struct backend_cursor *xfr,
+			   struct backend_rr *rr)
+{
+	int rc;
+
+	rc = sqlite3_step(xfr->stmt);
+	if (rc == SQLITE_DONE)
+		return 0;
+	if (rc != SQLITE_ROW) {
+		syslog(LOG_ERR, "zone transfer of %s failed: %s",
+		       xfr->zone, sqlite3_errmsg(xfr->db->db));
+		return -1;
+	}
+
+	sqlite_fill_rr(xfr->stmt, rr);
+	return 1;
+}
+
+static void sqlite_xfr_end(struct backend_cursor *xfr)
+{
+	sqlite3_finalize(xfr->stmt);
+	g_free(xfr->zone);
+	g_slice_free(struct backend_cursor, xfr);
+}
+
+static void sqlite_page_stats(struct backend_db *db, int *hit, int *miss)
+{
+#ifdef SQLITE_DBSTATUS_CACHE_HIT
+	int hi;
+
+	sqlite3_db_status(db->db, SQLITE_DBSTATUS_CACHE_HIT, hit, &hi, 1);
+	sqlite3_db_status(db->db, SQLITE_DBSTATUS_CACHE_MISS, miss, &hi, 1);
+#endif
+}
+
+const struct backend_ops backend_sqlite = {
+	.name		= "sqlite",
+	.init		= sqlite_init,
+	.exit		= sqlite_exit,
+	.open		= sqlite_open,
+	.close		= sqlite_close,
+	.begin		= sqlite_begin,
+	.end		= sqlite_end,
+	.rrs		= sqlite_rrs,
+	.exists		= sqlite_exists,
+	.zone		= sqlite_zone,
+	.nsec_prev	= sqlite_nsec_prev,
+	.any_type	= sqlite_any_type,
+	.soas		= sqlite_soas,
+	.xfr_begin	= sqlite_xfr_begin,
+	.xfr_next	= sqlite_xfr_next,
+	.xfr_end	= sqlite_xfr_end,
+	.page_stats	= sqlite_page_stats,
+};
@@ -0,0 +1,183 @@
+/*
+ * Copyright 2006 Jeff Garzik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * CPU placement.
+ *
+ * With --cpus, the main loop is pinned to the first listed CPU and
+ * database workers to the others, round robin.  Memory is placed on
+ * the node of the thread that first touches it, so the message cache
+ * stays on the main loop's node, and each worker's SQLite page cache,
+ * its copy of the zone data, stays on the worker's node.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "dvdns-config.h"
+#endif
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <syslog.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+#include "dnsd.h"
+
+enum {
+	CPU_MAX			= 1024,
+};
+
+static unsigned int cpus[CPU_MAX];
+static unsigned int n_cpus;
+
+
+/* parse a list such as "0-3,8,10-11" */
+bool cpu_list_parse(const char *list)
+{
+	const char *s = list;
+	char *end;
+	unsigned long first, last;
+
+	n_cpus = 0;
+
+	while (*s) {
+		first = strtoul(s, &end, 10);
+		if (end == s)
+			return false;
+
+		last = first;
+		if (*end == '-') {
+			s = end + 1;
+			last = strtoul(s, &end, 10);
+			if (end == s || last < first)
+				return false;
+		}
+
+		if (last >= CPU_MAX)
+			return false;
+
+		while (first <= last) {
+			if (n_cpus == CPU_MAX)
+				return false;
+			cpus[n_cpus++] = first++;
+		}
+
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return false;
+		s = end;
+	}
+
+	return n_cpus > 0;
+}
+
+/* NUMA node of 'cpu', as sysfs tells it; 0 if it does not */
+static unsigned int cpu_node(unsigned int cpu)
+{
+	char path[128];
+	unsigned int node;
+
+	for (node = 0; node < cpu_max_nodes; node++) {
+		sprintf(path, "/sys/devices/system/cpu/cpu%u/node%u",
+			cpu, node);
+		if (access(path, F_OK) == 0)
+			return node;
+	}
+
+	return 0;
+}
+
+static bool cpu_bind(const unsigned int *list, unsigned int n)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t set;
+	unsigned int i;
+
+	CPU_ZERO(&set);
+	for (i = 0; i < n; i++)
+		CPU_SET(list[i], &set);
+
+	if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+		syslog(LOG_ERR, "sched_setaffinity: %m");
+		return false;
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+/* pin the calling thread, the main loop; returns its node */
+unsigned int cpu_bind_main(void)
+{
+	unsigned int node;
+
+	if (!n_cpus || !cpu_bind(&cpus[0], 1))
+		return 0;
+
+	node = cpu_node(cpus[0]);
+	syslog(LOG_INFO, "main loop on cpu %u, node %u", cpus[0], node);
+
+	return node;
+}
+
+/* pin the calling thread, worker 'idx'; returns its node */
+unsigned int cpu_bind_worker(unsigned int idx)
+{
+	unsigned int cpu;
+
+	if (!n_cpus)
+		return 0;
+
+	/* leave the main loop's CPU alone, if there are others */
+	if (n_cpus > 1)
+		cpu = cpus[1 + idx % (n_cpus - 1)];
+	else
+		cpu = cpus[0];
+
+	if (!cpu_bind(&cpu, 1))
+		return 0;
+
+	return cpu_node(cpu);
+}
+
+/* let the calling thread, a helper, run on any listed CPU */
+void cpu_bind_any(void)
+{
+	if (n_cpus)
+		cpu_bind(cpus, n_cpus);
+}
+
+bool cpu_placed(void)
+{
+	return n_cpus > 0;
+}
+
+/* is there a CPU besides the main loop's, for it to spin without starving? */
+bool cpu_spare(void)
+{
+	if (n_cpus)
+		return n_cpus > 1;
+
+	return sysconf(_SC_NPROCESSORS_ONLN) > 1;
+}
@@ -18,6 +18,7 @@
  *
  */
 
+#include <stddef.h>
 #include <string.h>
 #include <time.h>
 #include <glib.h>
@@ -26,12 +27,94 @@
 enum {
 	MSG_CACHE_EXPIRE		= 60,
 
-	MSG_CACHE_EXPIRE_WAIT		= 20,
+	/* refresh-ahead: rebuild hot entries this close to expiry */
+	MSG_CACHE_REFRESH		= 10,
+	MSG_CACHE_HOT			= 8,	/* hits to count as hot */
+
+	/* serve an entry this long past expiry while it is rebuilt */
+	MSG_CACHE_STALE			= 10,
+
+	MSG_CACHE_BUCKETS		= 1024,	/* initial; power of two */
+
+	/* an ECS option: code, length, family, two prefixes, address */
+	ECS_HDR				= 8,
+	ECS_OPT_MAX			= ECS_HDR + 16,
+	ECS_SCOPE_OFF			= 7,
+
+	VIEW_REQ_MAX			= 65535 + 2, /* request and view */
+};
+
+/* a requester's ECS option, echoed back with our scope (RFC 7871) */
+struct dns_ecs {
+	unsigned int		len;		/* 0 if none */
+	unsigned int		scope;		/* if the answer is by view */
+	unsigned char		opt[ECS_OPT_MAX];
+};
+
+/*
+ * A request, as looked up.  With --views, that is a copy minus any
+ * ECS option, followed by the requester's view in two bytes: its
+ * cache key is the copy alone for answers that are the same in every
+ * view, and the copy with the view for those that are not.
+ */
+struct dns_client {
+	const char		*req;
+	unsigned int		req_len;	/* without the view */
+	bool			keyed;		/* view follows req */
+	bool			formerr;	/* malformed ECS option */
+	unsigned int		view;
+	struct dns_ecs		ecs;
+};
+
+struct dns_waiter {
+	dns_done_fn		done;
+	void			*data;
+	char			id[2];		/* requester's message id */
+	struct dns_ecs		ecs;
+};
+
+/*
+ * A request handed to the backend.  Identical requests arriving while
+ * it is in flight wait on the same job rather than query again.
+ */
+struct dns_job {
+	unsigned long		hash;
+	char			*key;		/* request, minus msg id */
+	unsigned int		key_len;
+	bool			keyed;		/* key ends in a view */
+	bool			pending;	/* listed in msg_pending */
+	bool			stale;		/* data changed meanwhile */
+	char			*name;		/* question name, if any */
+	GList			*name_link;	/* in the by-name index */
+
+	struct dnsres		*old;		/* cache entry being refreshed */
+	GList			*waiters;
 };
 
-static GQueue		*msg_expire_q;
-static GHashTable	*msg_cache;
-static time_t		current_time;
+static struct dnsres	**msg_cache;	/* buckets, chained on mc_next */
+static unsigned long	msg_cache_mask;	/* bucket count - 1 */
+static unsigned long	msg_cache_count;
+static GHashTable	*msg_pending;	/* hash -> dns_job */
+
+/*
+ * Cache entries, and jobs in flight, by question name, so that a
+ * dynamic update can drop exactly the answers it changes.  Answers
+ * hold the records at the question name alone, apart from the zone
+ * SOA in negative answers.
+ */
+struct msg_name {
+	GList			*entries;	/* of dnsres */
+	GList			*jobs;		/* of dns_job */
+};
+
+static GHashTable	*msg_names;	/* name -> msg_name */
+
+static struct dnsres *dns_parse(const char *buf, unsigned int buflen,
+				bool *lookup);
+static void dns_job_submit(struct dns_job *job, struct dnsres *res);
+static void msg_cache_refresh(struct dnsres *old);
+static void dns_push_bytes(struct dnsres *res, const void *buf,
+			   unsigned int buflen);
 
 
 /* "djb2"-derived hash function */
@@ -50,51 +133,289 @@ static unsigned long blob_hash(unsigned long hash, const void *_buf, size_t bufl
 	return hash;
 }
 
-static void msg_cache_expire(void)
+static time_t msg_cache_deadline(const struct dnsres *res)
+{
+	/* entries being rebuilt may be served a little past expiry */
+	return res->mc_expire + (res->refreshing ? MSG_CACHE_STALE : 0);
+}
+
+/*
+ * The message cache is a plain chained hash table rather than a
+ * GHashTable, so that a batch of lookups can prefetch its buckets
+ * and entries ahead of use.  It holds one reference to each entry.
+ */
+static struct dnsres **msg_cache_bucket(unsigned long hash)
+{
+	return &msg_cache[hash & msg_cache_mask];
+}
+
+/* keys ending in a view only match entries made for a view */
+static struct dnsres *msg_cache_find(unsigned long hash, const char *key,
+				     unsigned int key_len, bool keyed)
 {
 	struct dnsres *res;
 
-	while (1) {
-		res = g_queue_peek_head(msg_expire_q);
-		if (!res)
-			return;
-		if (current_time < res->mc_expire)
+	for (res = *msg_cache_bucket(hash); res; res = res->mc_next)
+		if (res->hash == hash && res->key_len == key_len &&
+		    res->view_scoped == keyed &&
+		    !memcmp(res->key, key, key_len))
+			return res;
+
+	return NULL;
+}
+
+/* first question name, "" for the root; NULL if none */
+static const char *dnsres_qname(const struct dnsres *res)
+{
+	const struct dnsq *q;
+
+	if (!res->queries)
+		return NULL;
+
+	q = res->queries->data;
+	return q->name ? q->name : "";
+}
+
+static struct msg_name *msg_name_get(const char *name)
+{
+	struct msg_name *mn = g_hash_table_lookup(msg_names, name);
+
+	if (!mn) {
+		mn = g_slice_new0(struct msg_name);
+		g_assert(mn != NULL);
+		g_hash_table_insert(msg_names, g_strdup(name), mn);
+	}
+
+	return mn;
+}
+
+/* remove 'link' from the entries or jobs of 'name' */
+static void msg_name_del(const char *name, GList *link, bool job)
+{
+	struct msg_name *mn = g_hash_table_lookup(msg_names, name);
+
+	g_assert(mn != NULL);
+
+	if (job)
+		mn->jobs = g_list_delete_link(mn->jobs, link);
+	else
+		mn->entries = g_list_delete_link(mn->entries, link);
+
+	if (!mn->entries && !mn->jobs)
+		g_hash_table_remove(msg_names, name);
+}
+
+static void msg_name_free(gpointer data)
+{
+	g_slice_free(struct msg_name, data);
+}
+
+/* drop 'res' from the table, if it is still there */
+static void msg_cache_unlink(struct dnsres *res)
+{
+	struct dnsres **link;
+
+	for (link = msg_cache_bucket(res->hash); *link;
+	     link = &(*link)->mc_next)
+		if (*link == res) {
+			*link = res->mc_next;
+			res->mc_next = NULL;
+			msg_cache_count--;
+			timer_del(&res->mc_timer);
+			if (res->mc_name_link) {
+				msg_name_del(dnsres_qname(res),
+					     res->mc_name_link, false);
+				res->mc_name_link = NULL;
+			}
+			dnsres_unref(res);
 			return;
+		}
+}
+
+static void msg_cache_grow(void)
+{
+	struct dnsres **old = msg_cache, *res, *next;
+	unsigned long i, n_old = msg_cache_mask + 1;
+
+	msg_cache_mask = (n_old << 1) - 1;
+	msg_cache = g_new0(struct dnsres *, msg_cache_mask + 1);
+	g_assert(msg_cache != NULL);
+
+	for (i = 0; i < n_old; i++)
+		for (res = old[i]; res; res = next) {
+			struct dnsres **bucket = msg_cache_bucket(res->hash);
+
+			next = res->mc_next;
+			res->mc_next = *bucket;
+			*bucket = res;
+		}
 
-		g_queue_pop_head(msg_expire_q);
-		g_hash_table_remove(msg_cache, (gpointer) res->hash);
+	g_free(old);
+}
+
+/*
+ * An entry's timer first fires MSG_CACHE_REFRESH before it expires,
+ * to rebuild it if it is hot, then again at its deadline to drop it.
+ */
+static void msg_cache_timer(struct timer *t, void *data)
+{
+	struct dnsres *res = data;
+	time_t deadline = msg_cache_deadline(res);
+
+	if (clock_now >= deadline) {
+		msg_cache_unlink(res);
+		return;
 	}
+
+	if (!res->refreshing && res->n_hits >= MSG_CACHE_HOT)
+		msg_cache_refresh(res);
+
+	timer_add(t, (msg_cache_deadline(res) - clock_now) * 1000);
 }
 
-static struct dnsres *msg_cache_lookup(const char *buf, unsigned int buflen,
-				       bool *expired, unsigned long *hash_out)
+static unsigned long msg_cache_hash(const char *key, unsigned int key_len)
 {
-	struct dnsres *res;
 	unsigned long hash;
 
-	*expired = false;
+	hash = blob_hash(BLOB_HASH_INIT, key, key_len);
+	return blob_hash(hash, &key_len, sizeof(key_len));
+}
 
-	hash = blob_hash(BLOB_HASH_INIT, buf, buflen);
-	hash = blob_hash(hash, &buflen, sizeof(buflen));
-	*hash_out = hash;
+static void msg_cache_add(unsigned long hash, const char *key,
+			  unsigned int key_len, struct dnsres *res,
+			  unsigned int ttl)
+{
+	struct dnsres **bucket, *old;
+	struct msg_name *mn;
+	const char *name;
+
+	res->mc_expire = clock_now + ttl;
+	res->hash = hash;
+	res->key = g_memdup(key, key_len);
+	res->key_len = key_len;
+
+	/* a rebuilt entry replaces the one it was rebuilt from */
+	old = msg_cache_find(hash, key, key_len, res->view_scoped);
+	if (old)
+		msg_cache_unlink(old);
+
+	bucket = msg_cache_bucket(hash);
+	res->mc_next = *bucket;
+	*bucket = dnsres_ref(res);
+	msg_cache_count++;
+
+	if (msg_cache_count > msg_cache_mask)
+		msg_cache_grow();
+
+	name = dnsres_qname(res);
+	if (name) {
+		mn = msg_name_get(name);
+		mn->entries = g_list_prepend(mn->entries, res);
+		res->mc_name_link = mn->entries;
+	}
 
-	res = g_hash_table_lookup(msg_cache, (gpointer) hash);
-	if (!res)
-		return NULL;
+	timer_setup(&res->mc_timer, msg_cache_timer, res);
+	timer_add(&res->mc_timer, (ttl > MSG_CACHE_REFRESH ?
+				   ttl - MSG_CACHE_REFRESH : ttl) * 1000);
+}
 
-	if (current_time < res->mc_expire)
-		return res;
+static struct dns_job *dns_job_new(unsigned long hash, const char *key,
+				   unsigned int key_len)
+{
+	struct dns_job *job = g_slice_new0(struct dns_job);
+	g_assert(job != NULL);
 
-	msg_cache_expire();
-	*expired = true;
-	return NULL;
+	job->hash = hash;
+	job->key = g_memdup(key, key_len);
+	job->key_len = key_len;
+
+	return job;
 }
 
-static void msg_cache_add(unsigned long hash, struct dnsres *res)
+static void dns_job_wait(struct dns_job *job, dns_done_fn done, void *data,
+			 const char *id, const struct dns_ecs *ecs)
 {
-	g_hash_table_insert(msg_cache, (gpointer) hash, res);
-	g_queue_push_tail(msg_expire_q, res);
+	struct dns_waiter *w = g_slice_new(struct dns_waiter);
+	g_assert(w != NULL);
+
+	w->done = done;
+	w->data = data;
+	memcpy(w->id, id, 2);
+	w->ecs = *ecs;
 
+	job->waiters = g_list_append(job->waiters, w);
+}
+
+static void dns_job_free(struct dns_job *job)
+{
+	g_list_free(job->waiters);
+	g_free(job->name);
+	g_free(job->key);
+	g_slice_free(struct dns_job, job);
+}
+
+/*
+ * Rebuild a hot entry that is about to expire.  It stays in the cache,
+ * and may be served a little past expiry, until the new answer is in.
+ */
+static void msg_cache_refresh(struct dnsres *old)
+{
+	const unsigned char *view = NULL;
+	unsigned int req_len = old->key_len;
+	struct dns_job *job;
+	struct dnsres *res;
+	char *buf;
+	bool lookup;
+
+	/* the key of an answer by view ends in the view */
+	if (old->view_scoped) {
+		req_len -= 2;
+		view = (const unsigned char *) old->key + req_len;
+	}
+
+	/* rebuild from the stored request, with a zero id */
+	buf = g_malloc0(req_len + 2);
+	memcpy(buf + 2, old->key, req_len);
+	res = dns_parse(buf, req_len + 2, &lookup);
+	g_free(buf);
+
+	if (!res || !lookup) {
+		if (res)
+			dnsres_unref(res);
+		return;
+	}
+
+	if (view)
+		res->view = (view[0] << 8) | view[1];
+
+	old->refreshing = true;
+
+	job = dns_job_new(old->hash, old->key, old->key_len);
+	job->keyed = old->view_scoped;
+	job->old = dnsres_ref(old);
+	dns_job_submit(job, res);
+}
+
+/*
+ * The cache is keyed on the whole request minus its message id, so
+ * that clients using different ids share entries.  The stored key is
+ * compared in full, so a hash collision is only ever a miss.
+ */
+static struct dnsres *msg_cache_lookup(const char *key, unsigned int key_len,
+				       unsigned long hash, bool keyed)
+{
+	struct dnsres *res;
+
+	res = msg_cache_find(hash, key, key_len, keyed);
+	if (!res)
+		return NULL;
+
+	/* expired, but its timer has yet to run */
+	if (clock_now >= msg_cache_deadline(res))
+		return NULL;
+
+	res->n_hits++;
+	return res;
 }
 
 void dns_set_rcode(struct dnsres *res, unsigned int code)
@@ -105,15 +426,78 @@ void dns_set_rcode(struct dnsres *res, unsigned int code)
 	hdr->opts[1] = code & 0x0f;
 }
 
-static void dns_finalize(struct dnsres *res)
+/* our OPT pseudo-RR, answering one in the request (RFC 6891) */
+static void dns_opt_rr(const struct dnsres *res, unsigned char *out)
+{
+	uint32_t ttl;
+	uint16_t tmp;
+
+	out[0] = 0;				/* root */
+
+	tmp = g_htons(qtype_opt);
+	memcpy(out + 1, &tmp, 2);
+
+	tmp = g_htons(edns_udp_size);
+	memcpy(out + 3, &tmp, 2);
+
+	ttl = g_htonl((res->ext_rcode << 24) |
+		      (res->dnssec_ok ? edns_do : 0));
+	memcpy(out + 5, &ttl, 4);
+
+	out[9] = out[10] = 0;			/* no options */
+}
+
+/* fill in section counts, and add our OPT record; called once */
+void dns_finalize(struct dnsres *res)
 {
 	struct dns_msg_hdr *hdr;
 
+	if (res->edns) {
+		unsigned char opt[edns_opt_len];
+
+		dns_opt_rr(res, opt);
+		dns_push_bytes(res, opt, sizeof(opt));
+		res->n_add++;
+	}
+
 	hdr = (struct dns_msg_hdr *) res->buf;
 	hdr->n_ans = g_htons(res->n_answers);
+	hdr->n_auth = g_htons(res->n_auth);
+	hdr->n_add = g_htons(res->n_add);
 	hdr->opts[0] |= hdr_auth;
 }
 
+/*
+ * Copy the header and question of 'res' into 'buf', with the TC bit
+ * set and no records but our OPT, telling the client to retry over
+ * TCP.
+ */
+unsigned int dns_truncate(const struct dnsres *res, char *buf,
+			  unsigned int buflen)
+{
+	struct dns_msg_hdr *hdr;
+	unsigned int len = res->hdrq_len;
+
+	if ((len + edns_opt_len) > buflen)
+		return 0;
+
+	memcpy(buf, res->buf, len);
+
+	hdr = (struct dns_msg_hdr *) buf;
+	hdr->opts[0] |= hdr_trunc;
+	hdr->n_ans = 0;
+	hdr->n_auth = 0;
+	hdr->n_add = 0;
+
+	if (res->edns) {
+		dns_opt_rr(res, (unsigned char *) buf + len);
+		len += edns_opt_len;
+		hdr->n_add = g_htons(1);
+	}
+
+	return len;
+}
+
 static void dns_res_grow(struct dnsres *res, unsigned int buflen)
 {
 	size_t new_size = res->alloc_len;
@@ -141,37 +525,119 @@ static void dns_push_bytes(struct dnsres *res, const void *buf,
 	res->buflen += buflen;
 }
 
-void dns_push_rr(struct dnsres *res, const struct backend_rr *rr)
+/* compare dotted name against a wire-format name already in the message */
+static bool comp_name_eq(const struct dnsres *res, unsigned int off,
+			 const unsigned char *name, size_t name_len)
 {
-	const unsigned char *s, *accum;
-	size_t accum_len;
-	uint32_t ttl;
-	uint16_t tmp;
+	const unsigned char *buf = (const unsigned char *) res->buf;
+	unsigned int hops = 0;
+
+	while (off < res->buflen) {
+		unsigned int label_len = buf[off];
+
+		/* follow compression pointer */
+		if ((label_len & 0xc0) == 0xc0) {
+			if ((off + 1) >= res->buflen || ++hops > max_comp_names)
+				return false;
+			off = ((label_len & 0x3f) << 8) | buf[off + 1];
+			continue;
+		}
+
+		if (label_len == 0)
+			return name_len == 0;
+
+		off++;
+		if (label_len > name_len || (off + label_len) > res->buflen)
+			return false;
+		if (g_ascii_strncasecmp((const char *) buf + off,
+					(const char *) name, label_len))
+			return false;
+
+		off += label_len;
+		name += label_len;
+		name_len -= label_len;
+
+		if (name_len) {
+			if (*name != '.')
+				return false;
+			name++;
+			name_len--;
+		}
+	}
+
+	return false;
+}
+
+static void comp_add(struct dnsres *res, unsigned int off)
+{
+	/* pointers are limited to 14 bits */
+	if (res->n_comp < max_comp_names && off < 0x4000)
+		res->comp[res->n_comp++] = off;
+}
+
+/* note the label offsets of the wire-format name at 'off' */
+static void comp_add_wire(struct dnsres *res, unsigned int off)
+{
+	const unsigned char *buf = (const unsigned char *) res->buf;
+
+	while (off < res->buflen) {
+		unsigned int label_len = buf[off];
+
+		if (label_len == 0 || (label_len & 0xc0))
+			break;
+
+		comp_add(res, off);
+		off += label_len + 1;
+	}
+}
+
+static void dns_push_name(struct dnsres *res, const unsigned char *name)
+{
+	size_t len = strlen((const char *) name);
 	uint8_t zero8 = 0;
 
-	accum_len = 0;
-	accum = s = rr->domain;
-	while (1) {
-		if (*s == '.' || *s == 0) {
-			if (accum_len) {
-				uint8_t len = accum_len;
-				g_assert(len <= 63);
-				dns_push_bytes(res, &len, 1);
-				dns_push_bytes(res, accum, accum_len);
+	while (len > 0) {
+		const unsigned char *dot;
+		size_t label_len;
+		unsigned int i;
+
+		/* emit pointer to the longest suffix already present */
+		for (i = 0; i < res->n_comp; i++)
+			if (comp_name_eq(res, res->comp[i], name, len)) {
+				uint16_t ptr = g_htons(0xc000 | res->comp[i]);
+				dns_push_bytes(res, &ptr, 2);
+				return;
 			}
 
-			if (*s == 0)
-				break;
+		dot = memchr(name, '.', len);
+		label_len = dot ? (size_t) (dot - name) : len;
+
+		if (label_len) {
+			uint8_t len8 = label_len;
+			g_assert(label_len <= max_label_len);
+
+			comp_add(res, res->buflen);
+			dns_push_bytes(res, &len8, 1);
+			dns_push_bytes(res, name, label_len);
+		}
 
-			accum = s + 1;
-			accum_len = 0;
-		} else
-			accum_len++;
+		if (!dot)
+			break;
 
-		s++;
+		name = dot + 1;
+		len -= label_len + 1;
 	}
 
 	dns_push_bytes(res, &zero8, 1);
+}
+
+void dns_push_rr_sect(struct dnsres *res, const struct backend_rr *rr,
+		      enum dns_section sect)
+{
+	uint32_t ttl;
+	uint16_t tmp;
+
+	dns_push_name(res, rr->domain);
 
 	tmp = g_htons(rr->type);
 	dns_push_bytes(res, &tmp, 2);
@@ -186,7 +652,25 @@ void dns_push_rr(struct dnsres *res, const struct backend_rr *rr)
 	dns_push_bytes(res, &tmp, 2);
 	dns_push_bytes(res, rr->rdata, rr->rdata_len);
 
-	res->n_answers++;
+	/* sections must be filled in order */
+	switch (sect) {
+	case sect_answer:
+		g_assert(res->n_auth == 0 && res->n_add == 0);
+		res->n_answers++;
+		break;
+	case sect_auth:
+		g_assert(res->n_add == 0);
+		res->n_auth++;
+		break;
+	case sect_add:
+		res->n_add++;
+		break;
+	}
+}
+
+void dns_push_rr(struct dnsres *res, const struct backend_rr *rr)
+{
+	dns_push_rr_sect(res, rr, sect_answer);
 }
 
 static void list_free_ent(void *data, void *user_data)
@@ -206,6 +690,8 @@ static void dnsres_free_q(void *data, void *user_data)
 
 static void dnsres_free(struct dnsres *res)
 {
+	g_free(res->key);
+	g_free(res->update);
 	g_list_foreach(res->queries, dnsres_free_q, NULL);
 	g_list_free(res->queries);
 	g_slice_free1(res->alloc_len, res->buf);
@@ -229,6 +715,35 @@ static struct dnsres *dnsres_alloc(void)
 	return res;
 }
 
+/* new response carrying a copy of the header + question of 'tmpl' */
+struct dnsres *dnsres_clone_hdrq(const struct dnsres *tmpl)
+{
+	struct dnsres *res = dnsres_alloc();
+	g_assert(res != NULL);
+
+	res->alloc_len = MAX(1024, tmpl->hdrq_len);
+	res->buf = g_slice_alloc(res->alloc_len);
+	g_assert(res->buf != NULL);
+
+	memcpy(res->buf, tmpl->buf, tmpl->hdrq_len);
+	res->buflen = res->hdrq_len = tmpl->hdrq_len;
+
+	comp_add_wire(res, sizeof(struct dns_msg_hdr));
+
+	return res;
+}
+
+static bool dns_xfr_query(const struct dnsres *res)
+{
+	const struct dnsq *q;
+
+	if (!res->queries || res->queries->next)
+		return false;
+
+	q = res->queries->data;
+	return q->type == qtype_axfr || q->type == qtype_ixfr;
+}
+
 static void dnsq_append_label(struct dnsq *q, const char *buf, unsigned int buflen)
 {
 	char *label;
@@ -429,40 +944,226 @@ err_out:
 	goto out;
 }
 
-struct dnsres *dns_message(const char *buf, unsigned int buflen)
+/* offset past the name at 'off': labels, ending in a zero or a pointer */
+static unsigned int dns_skip_name(const unsigned char *p, unsigned int off,
+				  unsigned int len)
+{
+	while (1) {
+		if (off >= len)
+			return 0;
+		if (p[off] == 0)
+			return off + 1;
+		if ((p[off] & 0xc0) == 0xc0)
+			return off + 2;
+		if (p[off] & 0xc0)
+			return 0;
+		off += p[off] + 1;
+	}
+}
+
+/*
+ * Look for an OPT record among the additional records of a request
+ * (RFC 6891), the records starting at 'off'.  Returns the offset of
+ * its type field, or 0 if there is none or the records cannot be
+ * walked.
+ */
+static unsigned int dns_find_opt(const struct dns_msg_hdr *hdr,
+				 const char *msg, unsigned int msg_len,
+				 unsigned int off)
+{
+	const unsigned char *p = (const unsigned char *) msg;
+	unsigned int n_add = g_ntohs(hdr->n_add);
+	unsigned int n_rr = g_ntohs(hdr->n_ans) + g_ntohs(hdr->n_auth) + n_add;
+	unsigned int i, rr;
+
+	for (i = 0; i < n_rr; i++) {
+		uint16_t type, rdlen;
+
+		off = dns_skip_name(p, off, msg_len);
+		if (!off || (off + 10) > msg_len)
+			return 0;
+
+		memcpy(&type, p + off, 2);
+		memcpy(&rdlen, p + off + 8, 2);
+		rr = off;
+		off += 10 + g_ntohs(rdlen);
+
+		if (i >= (n_rr - n_add) && g_ntohs(type) == qtype_opt)
+			return rr;
+	}
+
+	return 0;
+}
+
+/* records we cannot walk are ignored, as before EDNS */
+static void dns_parse_edns(struct dnsres *res, const struct dns_msg_hdr *hdr,
+			   const char *msg, unsigned int msg_len)
+{
+	unsigned int off = dns_find_opt(hdr, msg, msg_len, res->hdrq_len);
+	uint16_t class;
+	uint32_t ttl;
+
+	if (!off)
+		return;
+
+	memcpy(&class, msg + off + 2, 2);
+	memcpy(&ttl, msg + off + 4, 4);
+	ttl = g_ntohl(ttl);
+
+	res->edns = true;
+	res->udp_size = g_ntohs(class);
+	res->dnssec_ok = (ttl & edns_do) != 0;
+
+	/* we only speak EDNS version 0 */
+	if ((ttl >> 16) & 0xff)
+		res->ext_rcode = rcode_badvers >> 4;
+}
+
+/*
+ * The ECS option in the OPT record at 'opt' (RFC 7871, 6): its offset,
+ * and in *len its length.  0 if none, -1 if it is malformed: an
+ * unknown family, a length wrong for it, a SCOPE PREFIX-LENGTH set,
+ * or address bits past SOURCE PREFIX-LENGTH.
+ */
+static int dns_find_ecs(const unsigned char *p, unsigned int opt,
+			unsigned int msg_len, unsigned int *len)
+{
+	unsigned int off = opt + 10, end, code, olen, family, src;
+
+	end = off + ((p[opt + 8] << 8) | p[opt + 9]);
+	if (end > msg_len)
+		return 0;
+
+	for (; off + 4 <= end; off += 4 + olen) {
+		code = (p[off] << 8) | p[off + 1];
+		olen = (p[off + 2] << 8) | p[off + 3];
+		if (off + 4 + olen > end)
+			return 0;
+		if (code != edns_opt_ecs)
+			continue;
+
+		if (olen < ECS_HDR - 4)
+			return -1;
+
+		family = (p[off + 4] << 8) | p[off + 5];
+		src = p[off + 6];
+		if ((family != 1 || src > 32) && (family != 2 || src > 128))
+			return -1;
+
+		/* just the prefix bits, and no scope: we set that */
+		if (olen != ECS_HDR - 4 + (src + 7) / 8 ||
+		    p[off + ECS_SCOPE_OFF] ||
+		    ((src % 8) && (p[off + 3 + olen] & (0xff >> (src % 8)))))
+			return -1;
+
+		*len = 4 + olen;
+		return off;
+	}
+
+	return 0;
+}
+
+/*
+ * Find the requester's view, and copy the request into 'buf' for
+ * lookup, minus any ECS option; the option is kept to echo back.
+ * The view is that of the ECS address, if there is one, or else of
+ * the requester's own.  A malformed option gets FORMERR (RFC 7871,
+ * 7.1.1).  Without --views, the request is looked up as it is, and
+ * ECS ignored.
+ */
+static void dns_client_init(struct dns_client *cl, const char *msg,
+			    unsigned int msg_len, const unsigned char *addr,
+			    unsigned int addr_len, char *buf)
+{
+	const struct dns_msg_hdr *hdr = (const struct dns_msg_hdr *) msg;
+	const unsigned char *p = (const unsigned char *) msg;
+	unsigned int off = sizeof(*hdr), opt = 0, ecs_len = 0;
+	unsigned int i, n_q = g_ntohs(hdr->n_q), scope = 0;
+	int ecs = 0;
+
+	cl->req = msg;
+	cl->req_len = msg_len;
+	cl->keyed = false;
+	cl->formerr = false;
+	cl->view = 0;
+	cl->ecs.len = 0;
+
+	if (!views_fn[0])
+		return;
+
+	for (i = 0; i < n_q && off; i++) {
+		off = dns_skip_name(p, off, msg_len);
+		if (off && (off += 4) > msg_len)
+			off = 0;
+	}
+	if (off)
+		opt = dns_find_opt(hdr, msg, msg_len, off);
+	if (opt)
+		ecs = dns_find_ecs(p, opt, msg_len, &ecs_len);
+
+	if (ecs < 0) {
+		cl->formerr = true;
+		return;
+	}
+
+	if (ecs) {
+		const unsigned char *o = p + ecs;
+		unsigned char ecs_addr[16];
+		unsigned int rdlen;
+
+		srvstat.ecs_q++;
+
+		memcpy(buf, msg, ecs);
+		memcpy(buf + ecs, msg + ecs + ecs_len, msg_len - ecs - ecs_len);
+		cl->req_len = msg_len - ecs_len;
+
+		rdlen = ((p[opt + 8] << 8) | p[opt + 9]) - ecs_len;
+		buf[opt + 8] = rdlen >> 8;
+		buf[opt + 9] = rdlen;
+
+		/* SOURCE PREFIX-LENGTH 0: an answer for everyone */
+		memset(ecs_addr, 0, sizeof(ecs_addr));
+		memcpy(ecs_addr, o + ECS_HDR, ecs_len - ECS_HDR);
+		if (o[6])
+			cl->view = view_lookup(ecs_addr, o[5] == 1 ? 4 : 16,
+					       &scope);
+
+		cl->ecs.len = ecs_len;
+		cl->ecs.scope = scope;
+		memcpy(cl->ecs.opt, o, ecs_len);
+	} else {
+		memcpy(buf, msg, msg_len);
+		cl->view = view_lookup(addr, addr_len, &scope);
+	}
+
+	cl->req = buf;
+	buf[cl->req_len] = cl->view >> 8;
+	buf[cl->req_len + 1] = cl->view;
+	cl->keyed = true;
+}
+
+/*
+ * Parse a request and start its response.  *lookup is set if the
+ * answer must still be fetched from the backend.  Returns NULL if the
+ * request gets no response at all.
+ */
+static struct dnsres *dns_parse(const char *buf, unsigned int buflen,
+				bool *lookup)
 {
 	const struct dns_msg_hdr *hdr;
 	struct dns_msg_hdr *ohdr;
 	struct dnsres *res;
 	char *obuf;
 	unsigned int opcode;
-	unsigned long hash;
 	int rc;
-	bool expired;
-	static time_t next_expire;
-
-	current_time = time(NULL);
 
-	/* look up raw bytes in message cache */
-	res = msg_cache_lookup(buf, buflen, &expired, &hash);
-	if (res) {
-		srvstat.mc_hit++;
-		return dnsres_ref(res);
-	}
-
-	srvstat.mc_miss++;
+	*lookup = false;
 
 	/* allocate result struct */
 	res = dnsres_alloc();
 	if (!res)
 		return NULL;
 
-	res->mc_expire = current_time + MSG_CACHE_EXPIRE;
-
-	/* bail, if packet smaller than dns header */
-	if (buflen < sizeof(*hdr))
-		goto err_out;
-
 	hdr = (const struct dns_msg_hdr *) buf;
 
 	/* if this is a response packet, just return NULL (no resp to client) */
@@ -474,6 +1175,8 @@ struct dnsres *dns_message(const char *buf, unsigned int buflen)
 	if (rc != 0)			/* invalid input */
 		goto err_out;
 
+	dns_parse_edns(res, hdr, buf, buflen);
+
 	/* allocate output buffer */
 	res->alloc_len = MAX(1024, buflen);
 	obuf = res->buf = g_slice_alloc(res->alloc_len);
@@ -493,13 +1196,26 @@ struct dnsres *dns_message(const char *buf, unsigned int buflen)
 	ohdr->n_auth = 0;
 	ohdr->n_add = 0;
 
+	/* question name is the first compression target */
+	comp_add_wire(res, sizeof(*ohdr));
+
 	opcode = (hdr->opts[0] & hdr_opcode_mask) >> hdr_opcode_shift;
 	switch (opcode) {
 		case op_query:
-			g_list_foreach(res->queries,
-				       (GFunc) backend_query, res);
-			if (res->query_rc != 0)		/* query failed */
-				goto err_out;
+			/* zone transfers are streamed by the TCP code */
+			if (dns_xfr_query(res))
+				res->xfr = true;
+			else if (!res->ext_rcode)	/* BADVERS */
+				*lookup = true;
+			break;
+
+		case op_update:
+			/* for update.c, where the transport allows it */
+			dns_set_rcode(res, rcode_notimpl);
+			if (!res->ext_rcode) {
+				res->update = g_memdup(buf, buflen);
+				res->update_len = buflen;
+			}
 			break;
 
 		default:
@@ -507,29 +1223,455 @@ struct dnsres *dns_message(const char *buf, unsigned int buflen)
 			break;
 	}
 
+	return res;
+
+err_out:
+	dnsres_unref(res);
+	return NULL;
+}
+
+static void dns_job_submit(struct dns_job *job, struct dnsres *res)
+{
+	const char *name = dnsres_qname(res);
+	struct msg_name *mn;
+
+	/* on a hash collision, the later job simply is not shared */
+	if (!g_hash_table_lookup(msg_pending, (gpointer) job->hash)) {
+		g_hash_table_insert(msg_pending, (gpointer) job->hash, job);
+		job->pending = true;
+	}
+
+	if (name) {
+		job->name = g_strdup(name);
+		mn = msg_name_get(name);
+		mn->jobs = g_list_prepend(mn->jobs, job);
+		job->name_link = mn->jobs;
+	}
+
+	backend_submit(res, job);
+}
+
+/*
+ * Move a response built by a worker into a buffer of its own size,
+ * allocated here on the main loop.  A cached entry thus takes no
+ * more memory than it needs, and lives on the main loop's node,
+ * which is where every later hit reads it.
+ */
+static void dnsres_rehome(struct dnsres *res)
+{
+	char *buf;
+
+	buf = g_slice_alloc(res->buflen);
+	memcpy(buf, res->buf, res->buflen);
+
+	g_slice_free1(res->alloc_len, res->buf);
+	res->buf = buf;
+	res->alloc_len = res->buflen;
+}
+
+/*
+ * Hand 'res' to a requester, under its message id.  A requester's ECS
+ * option goes back in our OPT record, with the scope of the answer:
+ * its view's, or 0 if the answer is the same in every view.
+ */
+static void dns_reply(struct dnsres *res, const char *id,
+		      const struct dns_ecs *ecs, bool cache_hit,
+		      dns_done_fn done, void *data)
+{
+	static char buf[VIEW_REQ_MAX + ECS_OPT_MAX];
+	char *orig = res->buf;
+	unsigned int orig_len = res->buflen;
+	uint16_t rdlen;
+
+	memcpy(res->buf, id, 2);
+
+	if (!ecs->len || !res->edns || res->xfr ||
+	    orig_len + ecs->len > sizeof(buf)) {
+		done(res, cache_hit, data);
+		return;
+	}
+
+	/* our OPT record comes last, with no options of its own */
+	memcpy(buf, orig, orig_len);
+	memcpy(buf + orig_len, ecs->opt, ecs->len);
+	buf[orig_len + ECS_SCOPE_OFF] = res->view_scoped ? ecs->scope : 0;
+	rdlen = g_htons(ecs->len);
+	memcpy(buf + orig_len - 2, &rdlen, 2);
+
+	res->buf = buf;
+	res->buflen = orig_len + ecs->len;
+	done(res, cache_hit, data);
+	res->buf = orig;
+	res->buflen = orig_len;
+}
+
+/* backend answer for a job, back on the main loop */
+void dns_query_done(struct dnsres *res, void *data)
+{
+	struct dns_job *job = data;
+	struct dns_waiter *w;
+	GList *tmp;
+
+	if (job->pending)
+		g_hash_table_remove(msg_pending, (gpointer) job->hash);
+	if (job->name_link)
+		msg_name_del(job->name, job->name_link, true);
+
+	if (res->query_rc) {
+		/* database unreadable: answer, but do not remember it */
+		res->buflen = res->hdrq_len;
+		res->n_answers = res->n_auth = res->n_add = 0;
+		dns_set_rcode(res, rcode_servfail);
+	} else if (job->stale)
+		;	/* read before an update: answer, do not remember */
+	else if (job->keyed && !res->view_scoped)
+		/* the same in every view: one entry for them all */
+		msg_cache_add(msg_cache_hash(job->key, job->key_len - 2),
+			      job->key, job->key_len - 2, res,
+			      MSG_CACHE_EXPIRE);
+	else if (job->keyed || !res->view_scoped)
+		msg_cache_add(job->hash, job->key, job->key_len, res,
+			      MSG_CACHE_EXPIRE);
+
 	dns_finalize(res);
 
-	/* add to message cache */
-	if (!expired && (current_time > next_expire)) {
-		msg_cache_expire();
-		next_expire = current_time + MSG_CACHE_EXPIRE_WAIT;
+	if (!res->query_rc)
+		dnsres_rehome(res);
+
+	if (job->old) {
+		job->old->refreshing = false;
+		dnsres_unref(job->old);
+		if (!res->query_rc)
+			srvstat.mc_refresh++;
 	}
-	msg_cache_add(hash, dnsres_ref(res));
 
-	return res;
+	for (tmp = job->waiters; tmp; tmp = tmp->next) {
+		w = tmp->data;
+
+		dns_reply(res, w->id, &w->ecs, false, w->done, w->data);
+		g_slice_free(struct dns_waiter, w);
+	}
 
-err_out:
 	dnsres_unref(res);
-	return NULL;
+	dns_job_free(job);
+}
+
+/*
+ * Answer from the message cache, if possible: first an answer for
+ * every view, then one for the requester's.  'hash' is that of the
+ * request alone.
+ */
+static bool dns_message_cached(const struct dns_client *cl,
+			       unsigned long hash, dns_done_fn done,
+			       void *data)
+{
+	const char *key = cl->req + 2;
+	struct dnsres *res;
+
+	if (cl->formerr)
+		return false;
+
+	res = msg_cache_lookup(key, cl->req_len - 2, hash, false);
+	if (!res && cl->keyed)
+		res = msg_cache_lookup(key, cl->req_len,
+				       msg_cache_hash(key, cl->req_len), true);
+	if (!res)
+		return false;
+
+	srvstat.mc_hit++;
+
+	/* answer with the requester's message id */
+	dns_reply(res, cl->req, &cl->ecs, true, done, data);
+	return true;
+}
+
+/* the request is answered FORMERR, unless BADVERS comes first */
+static void dns_formerr(const struct dns_client *cl, dns_done_fn done,
+			void *data)
+{
+	struct dnsres *res;
+	bool lookup;
+
+	res = dns_parse(cl->req, cl->req_len, &lookup);
+	if (!res) {
+		done(NULL, false, data);
+		return;
+	}
+
+	/* nothing to stream or apply */
+	res->xfr = false;
+	g_free(res->update);
+	res->update = NULL;
+
+	if (!res->ext_rcode)
+		dns_set_rcode(res, rcode_formerr);
+	dns_finalize(res);
+	dns_reply(res, cl->req, &cl->ecs, false, done, data);
+	dnsres_unref(res);
+}
+
+static void dns_message_miss(const struct dns_client *cl,
+			     unsigned long hash, bool udp, dns_done_fn done,
+			     void *data)
+{
+	const char *key = cl->req + 2;
+	unsigned int key_len = cl->req_len - 2;
+	struct dns_msg_hdr *hdr;
+	struct dnsres *res;
+	struct dns_job *job;
+	bool lookup;
+
+	if (cl->formerr) {
+		dns_formerr(cl, done, data);
+		return;
+	}
+
+	srvstat.mc_miss++;
+
+	/* looked up for the requester's view, in case it matters */
+	if (cl->keyed) {
+		key_len += 2;
+		hash = msg_cache_hash(key, key_len);
+	}
+
+	/* the same request is already being looked up */
+	job = g_hash_table_lookup(msg_pending, (gpointer) hash);
+	if (job && job->key_len == key_len &&
+	    !memcmp(job->key, key, key_len)) {
+		dns_job_wait(job, done, data, cl->req, &cl->ecs);
+		return;
+	}
+
+	res = dns_parse(cl->req, cl->req_len, &lookup);
+	if (!res) {
+		done(NULL, false, data);
+		return;
+	}
+	if (!lookup) {
+		dns_finalize(res);
+		dns_reply(res, cl->req, &cl->ecs, false, done, data);
+		dnsres_unref(res);
+		return;
+	}
+
+	res->view = cl->view;
+
+	/* overloaded: send the client to TCP rather than queue it */
+	if (udp && load_shed()) {
+		srvstat.shed_tc++;
+
+		hdr = (struct dns_msg_hdr *) res->buf;
+		hdr->opts[0] |= hdr_trunc;
+		dns_finalize(res);
+		dns_reply(res, cl->req, &cl->ecs, false, done, data);
+		dnsres_unref(res);
+		return;
+	}
+
+	job = dns_job_new(hash, key, key_len);
+	job->keyed = cl->keyed;
+	dns_job_wait(job, done, data, cl->req, &cl->ecs);
+	dns_job_submit(job, res);
+}
+
+/*
+ * Answer a request.  Cache hits, and requests that need no lookup,
+ * are answered before this returns; anything else is answered once
+ * the backend is done with it.  'done' is called exactly once.
+ */
+void dns_message(const char *buf, unsigned int buflen,
+		 const unsigned char *addr, unsigned int addr_len,
+		 dns_done_fn done, void *data)
+{
+	static char req[VIEW_REQ_MAX];
+	struct dns_client cl;
+	unsigned long hash;
+
+	/* bail, if packet smaller than dns header */
+	if (buflen < sizeof(struct dns_msg_hdr)) {
+		done(NULL, false, data);
+		return;
+	}
+
+	dns_client_init(&cl, buf, buflen, addr, addr_len, req);
+
+	hash = msg_cache_hash(cl.req + 2, cl.req_len - 2);
+	if (!dns_message_cached(&cl, hash, done, data))
+		dns_message_miss(&cl, hash, false, done, data);
+}
+
+/*
+ * Answer a batch of requests, as dns_message() would each of them.
+ * A large cache does not fit in CPU caches, and each lookup would
+ * otherwise stall on its bucket, then its entry, then the entry's
+ * key, one request after another.  Here each of those fetches is
+ * started for the whole batch before any of them is used, so the
+ * misses overlap.  Prefetching stale pointers is harmless; the final
+ * passes look everything up again.  Cache hits are answered before
+ * any miss is parsed or queued.
+ */
+void dns_message_batch(const struct dns_msg_in *msgs, unsigned int n_msgs)
+{
+	static char reqs[dns_batch_max][VIEW_REQ_MAX];
+	struct dns_client cl[dns_batch_max];
+	unsigned long hash[dns_batch_max];
+	struct dnsres *ent[dns_batch_max];
+	bool miss[dns_batch_max];
+	unsigned int i;
+
+	g_assert(n_msgs <= dns_batch_max);
+
+	for (i = 0; i < n_msgs; i++) {
+		const struct dns_msg_in *m = &msgs[i];
+
+		if (m->buflen < sizeof(struct dns_msg_hdr))
+			continue;
+
+		dns_client_init(&cl[i], m->buf, m->buflen, m->addr,
+				m->addr_len, reqs[i]);
+		hash[i] = msg_cache_hash(cl[i].req + 2, cl[i].req_len - 2);
+		prefetch(msg_cache_bucket(hash[i]));
+	}
+
+	for (i = 0; i < n_msgs; i++) {
+		ent[i] = NULL;
+		if (msgs[i].buflen < sizeof(struct dns_msg_hdr))
+			continue;
+
+		ent[i] = *msg_cache_bucket(hash[i]);
+		if (ent[i])
+			prefetch(ent[i]);
+	}
+
+	for (i = 0; i < n_msgs; i++)
+		if (ent[i] && ent[i]->hash == hash[i]) {
+			prefetch(ent[i]->key);
+			prefetch(ent[i]->buf);
+		}
+
+	for (i = 0; i < n_msgs; i++) {
+		const struct dns_msg_in *m = &msgs[i];
+
+		miss[i] = false;
+		if (m->buflen < sizeof(struct dns_msg_hdr))
+			m->done(NULL, false, m->data);
+		else if (!dns_message_cached(&cl[i], hash[i], m->done,
+					     m->data))
+			miss[i] = true;
+	}
+
+	for (i = 0; i < n_msgs; i++) {
+		const struct dns_msg_in *m = &msgs[i];
+
+		if (miss[i])
+			dns_message_miss(&cl[i], hash[i], m->udp, m->done,
+					 m->data);
+	}
+}
+
+/*
+ * Call 'fn' for every live cache entry, with its remaining lifetime.
+ * Answers by view are left out: restored, they would be taken for
+ * answers to everyone.
+ */
+void dns_cache_foreach(dns_cache_fn fn, void *data)
+{
+	struct dnsres *res;
+	unsigned long i;
+
+	clock_update();		/* may run after the main loop has quit */
+
+	for (i = 0; i <= msg_cache_mask; i++)
+		for (res = msg_cache[i]; res; res = res->mc_next)
+			if (res->mc_expire > clock_now && !res->view_scoped)
+				fn(res, res->mc_expire - clock_now, data);
+}
+
+/*
+ * Rebuild a cache entry from its key and response, as saved by an
+ * earlier run.  The response is not checked against the database.
+ */
+struct dnsres *dns_cache_entry(const char *key, unsigned int key_len,
+			       const char *buf, unsigned int buflen)
+{
+	struct dnsres *res;
+	uint16_t n_ans;
+	char *req;
+	bool lookup;
+
+	if (buflen < sizeof(struct dns_msg_hdr))
+		return NULL;
+	if (key_len + 2 < sizeof(struct dns_msg_hdr))
+		return NULL;		/* too short to hold a header */
+
+	/* the question is parsed from the request, as for a miss */
+	req = g_malloc0(key_len + 2);
+	memcpy(req + 2, key, key_len);
+	res = dns_parse(req, key_len + 2, &lookup);
+	g_free(req);
+
+	if (!res)
+		return NULL;
+	if (!lookup || buflen < res->hdrq_len) {
+		dnsres_unref(res);
+		return NULL;
+	}
+
+	if (res->alloc_len < buflen) {
+		g_slice_free1(res->alloc_len, res->buf);
+		res->alloc_len = buflen;
+		res->buf = g_slice_alloc(res->alloc_len);
+	}
+	memcpy(res->buf, buf, buflen);
+	res->buflen = buflen;
+
+	/* saved buffers need not be aligned */
+	memcpy(&n_ans, buf + offsetof(struct dns_msg_hdr, n_ans), 2);
+	res->n_answers = g_ntohs(n_ans);
+
+	return res;
+}
+
+void dns_cache_insert(const char *key, unsigned int key_len,
+		      struct dnsres *res, unsigned int ttl,
+		      unsigned int n_hits)
+{
+	res->n_hits = n_hits;
+	msg_cache_add(msg_cache_hash(key, key_len), key, key_len, res, ttl);
+}
+
+/*
+ * Forget every answer to questions about 'name', after an update
+ * changed it.  Answers still being looked up are not cached.
+ */
+void dns_cache_invalidate(const char *name)
+{
+	struct msg_name *mn = g_hash_table_lookup(msg_names, name);
+	GList *tmp;
+
+	if (!mn)
+		return;
+
+	for (tmp = mn->jobs; tmp; tmp = tmp->next)
+		((struct dns_job *) tmp->data)->stale = true;
+
+	/* the last entry unlinked frees 'mn', unless jobs remain */
+	while ((mn = g_hash_table_lookup(msg_names, name)) && mn->entries) {
+		msg_cache_unlink(mn->entries->data);
+		srvstat.mc_invalidated++;
+	}
 }
 
 void dns_init(void)
 {
-	msg_cache = g_hash_table_new_full(g_direct_hash, g_direct_equal,
-					  NULL, (GDestroyNotify) dnsres_unref);
+	msg_cache_mask = MSG_CACHE_BUCKETS - 1;
+	msg_cache = g_new0(struct dnsres *, MSG_CACHE_BUCKETS);
 	g_assert(msg_cache != NULL);
 
-	msg_expire_q = g_queue_new();
-	g_assert(msg_expire_q != NULL);
-}
+	msg_pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+	g_assert(msg_pending != NULL);
 
+	msg_names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					  msg_name_free);
+	g_assert(msg_names != NULL);
+}
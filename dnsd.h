@@ -28,16 +28,75 @@
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+#ifdef __GNUC__
+#define prefetch(x) __builtin_prefetch(x)
+#else
+#define prefetch(x) do { } while (0)
+#endif
+
 enum {
 	max_label_len		= 63,
 	initial_name_alloc	= 512,
+	max_comp_names		= 64,
 
+	qtype_a			= 1,
+	qtype_ns		= 2,
+	qtype_cname		= 5,
+	qtype_soa		= 6,
+	qtype_hinfo		= 13,
+	qtype_aaaa		= 28,
+	qtype_opt		= 41,
+	qtype_ds		= 43,
+	qtype_rrsig		= 46,
+	qtype_nsec		= 47,
+	qtype_dnskey		= 48,
+	qtype_nsec3		= 50,
+	qtype_ixfr		= 251,
+	qtype_axfr		= 252,
+	qtype_mailb		= 253,
+	qtype_maila		= 254,
 	qtype_all		= 255,
 
+	class_none		= 254,		/* RFC 2136 */
+	class_any		= 255,
+
+	rcode_formerr		= 1,
+	rcode_servfail		= 2,
 	rcode_nxdomain		= 3,
 	rcode_notimpl		= 4,
+	rcode_refused		= 5,
+	rcode_yxdomain		= 6,		/* RFC 2136 */
+	rcode_yxrrset		= 7,
+	rcode_nxrrset		= 8,
+	rcode_notauth		= 9,
+	rcode_notzone		= 10,
+	rcode_badvers		= 16,		/* extended, EDNS only */
 
 	op_query		= 0,
+	op_update		= 5,		/* RFC 2136 */
+
+	udp_max_plain		= 512,		/* without EDNS */
+	edns_udp_size		= 1232,		/* our advertised payload */
+	edns_opt_len		= 11,		/* OPT RR, no options */
+	edns_do			= 1 << 15,	/* DNSSEC OK */
+	edns_opt_ecs		= 8,		/* Client Subnet, RFC 7871 */
+
+	dns_batch_max		= 32,		/* requests per batch */
+
+	cpu_max_nodes		= 16,		/* NUMA nodes reported */
+};
+
+/* what the name table knows about a name */
+enum name_flags {
+	name_exists		= 1 << 0,	/* listed in labels */
+	name_soa		= 1 << 1,	/* a zone apex */
+	name_nsec		= 1 << 2,
+};
+
+enum dns_section {
+	sect_answer,
+	sect_auth,
+	sect_add,
 };
 
 enum blob_hash_init_info {
@@ -56,11 +115,24 @@ struct dns_msg_hdr {
 enum dns_hdr_bits {
 	hdr_response		= 1 << 7,
 	hdr_auth		= 1 << 2,
+	hdr_trunc		= 1 << 1,
 	hdr_req_recur		= 1 << 0,
 	hdr_opcode_mask		= 0x78,
 	hdr_opcode_shift	= 3,
 };
 
+struct timer;
+typedef void (*timer_fn)(struct timer *t, void *data);
+
+/* embedded in whatever it times out; see timer.c */
+struct timer {
+	struct timer		*next;
+	struct timer		**pprev;	/* NULL unless pending */
+	unsigned long		expires;	/* in ticks */
+	timer_fn		fn;
+	void			*data;
+};
+
 struct dnsq {
 	GList			*labels;
 	unsigned int		type;
@@ -79,10 +151,34 @@ struct dnsres {
 	int			query_rc;
 
 	unsigned int		n_answers;
+	unsigned int		n_auth;
+	unsigned int		n_add;
 	unsigned int		n_refs;
 
+	bool			edns;		/* request carried OPT */
+	bool			dnssec_ok;	/* ... with the DO bit */
+	unsigned int		udp_size;	/* requester's payload size */
+	unsigned int		ext_rcode;	/* upper 8 bits of rcode */
+
 	time_t			mc_expire;		/* cache expiration time */
+	struct timer		mc_timer;	/* refresh-ahead, then expiry */
 	unsigned long		hash;		/* raw message hash */
+	struct dnsres		*mc_next;	/* cache bucket chain */
+	GList			*mc_name_link;	/* in the by-name index */
+	char			*key;		/* request, minus msg id */
+	unsigned int		key_len;
+	unsigned int		n_hits;
+	bool			refreshing;	/* queued for refresh-ahead */
+
+	bool			xfr;		/* zone transfer request */
+	char			*update;	/* UPDATE request, for update.c */
+	unsigned int		update_len;
+
+	unsigned int		view;		/* the requester's; see view.c */
+	bool			view_scoped;	/* answer differs by view */
+
+	unsigned int		n_comp;		/* name compression targets */
+	uint16_t		comp[max_comp_names];
 };
 
 struct backend_rr {
@@ -92,20 +188,190 @@ struct backend_rr {
 	int			ttl;
 	const void		*rdata;
 	unsigned int		rdata_len;
+	unsigned int		view;
 };
 
 struct dns_server_stats {
 	unsigned long		sql_q;		/* SQL queries */
 	unsigned long		udp_q;		/* UDP queries */
 	unsigned long		tcp_q;		/* TCP queries */
+	unsigned long		udp_trunc;	/* UDP answers sent as TC */
+	unsigned long		udp_drop;	/* lost to a full rcvbuf */
 	unsigned long		mc_hit;		/* msg cache hits */
 	unsigned long		mc_miss;	/* msg cache misses */
+	unsigned long		mc_refresh;	/* msg cache refresh-ahead */
+	unsigned long		xfr_out;	/* outbound zone transfers */
+	unsigned long		rrl_drop;	/* rate-limited, dropped */
+	unsigned long		rrl_slip;	/* rate-limited, sent TC */
+	unsigned long		qlog_drop;	/* query log records lost */
+	unsigned long		tls_q;		/* DNS over TLS queries */
+	unsigned long		tls_hs;		/* TLS handshakes */
+	unsigned long		tls_resumed;	/* ... of them resumed */
+	unsigned long		tls_ktls;	/* ... of them on kTLS */
+	unsigned long		shed_tc;	/* overload: sent to TCP */
+	unsigned long		tcp_idle;	/* conns closed for idleness */
+	unsigned long		ecs_q;		/* queries with Client Subnet */
+	unsigned long		update_q;	/* UPDATE requests */
+	unsigned long		update_commits;	/* ... transactions for them */
+	unsigned long		mc_invalidated;	/* entries dropped by them */
+
+	/* database work, by NUMA node of the worker that did it */
+	unsigned long		node_jobs[cpu_max_nodes];
+	unsigned long		node_pg_hit[cpu_max_nodes];  /* page cache */
+	unsigned long		node_pg_miss[cpu_max_nodes];
+};
+
+/* how a zone answers ANY */
+enum any_mode {
+	any_full,				/* every record */
+	any_one_rrset,				/* RFC 8482, 4.1 */
+	any_synth_hinfo,			/* RFC 8482, 4.2 */
+};
+
+enum rrl_action {
+	rrl_send,
+	rrl_drop,
+	rrl_slip,
+};
+
+struct _GInetAddr;
+struct backend_cursor;
+struct backend_db;
+struct backend_xfr;
+struct name_table;
+struct sqlite3;
+struct tls_conn;
+struct xfr;
+
+enum tls_event {
+	tls_ev_read,
+	tls_ev_write,
+	tls_ev_close,
+};
+
+typedef void (*backend_rr_fn)(const struct backend_rr *rr, void *data);
+
+/*
+ * A zone store.  Each thread opens its own handle; a record passed to
+ * a backend_rr_fn or filled in by xfr_next is valid only until the
+ * next call on that handle.  Lookups count the database reads they
+ * make in *n_q.  Names are in presentation form, without the final
+ * dot.  With --views, rrs() always hands out records in type order,
+ * and within a type highest view first.
+ */
+struct backend_ops {
+	const char		*name;
+
+	void			(*init)(void);
+	void			(*exit)(void);
+	struct backend_db	*(*open)(void);
+	void			(*close)(struct backend_db *db);
+
+	/* around each request on a worker; begin() < 0 fails it */
+	int			(*begin)(struct backend_db *db);
+	void			(*end)(struct backend_db *db);
+
+	/* every record at 'name', in type order if asked; -1 on error */
+	int			(*rrs)(struct backend_db *db, const char *name,
+				       bool by_type, backend_rr_fn fn,
+				       void *data, unsigned long *n_q);
+	bool			(*exists)(struct backend_db *db,
+					  const char *name, unsigned long *n_q);
+	/* closest ancestor of 'name' with an SOA: a suffix of it, or NULL */
+	const char		*(*zone)(struct backend_db *db,
+					 const char *name, unsigned long *n_q);
+	/* canonically closest owner of an NSEC before 'name', or NULL */
+	char			*(*nsec_prev)(struct backend_db *db,
+					      const char *name,
+					      unsigned long *n_q);
+	/* lowest type at 'name', DNSSEC aside; 0 if none, -1 on error */
+	int			(*any_type)(struct backend_db *db,
+					    const char *name, unsigned int class,
+					    unsigned long *n_q);
+
+	/* every zone's SOA, within a request */
+	void			(*soas)(struct backend_db *db,
+					backend_rr_fn fn, void *data,
+					unsigned long *n_q);
+
+	/*
+	 * Zone transfers, within a request: the records at and below
+	 * 'zone' in canonical order, owners after 'after' only if it
+	 * is given.  Each owner's records come out together.
+	 */
+	struct backend_cursor	*(*xfr_begin)(struct backend_db *db,
+					      const char *zone,
+					      const char *after);
+	int			(*xfr_next)(struct backend_cursor *cur,
+					    struct backend_rr *rr);
+	void			(*xfr_end)(struct backend_cursor *cur);
+
+	/* page cache hits and misses since the last call; may be NULL */
+	void			(*page_stats)(struct backend_db *db,
+					      int *hit, int *miss);
+};
+
+/* 'addr', a GInetAddr, becomes the callee's */
+typedef void (*tls_accept_fn)(struct tls_conn *tc, struct _GInetAddr *addr,
+			      void *data);
+typedef void (*tls_conn_fn)(struct tls_conn *tc, enum tls_event ev,
+			    const char *buf, unsigned int len, void *data);
+
+/* work for backend_run(): 'db' is NULL if the store cannot be read */
+typedef void (*backend_job_fn)(struct backend_db *db, void *data,
+			       unsigned long *n_q);
+typedef void (*backend_job_done_fn)(void *data);
+
+/* next zone transfer message, or NULL once the transfer is over */
+typedef void (*xfr_msg_fn)(struct dnsres *msg, void *data);
+
+/* response ready; 'res' is NULL if the request gets no answer */
+typedef void (*dns_done_fn)(struct dnsres *res, bool cache_hit, void *data);
+typedef void (*dns_cache_fn)(const struct dnsres *res, unsigned int ttl,
+			     void *data);
+
+/* one request of a batch handed to dns_message_batch() */
+struct dns_msg_in {
+	const char		*buf;
+	unsigned int		buflen;
+	bool			udp;		/* may be sent to TCP */
+	unsigned char		addr[16];	/* requester, if views are on */
+	unsigned int		addr_len;
+	dns_done_fn		done;
+	void			*data;
 };
 
 /* backend.c */
 extern void backend_init(void);
 extern void backend_exit(void);
-extern void backend_query(const struct dnsq *, struct dnsres *);
+extern void backend_submit(struct dnsres *res, void *data);
+extern unsigned int backend_pending(void);
+extern void backend_run(backend_job_fn fn, backend_job_done_fn done,
+			void *data);
+extern GHashTable *backend_zone_serials(struct backend_db *db,
+					unsigned long *n_q);
+extern struct backend_xfr *backend_xfr_new(const char *zone);
+extern int backend_xfr_open(struct backend_db *db, struct backend_xfr *xfr,
+			    struct backend_rr *soa, unsigned long *n_q);
+extern int backend_xfr_next(struct backend_xfr *, struct backend_rr *);
+extern void backend_xfr_close(struct backend_xfr *);
+extern void backend_xfr_free(struct backend_xfr *);
+extern unsigned int backend_canon_key(const char *name, char *key);
+extern bool backend_in_zone(const char *name, const char *zone);
+
+/* backend_lmdb.c */
+extern const struct backend_ops backend_lmdb;
+
+/* backend_sqlite.c */
+extern const struct backend_ops backend_sqlite;
+
+/* cpu.c */
+extern bool cpu_list_parse(const char *list);
+extern unsigned int cpu_bind_main(void);
+extern unsigned int cpu_bind_worker(unsigned int idx);
+extern void cpu_bind_any(void);
+extern bool cpu_placed(void);
+extern bool cpu_spare(void);
 
 /* dns.c */
 static inline struct dnsres *dnsres_ref(struct dnsres *res)
@@ -114,17 +380,129 @@ static inline struct dnsres *dnsres_ref(struct dnsres *res)
 	return res;
 }
 extern void dnsres_unref(struct dnsres *res);
-extern struct dnsres *dns_message(const char *buf, unsigned int buflen);
+extern void dns_message(const char *buf, unsigned int buflen,
+			const unsigned char *addr, unsigned int addr_len,
+			dns_done_fn done, void *data);
+extern void dns_message_batch(const struct dns_msg_in *msgs,
+			      unsigned int n_msgs);
+extern void dns_query_done(struct dnsres *res, void *data);
 extern void dns_push_rr(struct dnsres *res, const struct backend_rr *rr);
+extern void dns_push_rr_sect(struct dnsres *res, const struct backend_rr *rr,
+			     enum dns_section sect);
 extern void dns_set_rcode(struct dnsres *res, unsigned int code);
+extern void dns_finalize(struct dnsres *res);
+extern unsigned int dns_truncate(const struct dnsres *res, char *buf,
+				 unsigned int buflen);
+extern struct dnsres *dnsres_clone_hdrq(const struct dnsres *tmpl);
+extern void dns_cache_foreach(dns_cache_fn fn, void *data);
+extern struct dnsres *dns_cache_entry(const char *key, unsigned int key_len,
+				      const char *buf, unsigned int buflen);
+extern void dns_cache_insert(const char *key, unsigned int key_len,
+			     struct dnsres *res, unsigned int ttl,
+			     unsigned int n_hits);
+extern void dns_cache_invalidate(const char *name);
 extern void dns_init(void);
 
+/* load.c */
+extern void load_init(void);
+extern bool load_shed(void);
+extern void load_backend_time(unsigned long usec);
+
+/* names.c */
+extern void names_init(void);
+extern void names_exit(void);
+extern struct name_table *names_get(void);
+extern void names_put(struct name_table *t);
+extern bool names_lookup(const struct name_table *t, const char *name,
+			 unsigned int flags);
+extern const char *names_closest(const struct name_table *t,
+				 const char *name, unsigned int flags);
+extern char *names_prev(const struct name_table *t, const char *name,
+			unsigned int flags);
+extern void names_touch(const char *name);
+extern bool names_stale(const char *name);
+extern void names_writer_version(gint64 ver);
+
+/* qlog.c */
+extern void qlog_init(void);
+extern void qlog_exit(void);
+extern void qlog_query(const GTimeVal *start, const unsigned char *addr,
+		       unsigned int addr_len, const struct dnsres *res,
+		       bool tcp, bool cache_hit);
+
+/* rrl.c */
+extern void rrl_init(void);
+extern enum rrl_action rrl_check(const unsigned char *addr,
+				 unsigned int addr_len,
+				 const struct dnsres *res);
+
+/* snapshot.c */
+extern void snapshot_init(void);
+extern void snapshot_exit(void);
+
 /* socket.c */
 extern void init_net(void);
 
+/* timer.c */
+extern time_t clock_now;
+extern void clock_update(void);
+extern void timer_init(void);
+extern void timer_setup(struct timer *t, timer_fn fn, void *data);
+extern void timer_add(struct timer *t, unsigned int ms);
+extern void timer_del(struct timer *t);
+static inline bool timer_pending(const struct timer *t)
+{
+	return t->pprev != NULL;
+}
+
+/* tls.c */
+extern bool tls_listen(int port, tls_accept_fn fn, void *data);
+extern void tls_conn_set_callback(struct tls_conn *tc, tls_conn_fn fn,
+				  void *data);
+extern void tls_conn_readn(struct tls_conn *tc, unsigned int n);
+extern void tls_conn_write(struct tls_conn *tc, const char *buf,
+			   unsigned int len);
+extern void tls_conn_unref(struct tls_conn *tc);
+
+/* update.c */
+extern void update_init(void);
+extern void update_exit(void);
+extern void update_submit(struct dnsres *res, dns_done_fn done, void *data);
+
+/* view.c */
+extern void view_init(void);
+extern unsigned int view_lookup(const unsigned char *addr,
+				unsigned int addr_len, unsigned int *scope);
+
+/* xfr.c */
+extern struct xfr *xfr_begin(struct dnsres *query, xfr_msg_fn fn,
+			     void *data);
+extern void xfr_next(struct xfr *xfr);
+extern bool xfr_busy(const struct xfr *xfr);
+extern void xfr_end(struct xfr *xfr);
+
 /* main.c */
 extern int dns_port;
+extern unsigned int backend_workers;
+extern GList *xfr_acl;
+extern GList *update_acl;
+extern GList *minimal_any_zones;
+extern GList *any_hinfo_zones;
+extern unsigned int rrl_rate;
+extern unsigned int rrl_slip_ratio;
+extern char qlog_fn[];
+extern unsigned long qlog_max_size;
+extern char snap_fn[];
+extern char views_fn[];
+extern unsigned int snap_interval;
+extern bool shed_enabled;
+extern char tls_cert_fn[];
+extern char tls_key_fn[];
+extern int tls_port;
+extern unsigned int tcp_timeout;
+extern bool low_latency;
 extern char db_fn[];
+extern char backend_name[];
 extern struct dns_server_stats srvstat;
 
 #endif /* __DNSD_H__ */
@@ -25,9 +25,10 @@ use Net::DNS::ZoneFile::Fast;
 use DBI qw(:sql_types);
 
 my ($dbh, %dom_cache, $next_id);
+my $view = 0;
 
 sub usage() {
-	print STDERR "usage: import-zone.pl DATABASE ZONE-FILE\n";
+	print STDERR "usage: import-zone.pl DATABASE [--view N] ZONE-FILE...\n";
 	exit(1);
 }
 
@@ -51,6 +52,43 @@ sub read_max_id() {
 	}
 }
 
+# DNSSEC canonical order key (RFC 4034, 6.1): labels right to left,
+# each followed by a NUL, so that a bytewise compare gives name order.
+# dvdnsd computes the same key for query names.
+sub canon_key($) {
+	my ($name) = @_;
+
+	return join('', map { lc($_) . "\0" } reverse split(/\./, $name));
+}
+
+# add the ckey column to databases created before DNSSEC support
+sub upgrade_db() {
+	my $sth = $dbh->prepare('select ckey from labels limit 1');
+	return if ($sth);
+
+	$dbh->do('alter table labels add column ckey blob')
+		or die "add ckey column failed";
+	$dbh->do('create index labels_ckey on labels (ckey)')
+		or die "create ckey index failed";
+
+	my $names = $dbh->selectcol_arrayref('select name from labels');
+	my $uh = $dbh->prepare('update labels set ckey = ? where name = ?');
+	foreach my $name (@$names) {
+		$uh->bind_param(1, canon_key($name), SQL_BLOB);
+		$uh->bind_param(2, $name);
+		$uh->execute() or die "ckey update failed";
+	}
+}
+
+# add the view column to databases created before dvdnsd --views
+sub upgrade_db_views() {
+	my $sth = $dbh->prepare('select view from rrs limit 1');
+	return if ($sth);
+
+	$dbh->do('alter table rrs add column view integer not null default 0')
+		or die "add view column failed";
+}
+
 sub get_dom_id($) {
 	my ($domain) = @_;
 
@@ -75,6 +113,12 @@ sub import_rr($) {
 	my ($rr) = @_;
 	my ($id);
 
+	# a view overlays its zone; the zone itself is view 0's
+	if ($view && $rr->type eq 'SOA') {
+		print STDERR "skipping SOA for ", $rr->name, " in view $view\n";
+		return;
+	}
+
 	# get domain integer id, or create new one
 	$id = get_dom_id($rr->name);
 	if (!$id) {
@@ -86,12 +130,18 @@ sub import_rr($) {
 		$dom_cache{$rr->name} = $id;
 
 		# store in database
-		my $ih = $dbh->prepare('insert into labels values (?,?)');
-		$ih->execute($rr->name, $id) or die "sql insert failed";
+		my $ih = $dbh->prepare('insert into labels (name, id, ckey) ' .
+				       'values (?,?,?)');
+		$ih->bind_param(1, $rr->name);
+		$ih->bind_param(2, $id, SQL_INTEGER);
+		$ih->bind_param(3, canon_key($rr->name), SQL_BLOB);
+		$ih->execute() or die "sql insert failed";
 	}
 
 	# build RR sql insert
-	my $sth = $dbh->prepare('insert into rrs values (?,?,?,?,?)');
+	my $sth = $dbh->prepare('insert into rrs ' .
+				'(domain, type, class, ttl, rdata, view) ' .
+				'values (?,?,?,?,?,?)');
 	die "sql prep failed" unless $sth;
 
 	$sth->bind_param(1, $id, SQL_INTEGER);
@@ -99,6 +149,7 @@ sub import_rr($) {
 	$sth->bind_param(3, Net::DNS::classesbyname($rr->class), SQL_INTEGER);
 	$sth->bind_param(4, $rr->ttl, SQL_INTEGER);
 	$sth->bind_param(5, $rr->_canonicalRdata, SQL_BLOB);
+	$sth->bind_param(6, $view, SQL_INTEGER);
 
 	$sth->execute() or die "sql exec failed";
 }
@@ -128,11 +179,20 @@ $dbh->{unicode} = 1;
 die "connect($dbfn) failed: " . DBI->errstr . "\n"
 	unless $dbh;
 
+upgrade_db();
+upgrade_db_views();
 read_max_id();
 $dom_cache{""} = 0;
 
+# --view N applies to the zone files after it
 my ($zonefn);
 while ($zonefn = shift) {
+	if ($zonefn eq '--view') {
+		$view = shift;
+		usage() unless (defined($view) && $view =~ /^\d+$/ &&
+				$view <= 65535);
+		next;
+	}
 	import_zonefile($zonefn);
 }
 
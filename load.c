@@ -0,0 +1,159 @@
+/*
+ * Copyright 2006 Jeff Garzik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Overload control.
+ *
+ * Three measures are sampled every LOAD_TICK_MS on the main loop:
+ * requests outstanding at the backend, how late this very timer
+ * fires (main loop lag), and a moving average of backend latency,
+ * queueing included.  Any one of them past its high mark puts the
+ * server in overload; it recovers once all of them have stayed below
+ * their low marks for LOAD_RECOVER_MS.
+ *
+ * While overloaded, UDP requests that would add backend work are
+ * answered with TC, sending the client to TCP, instead of joining the
+ * queue (see dns.c).  Cache hits cost next to nothing, and are still
+ * answered, so the hot names keep working.  A backend queue past
+ * LOAD_QUEUE_HARD sheds at once, without waiting for the next tick.
+ */
+
+#include <syslog.h>
+#include <glib.h>
+#include "dnsd.h"
+
+enum {
+	LOAD_TICK_MS		= 100,
+	LOAD_RECOVER_MS		= 2000,
+
+	/* backend requests outstanding, per worker */
+	LOAD_QUEUE_HIGH		= 64,
+	LOAD_QUEUE_LOW		= 16,
+	LOAD_QUEUE_HARD		= 256,
+
+	LOAD_LAG_HIGH_MS	= 50,
+	LOAD_LAG_LOW_MS		= 10,
+
+	LOAD_LATENCY_HIGH_MS	= 100,
+	LOAD_LATENCY_LOW_MS	= 20,
+
+	LOAD_EWMA_SHIFT		= 3,		/* weight 1/8 per sample */
+};
+
+static bool overloaded;
+static GTimeVal last_tick;
+static unsigned long lag_ms;
+static unsigned long latency_us;		/* moving average */
+static unsigned int calm_ms;			/* below all low marks */
+static time_t overload_start;
+static unsigned long shed_start;
+
+
+static unsigned long tv_ms(const GTimeVal *a, const GTimeVal *b)
+{
+	long ms = (a->tv_sec - b->tv_sec) * 1000 +
+		  (a->tv_usec - b->tv_usec) / 1000;
+
+	return ms > 0 ? ms : 0;
+}
+
+/* a backend request took 'usec' from submission to its answer */
+void load_backend_time(unsigned long usec)
+{
+	long diff = (long) usec - (long) latency_us;
+
+	latency_us += diff / (1 << LOAD_EWMA_SHIFT);
+}
+
+static void load_enter(unsigned int queue)
+{
+	overloaded = true;
+	calm_ms = 0;
+	overload_start = time(NULL);
+	shed_start = srvstat.shed_tc;
+
+	syslog(LOG_WARNING, "overload: sending UDP cache misses to TCP "
+	       "(backend queue %u, loop lag %lu ms, backend latency %lu ms)",
+	       queue, lag_ms, latency_us / 1000);
+}
+
+static void load_leave(void)
+{
+	overloaded = false;
+
+	syslog(LOG_INFO, "overload: recovered after %lu s, "
+	       "%lu requests sent to TCP",
+	       (unsigned long) (time(NULL) - overload_start),
+	       srvstat.shed_tc - shed_start);
+}
+
+static gboolean load_tick(void *data)
+{
+	unsigned int queue = backend_pending();
+	unsigned int workers = MAX(backend_workers, 1);
+	GTimeVal now;
+
+	g_get_current_time(&now);
+	lag_ms = tv_ms(&now, &last_tick);
+	lag_ms = lag_ms > LOAD_TICK_MS ? lag_ms - LOAD_TICK_MS : 0;
+	last_tick = now;
+
+	/* an idle backend says nothing about its latency */
+	if (!queue)
+		latency_us -= latency_us >> LOAD_EWMA_SHIFT;
+
+	if (queue >= LOAD_QUEUE_HIGH * workers ||
+	    lag_ms >= LOAD_LAG_HIGH_MS ||
+	    latency_us >= LOAD_LATENCY_HIGH_MS * 1000) {
+		if (!overloaded)
+			load_enter(queue);
+		calm_ms = 0;
+		return TRUE;
+	}
+
+	if (queue < LOAD_QUEUE_LOW * workers &&
+	    lag_ms < LOAD_LAG_LOW_MS &&
+	    latency_us < LOAD_LATENCY_LOW_MS * 1000) {
+		calm_ms += LOAD_TICK_MS;
+		if (overloaded && calm_ms >= LOAD_RECOVER_MS)
+			load_leave();
+	} else
+		calm_ms = 0;
+
+	return TRUE;
+}
+
+/* should a request that needs the backend be turned away? */
+bool load_shed(void)
+{
+	if (!shed_enabled)
+		return false;
+
+	return overloaded ||
+	       backend_pending() >= LOAD_QUEUE_HARD * MAX(backend_workers, 1);
+}
+
+void load_init(void)
+{
+	if (!shed_enabled)
+		return;
+
+	g_get_current_time(&last_tick);
+	g_timeout_add(LOAD_TICK_MS, load_tick, NULL);
+}
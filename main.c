@@ -26,6 +26,7 @@
 #include <fcntl.h>
 #include <syslog.h>
 #include <errno.h>
+#include <signal.h>
 #include <string.h>
 #include <glib.h>
 #include <gnet.h>
@@ -35,10 +36,53 @@
 #define PROGRAM_NAME "dvdnsd"
 
 char db_fn[4096] = "dns.db";
+char backend_name[32] = "sqlite";
 char pid_fn[4096] = "dvdnsd.pid";
 int dns_port = 9953;
+unsigned int backend_workers = 4;
 static int foreground;
 struct dns_server_stats srvstat;
+GList *xfr_acl;
+GList *update_acl;
+GList *minimal_any_zones;
+GList *any_hinfo_zones;
+unsigned int rrl_rate;
+unsigned int rrl_slip_ratio = 2;
+char qlog_fn[4096];
+unsigned long qlog_max_size = 64 * 1024 * 1024;
+char snap_fn[4096];
+unsigned int snap_interval;
+char views_fn[4096];
+char tls_cert_fn[4096];
+char tls_key_fn[4096];
+int tls_port = 853;
+bool shed_enabled = true;
+unsigned int tcp_timeout = 30;
+bool low_latency;
+static volatile sig_atomic_t stats_requested;
+static volatile sig_atomic_t exit_requested;
+static GMainLoop *loop;
+
+enum {
+	opt_qlog_size		= 0x100,	/* long-only options */
+	opt_snap,
+	opt_snap_interval,
+	opt_cpus,
+	opt_tls_cert,
+	opt_tls_key,
+	opt_tls_port,
+	opt_no_shed,
+	opt_tcp_timeout,
+	opt_minimal_any,
+	opt_any_hinfo,
+	opt_backend,
+	opt_views,
+	opt_low_latency,
+};
+
+enum {
+	LOWLAT_IDLE_MS		= 50,	/* spin this long before sleeping */
+};
 
 static const char doc[] =
 PROGRAM_NAME " - authoritative DNS server";
@@ -46,12 +90,59 @@ PROGRAM_NAME " - authoritative DNS server";
 static struct argp_option options[] = {
 	{ "database", 'f', "FILE", 0,
 	  "use sqlite database FILE" },
+	{ "backend", opt_backend, "NAME", 0,
+	  "Read zone data with backend NAME: sqlite (default), or lmdb for "
+	  "a database made by dvdns-mkmdb" },
 	{ "foreground", 'F', NULL, 0,
 	  "Run in foreground, do not fork" },
 	{ "port", 'p', "PORT", 0,
 	  "bind to port PORT" },
 	{ "pid", 'P', "FILE", 0,
 	  "Write daemon process id to FILE" },
+	{ "workers", 'w', "N", 0,
+	  "Answer database queries with N threads (default 4)" },
+	{ "allow-xfr", 'x', "ADDR", 0,
+	  "Permit zone transfers to ADDR (in addition to localhost)" },
+	{ "allow-update", 'u', "ADDR", 0,
+	  "Accept dynamic updates from ADDR (in addition to localhost)" },
+	{ "rrl-rate", 'R', "N", 0,
+	  "Limit UDP responses to N per second per client prefix (0 = off)" },
+	{ "rrl-slip", 'S', "N", 0,
+	  "Send every Nth rate-limited response truncated (0 = never)" },
+	{ "query-log", 'L', "FILE", 0,
+	  "Log queries to binary FILE" },
+	{ "query-log-size", opt_qlog_size, "MB", 0,
+	  "Rotate query log after MB megabytes (default 64)" },
+	{ "cache-snapshot", opt_snap, "FILE", 0,
+	  "Save the response cache to FILE at exit, reload it at startup" },
+	{ "cache-snapshot-interval", opt_snap_interval, "SECS", 0,
+	  "Also save the response cache every SECS seconds (default: never)" },
+	{ "cpus", opt_cpus, "LIST", 0,
+	  "Pin the main loop to the first CPU in LIST, workers to the rest "
+	  "(e.g. 0-3,8-11)" },
+	{ "tls-cert", opt_tls_cert, "FILE", 0,
+	  "Serve DNS over TLS, with the PEM certificate chain in FILE" },
+	{ "tls-key", opt_tls_key, "FILE", 0,
+	  "PEM private key for --tls-cert (default: in the same file)" },
+	{ "tls-port", opt_tls_port, "PORT", 0,
+	  "Serve DNS over TLS on PORT (default 853)" },
+	{ "no-shed", opt_no_shed, NULL, 0,
+	  "Queue every cache miss, even when overloaded (default: send "
+	  "UDP clients to TCP)" },
+	{ "tcp-timeout", opt_tcp_timeout, "SECS", 0,
+	  "Close TCP and TLS connections idle for SECS seconds "
+	  "(default 30, 0 = never)" },
+	{ "minimal-any", opt_minimal_any, "ZONE", 0,
+	  "Answer ANY in ZONE with a single RRset (\".\" = all zones)" },
+	{ "any-hinfo", opt_any_hinfo, "ZONE", 0,
+	  "Answer ANY in ZONE with a synthesized HINFO record, or a single "
+	  "RRset if DNSSEC is requested" },
+	{ "views", opt_views, "FILE", 0,
+	  "Answer by view, per client address or EDNS Client Subnet, with "
+	  "prefixes mapped to views in FILE" },
+	{ "low-latency", opt_low_latency, NULL, 0,
+	  "Busy-poll the sockets and enlarge UDP buffers, spending a CPU "
+	  "to cut wakeup latency (best with --cpus)" },
 
 	{ }
 };
@@ -79,6 +170,89 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 	case 'P':
 		strcpy(pid_fn, arg);
 		break;
+	case 'w':
+		if (atoi(arg) > 0)
+			backend_workers = atoi(arg);
+		else {
+			fprintf(stderr, "invalid worker count %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'x':
+		xfr_acl = g_list_append(xfr_acl, arg);
+		break;
+	case 'u':
+		update_acl = g_list_append(update_acl, arg);
+		break;
+	case 'R':
+		rrl_rate = atoi(arg);
+		break;
+	case 'S':
+		rrl_slip_ratio = atoi(arg);
+		break;
+	case 'L':
+		strcpy(qlog_fn, arg);
+		break;
+	case opt_qlog_size:
+		if (atoi(arg) > 0)
+			qlog_max_size = atoi(arg) * 1024UL * 1024UL;
+		else {
+			fprintf(stderr, "invalid query log size %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case opt_snap:
+		strcpy(snap_fn, arg);
+		break;
+	case opt_snap_interval:
+		snap_interval = atoi(arg);
+		break;
+	case opt_cpus:
+		if (!cpu_list_parse(arg)) {
+			fprintf(stderr, "invalid CPU list %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case opt_tls_cert:
+		strcpy(tls_cert_fn, arg);
+		break;
+	case opt_tls_key:
+		strcpy(tls_key_fn, arg);
+		break;
+	case opt_tls_port:
+		if (atoi(arg) > 0 && atoi(arg) < 65536)
+			tls_port = atoi(arg);
+		else {
+			fprintf(stderr, "invalid TLS port %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case opt_no_shed:
+		shed_enabled = false;
+		break;
+	case opt_tcp_timeout:
+		tcp_timeout = atoi(arg);
+		break;
+	case opt_minimal_any:
+		minimal_any_zones = g_list_append(minimal_any_zones, arg);
+		break;
+	case opt_any_hinfo:
+		any_hinfo_zones = g_list_append(any_hinfo_zones, arg);
+		break;
+	case opt_backend:
+		if (strlen(arg) < sizeof(backend_name))
+			strcpy(backend_name, arg);
+		else {
+			fprintf(stderr, "invalid backend %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case opt_views:
+		strcpy(views_fn, arg);
+		break;
+	case opt_low_latency:
+		low_latency = true;
+		break;
 	case ARGP_KEY_ARG:
 		argp_usage(state);	/* too many args */
 		break;
@@ -128,11 +302,103 @@ static void write_pid_file(void)
 		syslogerr("close pid file failed");
 }
 
+static void stats_signal(int sig)
+{
+	stats_requested = 1;
+}
+
+static void exit_signal(int sig)
+{
+	exit_requested = 1;
+}
+
+static void node_stats(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < cpu_max_nodes; i++)
+		if (srvstat.node_jobs[i])
+			syslog(LOG_INFO, "stats: node %u: jobs %lu "
+			       "page_hit %lu page_miss %lu", i,
+			       srvstat.node_jobs[i], srvstat.node_pg_hit[i],
+			       srvstat.node_pg_miss[i]);
+}
+
+/* act on signals noted by the handlers above */
+static gboolean signal_poll(void *data)
+{
+	if (exit_requested)
+		g_main_loop_quit(loop);
+
+	if (stats_requested) {
+		stats_requested = 0;
+
+		syslog(LOG_INFO, "stats: udp %lu tcp %lu udp_tc %lu sql %lu "
+		       "mc_hit %lu mc_miss %lu mc_refresh %lu xfr %lu "
+		       "rrl_drop %lu rrl_slip %lu qlog_drop %lu shed %lu "
+		       "tcp_idle %lu udp_drop %lu",
+		       srvstat.udp_q, srvstat.tcp_q, srvstat.udp_trunc,
+		       srvstat.sql_q,
+		       srvstat.mc_hit, srvstat.mc_miss, srvstat.mc_refresh,
+		       srvstat.xfr_out,
+		       srvstat.rrl_drop, srvstat.rrl_slip, srvstat.qlog_drop,
+		       srvstat.shed_tc, srvstat.tcp_idle, srvstat.udp_drop);
+
+		if (tls_cert_fn[0])
+			syslog(LOG_INFO, "stats: tls %lu handshakes %lu "
+			       "resumed %lu ktls %lu",
+			       srvstat.tls_q, srvstat.tls_hs,
+			       srvstat.tls_resumed, srvstat.tls_ktls);
+
+		if (views_fn[0])
+			syslog(LOG_INFO, "stats: ecs %lu", srvstat.ecs_q);
+
+		if (srvstat.update_q)
+			syslog(LOG_INFO, "stats: update %lu commits %lu "
+			       "mc_invalidated %lu", srvstat.update_q,
+			       srvstat.update_commits, srvstat.mc_invalidated);
+
+		if (cpu_placed())
+			node_stats();
+	}
+
+	return TRUE;
+}
+
+/*
+ * --low-latency: iterate without blocking, so a query is picked up
+ * as soon as it arrives rather than after a wakeup from poll().  Once
+ * LOWLAT_IDLE_MS pass without a query, sleep until the next event;
+ * timers alone do not start the spinning again.
+ */
+static void main_loop_spin(void)
+{
+	unsigned long seen = 0, n;
+	GTimeVal now, last = { 0, 0 };
+	bool idle = true;
+
+	while (g_main_loop_is_running(loop)) {
+		g_main_context_iteration(NULL, idle);
+
+		g_get_current_time(&now);
+		n = srvstat.udp_q + srvstat.tcp_q + srvstat.tls_q;
+		if (n != seen) {
+			seen = n;
+			last = now;
+		}
+
+		idle = (now.tv_sec - last.tv_sec) * 1000 +
+		       (now.tv_usec - last.tv_usec) / 1000 >= LOWLAT_IDLE_MS;
+	}
+}
+
 int main (int argc, char *argv[])
 {
-	GMainLoop *loop;
 	error_t rc;
 
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
 	rc = argp_parse(&argp, argc, argv, 0, NULL, NULL);
 	if (rc) {
 		fprintf(stderr, "argp_parse failed: %s\n", strerror(rc));
@@ -152,19 +418,51 @@ int main (int argc, char *argv[])
 
 	gnet_init();
 
-	loop = g_main_loop_new(NULL, FALSE);
+	/* before anything the main loop allocates is touched */
+	cpu_bind_main();
+
+	/* running from the start, for main_loop_spin() to test */
+	loop = g_main_loop_new(NULL, TRUE);
 	g_assert(loop != NULL);
 
+	timer_init();
+	view_init();
 	init_net();
 	backend_init();
+	update_init();
 	dns_init();
+	rrl_init();
+	load_init();
+	qlog_init();
+	snapshot_init();
+
+	/* SIGUSR1 dumps server statistics to syslog */
+	signal(SIGUSR1, stats_signal);
+	signal(SIGTERM, exit_signal);
+	signal(SIGINT, exit_signal);
+	signal(SIGPIPE, SIG_IGN);	/* TLS writes to departed clients */
+	g_timeout_add(1000, signal_poll, NULL);
 
 	syslog(LOG_INFO, "initialized");
 
-	g_main_loop_run(loop);
+	if (low_latency && cpu_spare())
+		main_loop_spin();
+	else {
+		if (low_latency)
+			syslog(LOG_WARNING, "low latency: no spare CPU for "
+			       "the main loop to spin on");
+		g_main_loop_run(loop);
+	}
+
+	syslog(LOG_INFO, "shutting down");
 
+	snapshot_exit();
+	qlog_exit();
+	update_exit();
 	backend_exit();
 
+	unlink(pid_fn);
+
 	return 0;
 }
 
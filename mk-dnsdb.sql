@@ -1,6 +1,7 @@
 create table labels (
 	name		text primary key,
-	id		integer unique
+	id		integer unique,
+	ckey		blob		-- DNSSEC canonical order key
 );
 
 create table rrs (
@@ -8,9 +9,12 @@ create table rrs (
 	type		integer,
 	class		integer,
 	ttl		integer,
-	rdata		blob
+	rdata		blob,
+	view		integer not null default 0	-- dvdnsd --views
 );
 
 create index rrs_idx1
 on rrs (domain);
 
+create index labels_ckey
+on labels (ckey);
@@ -0,0 +1,274 @@
+/*
+ * Copyright 2006 Jeff Garzik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * dvdns-mkmdb: copy the zone data of an SQLite database, as made by
+ * import-zone.pl, to an LMDB file for dvdnsd --backend lmdb.  The
+ * key layout is described in backend_lmdb.c.
+ *
+ * An existing file is updated in place, in a single write
+ * transaction: a running dvdnsd goes on answering from the old data
+ * until the commit, then from the new, with no restart or reload.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "dvdns-config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <argp.h>
+#include <sqlite3.h>
+#include <stdint.h>
+#include <lmdb.h>
+
+#define PROGRAM_NAME "dvdns-mkmdb"
+
+enum {
+	/*
+	 * Address space, not disk.  Readers map the size the file was
+	 * made with; never shrink it under a running server.
+	 */
+	MKMDB_MAP_SIZE		= 1 << 30,
+	MKMDB_MAP_UNITS		= 64,		/* 64 GB */
+
+	MKMDB_KEY_MAX		= 511,
+	MKMDB_VAL_HDR		= 6,
+	MKMDB_VAL_MAX		= MKMDB_VAL_HDR + 65535,
+
+	qtype_soa		= 6,
+	qtype_nsec		= 47,
+};
+
+/* every record, in the B-tree's own order */
+static const char mkmdb_sql[] =
+	"select labels.ckey, rrs.type, rrs.class, rrs.ttl, rrs.rdata, "
+	"rrs.view from labels, rrs where labels.id = rrs.domain "
+	"order by labels.ckey, rrs.type, rrs.view desc, rrs.rowid";
+
+/* databases made before views */
+static const char mkmdb_noview_sql[] =
+	"select labels.ckey, rrs.type, rrs.class, rrs.ttl, rrs.rdata, 0 "
+	"from labels, rrs where labels.id = rrs.domain "
+	"order by labels.ckey, rrs.type, rrs.rowid";
+
+static unsigned char val[MKMDB_VAL_MAX];
+static char sqlite_fn[4096] = "dns.db";
+static char mdb_fn[4096] = "dns.mdb";
+
+static const char doc[] =
+PROGRAM_NAME " - copy a dvdnsd SQLite database to LMDB";
+
+static struct argp_option options[] = {
+	{ "database", 'f', "FILE", 0,
+	  "Read sqlite database FILE (default dns.db)" },
+	{ "output", 'o', "FILE", 0,
+	  "Write LMDB FILE (default dns.mdb)" },
+
+	{ }
+};
+
+static error_t parse_opt (int key, char *arg, struct argp_state *state);
+static const struct argp argp = { options, parse_opt, NULL, doc };
+
+static error_t parse_opt (int key, char *arg, struct argp_state *state)
+{
+	switch(key) {
+	case 'f':
+		strcpy(sqlite_fn, arg);
+		break;
+	case 'o':
+		strcpy(mdb_fn, arg);
+		break;
+	case ARGP_KEY_ARG:
+		argp_usage(state);	/* too many args */
+		break;
+	case ARGP_KEY_END:
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+static void mdb_die(const char *what, int rc)
+{
+	fprintf(stderr, "%s %s: %s\n", what, mdb_fn, mdb_strerror(rc));
+	exit(1);
+}
+
+static void put(MDB_txn *txn, MDB_dbi dbi, const void *key,
+		unsigned int key_len, const void *data, unsigned int data_len)
+{
+	MDB_val k, v;
+	int rc;
+
+	k.mv_data = (void *) key;
+	k.mv_size = key_len;
+	v.mv_data = (void *) data;
+	v.mv_size = data_len;
+
+	rc = mdb_put(txn, dbi, &k, &v, 0);
+	if (rc)
+		mdb_die("mdb_put", rc);
+}
+
+int main (int argc, char *argv[])
+{
+	MDB_env *env;
+	MDB_txn *txn;
+	MDB_dbi dbi_rrs, dbi_nsec, dbi_zones;
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	const char *dummy;
+	char prev[MKMDB_KEY_MAX];
+	unsigned int prev_len = 0, prev_type = 0, idx = 0;
+	unsigned long n_rrs = 0, n_zones = 0;
+	error_t err;
+	int rc;
+
+	err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
+	if (err) {
+		fprintf(stderr, "argp_parse failed: %s\n", strerror(err));
+		return 1;
+	}
+
+	rc = sqlite3_open_v2(sqlite_fn, &db, SQLITE_OPEN_READONLY, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "sqlite3_open %s failed\n", sqlite_fn);
+		return 1;
+	}
+
+	rc = sqlite3_prepare(db, mkmdb_sql, strlen(mkmdb_sql), &stmt, &dummy);
+	if (rc != SQLITE_OK)
+		rc = sqlite3_prepare(db, mkmdb_noview_sql,
+				     strlen(mkmdb_noview_sql), &stmt, &dummy);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "%s: %s (re-run import-zone.pl to add "
+			"labels.ckey)\n", sqlite_fn, sqlite3_errmsg(db));
+		return 1;
+	}
+
+	if ((rc = mdb_env_create(&env)) ||
+	    (rc = mdb_env_set_maxdbs(env, 3)) ||
+	    (rc = mdb_env_set_mapsize(env, (size_t) MKMDB_MAP_SIZE *
+					   MKMDB_MAP_UNITS)))
+		mdb_die("mdb_env_create", rc);
+
+	rc = mdb_env_open(env, mdb_fn, MDB_NOSUBDIR, 0644);
+	if (rc)
+		mdb_die("mdb_env_open", rc);
+
+	rc = mdb_txn_begin(env, NULL, 0, &txn);
+	if (rc)
+		mdb_die("mdb_txn_begin", rc);
+
+	if ((rc = mdb_dbi_open(txn, "rrs", MDB_CREATE, &dbi_rrs)) ||
+	    (rc = mdb_dbi_open(txn, "nsec", MDB_CREATE, &dbi_nsec)) ||
+	    (rc = mdb_dbi_open(txn, "zones", MDB_CREATE, &dbi_zones)))
+		mdb_die("mdb_dbi_open", rc);
+
+	/* the old data stays visible to readers until the commit */
+	if ((rc = mdb_drop(txn, dbi_rrs, 0)) ||
+	    (rc = mdb_drop(txn, dbi_nsec, 0)) ||
+	    (rc = mdb_drop(txn, dbi_zones, 0)))
+		mdb_die("mdb_drop", rc);
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		const void *ckey = sqlite3_column_blob(stmt, 0);
+		unsigned int ckey_len = sqlite3_column_bytes(stmt, 0);
+		unsigned int type = sqlite3_column_int(stmt, 1);
+		unsigned int class = sqlite3_column_int(stmt, 2);
+		uint32_t ttl = sqlite3_column_int(stmt, 3);
+		unsigned int rdata_len = sqlite3_column_bytes(stmt, 4);
+		unsigned int view = sqlite3_column_int(stmt, 5);
+		unsigned char key[MKMDB_KEY_MAX];
+
+		if (!ckey && ckey_len) {
+			fprintf(stderr, "%s: out of memory\n", sqlite_fn);
+			return 1;
+		}
+		if (ckey_len + 7 > sizeof(key) ||
+		    MKMDB_VAL_HDR + rdata_len > sizeof(val)) {
+			fprintf(stderr, "%s: record too long, skipped\n",
+				sqlite_fn);
+			continue;
+		}
+
+		/* records of a type are numbered, in database order */
+		if (ckey_len == prev_len && !memcmp(ckey, prev, ckey_len) &&
+		    type == prev_type)
+			idx++;
+		else {
+			idx = 0;
+			memcpy(prev, ckey, ckey_len);
+			prev_len = ckey_len;
+			prev_type = type;
+
+			/* LMDB keys may not be empty, so not the root's */
+			if (type == qtype_soa && ckey_len) {
+				put(txn, dbi_zones, ckey, ckey_len, "", 0);
+				n_zones++;
+			} else if (type == qtype_nsec && ckey_len)
+				put(txn, dbi_nsec, ckey, ckey_len, "", 0);
+		}
+
+		memcpy(key, ckey, ckey_len);
+		key[ckey_len] = 0;
+		key[ckey_len + 1] = type >> 8;
+		key[ckey_len + 2] = type;
+		key[ckey_len + 3] = (0xffff - view) >> 8;
+		key[ckey_len + 4] = 0xffff - view;
+		key[ckey_len + 5] = idx >> 8;
+		key[ckey_len + 6] = idx;
+
+		val[0] = class >> 8;
+		val[1] = class;
+		val[2] = ttl >> 24;
+		val[3] = ttl >> 16;
+		val[4] = ttl >> 8;
+		val[5] = ttl;
+		if (rdata_len)
+			memcpy(val + MKMDB_VAL_HDR,
+			       sqlite3_column_blob(stmt, 4), rdata_len);
+
+		put(txn, dbi_rrs, key, ckey_len + 7, val,
+		    MKMDB_VAL_HDR + rdata_len);
+		n_rrs++;
+	}
+
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "%s: %s\n", sqlite_fn, sqlite3_errmsg(db));
+		mdb_txn_abort(txn);
+		return 1;
+	}
+
+	rc = mdb_txn_commit(txn);
+	if (rc)
+		mdb_die("mdb_txn_commit", rc);
+
+	printf("%s: %lu records, %lu zones\n", mdb_fn, n_rrs, n_zones);
+
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	mdb_env_close(env);
+	return 0;
+}
@@ -0,0 +1,861 @@
+/*
+ * Copyright 2006 Jeff Garzik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * In-memory table of every name in the database, so that the backend
+ * can answer "does it exist", "which zone", "closest encloser" and
+ * "canonical predecessor" without asking SQLite.
+ *
+ * Names are stored as a trie of labels, root first, so that shared
+ * suffixes are stored once.  Each distinct label is stored once too,
+ * and numbered in canonical order (RFC 4034, 6.1), so that siblings
+ * compare as integers.  Nodes are numbered breadth first; the
+ * children of a node are then contiguous and sorted, and the trie is
+ * two arrays of 32-bit words:
+ *
+ *	node_lbl[n]	label id of node n, with its flags in the top bits
+ *	node_child[n]	first child of node n; node_child[n + 1] ends them
+ *
+ * That is 8 bytes per node, plus each distinct label once.  A lookup
+ * costs a hash probe per label and a search among its siblings.
+ *
+ * The table is built by a thread from labels, in labels.ckey order,
+ * and rebuilt whenever the database changes.  Until a build is done
+ * names_get() returns NULL, and the backend asks SQLite as before.
+ *
+ * Dynamic updates (update.c) commit through a connection of their own.
+ * Its data_version does not count those commits, so while updates are
+ * on, the writer's reading of it (after each commit, and every so
+ * often) tells of changes made by others, in place of our own poll.
+ * Instead each name an update changes is marked stale, for the backend
+ * to ask SQLite about, until a table built after the change is in
+ * place.  Too many stale names force a rebuild.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sqlite3.h>
+#include "dnsd.h"
+
+enum {
+	NAMES_MAX_DEPTH		= 128,		/* labels per name */
+	NAMES_CHECK_MS		= 5000,		/* database change poll */
+	NAMES_PREV_MAX		= 1024,		/* nodes to walk back */
+	NAMES_GUESSES		= 3,		/* interpolation steps */
+	NAMES_BUSY_MS		= 2000,
+	NAMES_STALE_MAX		= 4096,		/* names before a rebuild */
+
+	NAMES_FLAG_SHIFT	= 29,
+	NAMES_LBL_MASK		= (1U << NAMES_FLAG_SHIFT) - 1,
+	NAMES_NONE		= 0xffffffffU,
+};
+
+struct name_table {
+	uint32_t		*node_lbl;
+	uint32_t		*node_child;	/* n_nodes + 1 entries */
+	uint32_t		n_nodes;
+	uint32_t		n_names;
+
+	char			*lbl_data;	/* length byte, then label */
+	uint32_t		*lbl_off;	/* by label id */
+	uint32_t		n_lbls;
+	uint32_t		*lbl_slots;	/* label id + 1; 0 is free */
+	uint32_t		slot_mask;
+
+	unsigned int		n_refs;		/* under names_lock */
+};
+
+/* one node while building, kept per depth */
+struct build_node {
+	uint32_t		lbl;		/* label id | flags */
+	uint32_t		child;		/* index in the next depth */
+};
+
+/* a lookup: the path from the root, as far as the name matched */
+struct name_walk {
+	unsigned int		depth;
+	uint32_t		node[NAMES_MAX_DEPTH + 1];
+	const char		*suffix[NAMES_MAX_DEPTH + 1];
+	bool			full;		/* whole name matched */
+	uint32_t		pos;		/* else, where it would go */
+};
+
+static const char names_build_sql[] =
+	"select ckey, "
+	"exists (select 1 from rrs where rrs.domain = labels.id and "
+	"rrs.type = 6), "
+	"exists (select 1 from rrs where rrs.domain = labels.id and "
+	"rrs.type = 47) "
+	"from labels order by ckey";
+
+static GMutex *names_lock;
+static struct name_table *names_cur;
+static GHashTable *names_stale_set;	/* name -> generation touched */
+static volatile gint names_n_stale;
+
+/* notices database changes */
+static sqlite3 *names_db;
+
+/* main loop only */
+static sqlite3_stmt *names_ver_stmt;
+static sqlite3_int64 names_ver;
+static bool names_ver_writer;		/* versions come from update.c */
+static gint64 names_writer_ver;
+static bool names_want;			/* a build is due */
+static GThread *names_builder;
+static guint names_gen;			/* of the latest names_touch() */
+
+static volatile gint names_building;
+static volatile gint names_discard;	/* database changed mid-build */
+
+/* for qsort; only ever used by the one build thread */
+static const char *sort_data;
+static const uint32_t *sort_off;
+
+
+static uint32_t lbl_hash(const char *s, unsigned int len)
+{
+	uint32_t hash = 2166136261U;
+
+	while (len-- > 0) {
+		hash ^= (unsigned char) *s++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/* canonical label order: bytewise, a prefix sorting first */
+static int lbl_cmp(const char *a, unsigned int a_len,
+		   const char *b, unsigned int b_len)
+{
+	int rc = memcmp(a, b, MIN(a_len, b_len));
+
+	return rc ? rc : (int) a_len - (int) b_len;
+}
+
+static uint32_t lbl_find(const char *data, const uint32_t *off,
+			 const uint32_t *slots, uint32_t mask,
+			 const char *s, unsigned int len)
+{
+	uint32_t i = lbl_hash(s, len) & mask;
+
+	for (; slots[i]; i = (i + 1) & mask) {
+		const char *l = data + off[slots[i] - 1];
+
+		if ((unsigned char) l[0] == len && !memcmp(l + 1, s, len))
+			return slots[i] - 1;
+	}
+
+	return NAMES_NONE;
+}
+
+/* number of labels sorting before 's', which is not in the table */
+static uint32_t lbl_rank(const struct name_table *t, const char *s,
+			 unsigned int len)
+{
+	uint32_t lo = 0, hi = t->n_lbls;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const char *l = t->lbl_data + t->lbl_off[mid];
+
+		if (lbl_cmp(l + 1, (unsigned char) l[0], s, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static unsigned int node_flags(const struct name_table *t, uint32_t node)
+{
+	return t->node_lbl[node] >> NAMES_FLAG_SHIFT;
+}
+
+static void names_walk(const struct name_table *t, const char *name,
+		       struct name_walk *w)
+{
+	const char *end = name + strlen(name), *dot;
+	uint32_t node = 0;
+
+	w->depth = 0;
+	w->node[0] = 0;
+	w->suffix[0] = end;
+	w->full = true;
+
+	while (end > name) {
+		uint32_t id, key, lo, hi;
+		unsigned int len, i;
+
+		for (dot = end; dot > name && dot[-1] != '.'; dot--)
+			;
+		len = end - dot;
+
+		lo = t->node_child[node];
+		hi = t->node_child[node + 1];
+
+		id = lbl_find(t->lbl_data, t->lbl_off, t->lbl_slots,
+			      t->slot_mask, dot, len);
+		key = (id != NAMES_NONE) ? id : lbl_rank(t, dot, len);
+
+		/*
+		 * First child whose label is not below this one.  Label ids
+		 * are dense, so for a wide node, guessing the position from
+		 * the ids at the ends narrows the search in a step or two.
+		 */
+		for (i = 0; i < NAMES_GUESSES && hi - lo > 16; i++) {
+			uint32_t first = t->node_lbl[lo] & NAMES_LBL_MASK;
+			uint32_t last = t->node_lbl[hi - 1] & NAMES_LBL_MASK;
+			uint32_t mid;
+
+			if (key <= first) {
+				hi = lo;
+				break;
+			}
+			if (key > last) {
+				lo = hi;
+				break;
+			}
+
+			mid = lo + (uint64_t) (key - first) * (hi - 1 - lo) /
+				   (last - first);
+			if ((t->node_lbl[mid] & NAMES_LBL_MASK) < key)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+
+			if ((t->node_lbl[mid] & NAMES_LBL_MASK) < key)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (id == NAMES_NONE || lo == t->node_child[node + 1] ||
+		    (t->node_lbl[lo] & NAMES_LBL_MASK) != id ||
+		    w->depth == NAMES_MAX_DEPTH) {
+			w->full = false;
+			w->pos = lo;
+			return;
+		}
+
+		node = lo;
+		w->depth++;
+		w->node[w->depth] = node;
+		w->suffix[w->depth] = dot;
+
+		end = (dot > name) ? dot - 1 : name;
+	}
+}
+
+/* 'name' is in the table, with one of 'flags' */
+bool names_lookup(const struct name_table *t, const char *name,
+		  unsigned int flags)
+{
+	struct name_walk w;
+
+	names_walk(t, name, &w);
+	return w.full && (node_flags(t, w.node[w.depth]) & flags);
+}
+
+/* longest suffix of 'name', itself included, with one of 'flags' */
+const char *names_closest(const struct name_table *t, const char *name,
+			  unsigned int flags)
+{
+	struct name_walk w;
+	int i;
+
+	names_walk(t, name, &w);
+
+	for (i = w.depth; i > 0; i--)
+		if (node_flags(t, w.node[i]) & flags)
+			return w.suffix[i];
+
+	return NULL;
+}
+
+/* move to the last node, in canonical order, of the subtree at 'path' */
+static void names_last(const struct name_table *t, uint32_t *path,
+		       unsigned int *depth)
+{
+	uint32_t node = path[*depth];
+
+	while (t->node_child[node] < t->node_child[node + 1] &&
+	       *depth < NAMES_MAX_DEPTH) {
+		node = t->node_child[node + 1] - 1;
+		path[++(*depth)] = node;
+	}
+}
+
+/* move to the node before 'path' in canonical order */
+static void names_back(const struct name_table *t, uint32_t *path,
+		       unsigned int *depth)
+{
+	uint32_t node = path[*depth];
+
+	if (node > t->node_child[path[*depth - 1]]) {
+		path[*depth] = node - 1;
+		names_last(t, path, depth);
+	} else
+		(*depth)--;		/* a parent sorts before its children */
+}
+
+static char *names_path_str(const struct name_table *t, const uint32_t *path,
+			    unsigned int depth)
+{
+	unsigned int i, len = 0;
+	char *s, *p;
+
+	for (i = 1; i <= depth; i++)
+		len += (unsigned char)
+		       t->lbl_data[t->lbl_off[t->node_lbl[path[i]] &
+					      NAMES_LBL_MASK]] + 1;
+
+	p = s = g_malloc(len + 1);
+	for (i = depth; i > 0; i--) {
+		const char *l = t->lbl_data +
+				t->lbl_off[t->node_lbl[path[i]] & NAMES_LBL_MASK];
+		unsigned int l_len = (unsigned char) l[0];
+
+		memcpy(p, l + 1, l_len);
+		p += l_len;
+		*p++ = '.';
+	}
+	s[len ? len - 1 : 0] = 0;
+
+	return s;
+}
+
+/*
+ * The last name before 'name' in canonical order having one of
+ * 'flags', or NULL.  The walk back stops at a zone apex, before which
+ * nothing belongs to the zone.
+ */
+char *names_prev(const struct name_table *t, const char *name,
+		 unsigned int flags)
+{
+	struct name_walk w;
+	unsigned int depth, n;
+
+	names_walk(t, name, &w);
+	depth = w.depth;
+
+	if (w.full) {
+		if (depth == 0)
+			return NULL;
+		names_back(t, w.node, &depth);
+	} else if (w.pos > t->node_child[w.node[depth]]) {
+		w.node[++depth] = w.pos - 1;
+		names_last(t, w.node, &depth);
+	}
+
+	for (n = 0; n < NAMES_PREV_MAX && depth > 0; n++) {
+		unsigned int f = node_flags(t, w.node[depth]);
+
+		if (f & flags)
+			return names_path_str(t, w.node, depth);
+		if (f & name_soa)
+			break;
+
+		names_back(t, w.node, &depth);
+	}
+
+	return NULL;
+}
+
+static void names_free(struct name_table *t)
+{
+	g_free(t->node_lbl);
+	g_free(t->node_child);
+	g_free(t->lbl_data);
+	g_free(t->lbl_off);
+	g_free(t->lbl_slots);
+	g_free(t);
+}
+
+/* the current table, or NULL; release it with names_put() */
+struct name_table *names_get(void)
+{
+	struct name_table *t;
+
+	if (!names_lock)
+		return NULL;
+
+	g_mutex_lock(names_lock);
+	t = names_cur;
+	if (t)
+		t->n_refs++;
+	g_mutex_unlock(names_lock);
+
+	return t;
+}
+
+void names_put(struct name_table *t)
+{
+	unsigned int n_refs;
+
+	if (!t)
+		return;
+
+	g_mutex_lock(names_lock);
+	n_refs = --t->n_refs;
+	g_mutex_unlock(names_lock);
+
+	if (n_refs == 0)
+		names_free(t);
+}
+
+static void names_install(struct name_table *t)
+{
+	struct name_table *old;
+
+	g_mutex_lock(names_lock);
+	old = names_cur;
+	names_cur = t;
+	g_mutex_unlock(names_lock);
+
+	names_put(old);
+}
+
+static gboolean names_stale_built(gpointer key, gpointer value,
+				  gpointer data)
+{
+	return GPOINTER_TO_UINT(value) <= GPOINTER_TO_UINT(data);
+}
+
+/* a table is in place that includes changes up to generation 'gen' */
+static void names_unstale(guint gen)
+{
+	g_mutex_lock(names_lock);
+	g_hash_table_foreach_remove(names_stale_set, names_stale_built,
+				    GUINT_TO_POINTER(gen));
+	g_atomic_int_set(&names_n_stale, g_hash_table_size(names_stale_set));
+	g_mutex_unlock(names_lock);
+}
+
+/* main loop only: 'name' was just changed by an update */
+void names_touch(const char *name)
+{
+	unsigned int n;
+
+	if (!names_db)
+		return;			/* no table to go stale */
+
+	g_mutex_lock(names_lock);
+	g_hash_table_replace(names_stale_set, g_strdup(name),
+			     GUINT_TO_POINTER(++names_gen));
+	n = g_hash_table_size(names_stale_set);
+	g_atomic_int_set(&names_n_stale, n);
+	g_mutex_unlock(names_lock);
+
+	if (n >= NAMES_STALE_MAX)
+		names_want = true;
+}
+
+/* the table's entry for 'name' may be out of date */
+bool names_stale(const char *name)
+{
+	bool stale;
+
+	if (!g_atomic_int_get(&names_n_stale))
+		return false;
+
+	g_mutex_lock(names_lock);
+	stale = g_hash_table_lookup(names_stale_set, name) != NULL;
+	g_mutex_unlock(names_lock);
+
+	return stale;
+}
+
+static int cmp_lbl_id(const void *a, const void *b)
+{
+	const char *la = sort_data + sort_off[*(const uint32_t *) a];
+	const char *lb = sort_data + sort_off[*(const uint32_t *) b];
+
+	return lbl_cmp(la + 1, (unsigned char) la[0],
+		       lb + 1, (unsigned char) lb[0]);
+}
+
+/* intern a label while building; returns its provisional id */
+static uint32_t build_lbl(GString *data, GArray *off, uint32_t **slots,
+			  uint32_t *mask, const char *s, unsigned int len)
+{
+	uint32_t id, i, *new_slots, new_mask, o;
+	unsigned char len8 = len;
+
+	id = lbl_find(data->str, (uint32_t *) off->data, *slots, *mask,
+		      s, len);
+	if (id != NAMES_NONE)
+		return id;
+
+	id = off->len;
+	o = data->len;
+	g_array_append_val(off, o);
+	g_string_append_len(data, (char *) &len8, 1);
+	g_string_append_len(data, s, len);
+
+	/* keep the hash at most half full */
+	if (off->len * 2 > *mask + 1) {
+		new_mask = (*mask << 1) | 1;
+		new_slots = g_new0(uint32_t, new_mask + 1);
+
+		for (i = 0; i <= *mask; i++) {
+			const char *l;
+			uint32_t j;
+
+			if (!(*slots)[i])
+				continue;
+			l = data->str + g_array_index(off, uint32_t,
+						      (*slots)[i] - 1);
+			j = lbl_hash(l + 1, (unsigned char) l[0]) & new_mask;
+			while (new_slots[j])
+				j = (j + 1) & new_mask;
+			new_slots[j] = (*slots)[i];
+		}
+
+		g_free(*slots);
+		*slots = new_slots;
+		*mask = new_mask;
+	}
+
+	i = lbl_hash(s, len) & *mask;
+	while ((*slots)[i])
+		i = (i + 1) & *mask;
+	(*slots)[i] = id + 1;
+
+	return id;
+}
+
+/*
+ * Build the table from labels.  Rows come in canonical order, so a
+ * name's ancestors come before it, and the nodes at each depth come
+ * grouped by parent and sorted; appending each new node to the array
+ * for its depth yields the breadth first layout directly.
+ */
+static struct name_table *names_build(sqlite3 *db)
+{
+	GArray *levels[NAMES_MAX_DEPTH + 1];
+	uint32_t path[NAMES_MAX_DEPTH + 1];
+	uint32_t base[NAMES_MAX_DEPTH + 2];
+	unsigned int depth = 0, max_depth = 0, d, i;
+	uint32_t root_flags = 0, *slots, mask = 1023, *order, *rank;
+	struct name_table *t = NULL;
+	sqlite3_stmt *stmt;
+	GString *data;
+	GArray *off;
+	uint32_t n_names = 0;
+	unsigned long bytes;
+	int rc;
+
+	rc = sqlite3_prepare(db, names_build_sql, strlen(names_build_sql),
+			     &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		syslog(LOG_WARNING, "%s has no labels.ckey column, "
+		       "no name table", db_fn);
+		return NULL;
+	}
+
+	data = g_string_new(NULL);
+	off = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+	slots = g_new0(uint32_t, mask + 1);
+	for (d = 0; d <= NAMES_MAX_DEPTH; d++)
+		levels[d] = g_array_new(FALSE, FALSE,
+					sizeof(struct build_node));
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		const char *key = sqlite3_column_blob(stmt, 0);
+		unsigned int key_len = sqlite3_column_bytes(stmt, 0);
+		uint32_t flags = name_exists, ids[NAMES_MAX_DEPTH];
+		unsigned int n = 0, k, pos = 0;
+
+		if (!key) {
+			syslog(LOG_ERR, "%s: labels.ckey not filled in, "
+			       "no name table", db_fn);
+			goto out;
+		}
+
+		if (sqlite3_column_int(stmt, 1))
+			flags |= name_soa;
+		if (sqlite3_column_int(stmt, 2))
+			flags |= name_nsec;
+
+		/* labels, root first, each followed by a NUL */
+		while (pos < key_len) {
+			const char *nul = memchr(key + pos, 0, key_len - pos);
+			unsigned int len = nul ? nul - (key + pos)
+					       : key_len - pos;
+
+			if (n == NAMES_MAX_DEPTH || len > 255)
+				goto out;
+			ids[n++] = build_lbl(data, off, &slots, &mask,
+					     key + pos, len);
+			pos += len + 1;
+		}
+
+		/* ancestors already in place */
+		for (k = 0; k < n && k < depth && path[k + 1] == ids[k]; k++)
+			;
+
+		for (d = k + 1; d <= n; d++) {
+			struct build_node bn;
+
+			bn.lbl = ids[d - 1];
+			bn.child = (d < NAMES_MAX_DEPTH) ? levels[d + 1]->len : 0;
+			g_array_append_val(levels[d], bn);
+			path[d] = ids[d - 1];
+		}
+		depth = n;
+		max_depth = MAX(max_depth, n);
+
+		flags <<= NAMES_FLAG_SHIFT;
+		if (n == 0)
+			root_flags |= flags;
+		else
+			g_array_index(levels[n], struct build_node,
+				      levels[n]->len - 1).lbl |= flags;
+		n_names++;
+	}
+
+	if (rc != SQLITE_DONE) {
+		syslog(LOG_ERR, "name table: %s", sqlite3_errmsg(db));
+		goto out;
+	}
+
+	t = g_new0(struct name_table, 1);
+	t->n_names = n_names;
+	t->n_lbls = off->len;
+
+	/* renumber labels in canonical order */
+	order = g_new(uint32_t, t->n_lbls);
+	rank = g_new(uint32_t, t->n_lbls);
+	for (i = 0; i < t->n_lbls; i++)
+		order[i] = i;
+	sort_data = data->str;
+	sort_off = (uint32_t *) off->data;
+	qsort(order, t->n_lbls, sizeof(uint32_t), cmp_lbl_id);
+
+	t->lbl_off = g_new(uint32_t, MAX(t->n_lbls, 1));
+	for (i = 0; i < t->n_lbls; i++) {
+		rank[order[i]] = i;
+		t->lbl_off[i] = g_array_index(off, uint32_t, order[i]);
+	}
+	for (i = 0; i <= mask; i++)
+		if (slots[i])
+			slots[i] = rank[slots[i] - 1] + 1;
+
+	t->lbl_slots = slots;
+	t->slot_mask = mask;
+	slots = NULL;
+	bytes = data->len + (t->n_lbls + mask + 1) * 4;
+	t->lbl_data = g_string_free(data, FALSE);
+	data = NULL;
+
+	/* lay the depths end to end */
+	base[1] = 1;
+	for (d = 1; d <= NAMES_MAX_DEPTH; d++)
+		base[d + 1] = base[d] + levels[d]->len;
+	t->n_nodes = base[NAMES_MAX_DEPTH + 1];
+
+	t->node_lbl = g_new(uint32_t, t->n_nodes);
+	t->node_child = g_new(uint32_t, t->n_nodes + 1);
+	t->node_lbl[0] = root_flags;
+	t->node_child[0] = base[1];
+
+	for (d = 1; d <= max_depth; d++)
+		for (i = 0; i < levels[d]->len; i++) {
+			struct build_node *bn =
+				&g_array_index(levels[d], struct build_node, i);
+
+			t->node_lbl[base[d] + i] =
+				rank[bn->lbl & NAMES_LBL_MASK] |
+				(bn->lbl & ~NAMES_LBL_MASK);
+			t->node_child[base[d] + i] = base[d + 1] + bn->child;
+		}
+	t->node_child[t->n_nodes] = t->n_nodes;
+
+	g_free(order);
+	g_free(rank);
+
+	bytes += (t->n_nodes * 2 + 1) * 4;
+	syslog(LOG_INFO, "name table: %u names, %u nodes, %u labels, "
+	       "%lu bytes", t->n_names, t->n_nodes, t->n_lbls, bytes);
+
+out:
+	sqlite3_finalize(stmt);
+	for (d = 0; d <= NAMES_MAX_DEPTH; d++)
+		g_array_free(levels[d], TRUE);
+	g_array_free(off, TRUE);
+	g_free(slots);
+	if (data)
+		g_string_free(data, TRUE);
+
+	return t;
+}
+
+/* 'data' is the names_touch() generation the build starts from */
+static void *names_thread(void *data)
+{
+	struct name_table *t = NULL;
+	sqlite3 *db;
+
+	cpu_bind_any();
+
+	if (sqlite3_open_v2(db_fn, &db, SQLITE_OPEN_READONLY,
+			    NULL) == SQLITE_OK) {
+		sqlite3_busy_timeout(db, NAMES_BUSY_MS);
+		t = names_build(db);
+	}
+	sqlite3_close(db);
+
+	if (t) {
+		t->n_refs = 1;
+		if (g_atomic_int_get(&names_discard))
+			names_free(t);		/* already out of date */
+		else {
+			names_install(t);
+			names_unstale(GPOINTER_TO_UINT(data));
+		}
+	}
+
+	g_atomic_int_set(&names_building, 0);
+	return NULL;
+}
+
+static sqlite3_int64 names_version(void)
+{
+	sqlite3_int64 ver = -1;
+
+	if (sqlite3_step(names_ver_stmt) == SQLITE_ROW)
+		ver = sqlite3_column_int64(names_ver_stmt, 0);
+	sqlite3_reset(names_ver_stmt);
+
+	return ver;
+}
+
+/* drop the table, so that no answer is based on names since changed */
+static void names_changed(void)
+{
+	names_install(NULL);
+	names_want = true;
+	if (g_atomic_int_get(&names_building))
+		g_atomic_int_set(&names_discard, 1);
+}
+
+/*
+ * Main loop only: the update writer's data_version, read on its own
+ * connection, after a commit or while idle.  Any change is someone
+ * else's.  The first switches change detection over from our poll,
+ * which from then on would see the writer's commits too.
+ */
+void names_writer_version(gint64 ver)
+{
+	if (!names_db)
+		return;
+
+	if (!names_ver_writer) {
+		names_ver_writer = true;
+		if (names_version() != names_ver)
+			names_changed();
+	} else if (ver != names_writer_ver)
+		names_changed();
+
+	names_writer_ver = ver;
+}
+
+/*
+ * Drop the table as soon as the database changes, so that no answer
+ * is based on names since removed or added, and build another.
+ */
+static gboolean names_poll(void *data)
+{
+	sqlite3_int64 ver;
+
+	if (!names_ver_writer) {
+		ver = names_version();
+		if (ver != names_ver) {
+			names_ver = ver;
+			names_changed();
+		}
+	}
+
+	if (names_want && !g_atomic_int_get(&names_building)) {
+		if (names_builder)
+			g_thread_join(names_builder);
+
+		names_want = false;
+		g_atomic_int_set(&names_discard, 0);
+		g_atomic_int_set(&names_building, 1);
+		names_builder = g_thread_create(names_thread,
+						GUINT_TO_POINTER(names_gen),
+						TRUE, NULL);
+		g_assert(names_builder != NULL);
+	}
+
+	return TRUE;
+}
+
+void names_init(void)
+{
+	int rc;
+
+	names_lock = g_mutex_new();
+	names_stale_set = g_hash_table_new_full(g_str_hash, g_str_equal,
+						g_free, NULL);
+
+	rc = sqlite3_open_v2(db_fn, &names_db, SQLITE_OPEN_READONLY, NULL);
+	if (rc == SQLITE_OK)
+		rc = sqlite3_prepare(names_db, "pragma data_version", -1,
+				     &names_ver_stmt, NULL);
+	if (rc != SQLITE_OK) {
+		/* no way to notice changes, so no table to go stale */
+		syslog(LOG_WARNING, "sqlite3 lacks data_version, "
+		       "no name table");
+		sqlite3_close(names_db);
+		names_db = NULL;
+		return;
+	}
+
+	names_ver = names_version();
+	names_want = true;
+	names_poll(NULL);
+
+	g_timeout_add(NAMES_CHECK_MS, names_poll, NULL);
+}
+
+void names_exit(void)
+{
+	if (names_builder)
+		g_thread_join(names_builder);
+	names_builder = NULL;
+
+	if (names_lock)
+		names_install(NULL);
+
+	if (names_db) {
+		sqlite3_finalize(names_ver_stmt);
+		sqlite3_close(names_db);
+		names_db = NULL;
+	}
+}
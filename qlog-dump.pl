@@ -0,0 +1,79 @@
+#!/usr/bin/perl -w
+#
+# Print a dvdnsd binary query log (see qlog.c) as text.
+#
+#
+# Copyright 2006 Jeff Garzik
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2, or (at your option)
+# any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; see the file COPYING.  If not, write to
+# the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+#
+
+use strict;
+use Socket qw(inet_ntop AF_INET AF_INET6);
+
+my $REC_FIXED = 36;
+
+sub usage() {
+	print STDERR "usage: qlog-dump.pl LOG-FILE...\n";
+	exit(1);
+}
+
+sub dump_file($) {
+	my ($fn) = @_;
+	my ($buf, $e);
+
+	open(F, '<', $fn) or die "$fn: $!\n";
+	binmode(F);
+
+	read(F, $buf, 8) == 8 or die "$fn: short header\n";
+	die "$fn: not a dvdnsd query log\n" unless (substr($buf, 0, 4) eq 'DVQL');
+
+	# version field tells us the writer's byte order
+	if (unpack('V', substr($buf, 4, 4)) == 1) {
+		$e = '<';
+	} elsif (unpack('N', substr($buf, 4, 4)) == 1) {
+		$e = '>';
+	} else {
+		die "$fn: unknown version\n";
+	}
+
+	while (read(F, $buf, $REC_FIXED) == $REC_FIXED) {
+		my ($ts, $lat, $qtype, $rcode, $flags, $alen, $qlen) =
+			unpack("Q${e}L${e}S${e}CCCC", $buf);
+		my $addr = substr($buf, 20, $alen);
+		my $qname = '';
+
+		read(F, $qname, $qlen) if ($qlen);
+
+		printf("%d.%06d %s %s %d rcode=%d %s%s %dus\n",
+		       int($ts / 1000000), $ts % 1000000,
+		       inet_ntop($alen == 4 ? AF_INET : AF_INET6, $addr),
+		       $qname eq '' ? '.' : $qname, $qtype, $rcode,
+		       ($flags & 1) ? 'hit' : 'miss',
+		       ($flags & 2) ? ' tcp' : '',
+		       $lat);
+	}
+
+	close(F);
+}
+
+usage() unless (@ARGV);
+
+my $fn;
+foreach $fn (@ARGV) {
+	dump_file($fn);
+}
+
+exit(0);
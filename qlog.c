@@ -0,0 +1,298 @@
+/*
+ * Copyright 2006 Jeff Garzik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Query logging.
+ *
+ * Each thread that answers queries owns a single-producer,
+ * single-consumer ring of fixed-size records.  Producers never block:
+ * when the ring is full the record is dropped and counted.  A writer
+ * thread drains every ring into a binary log file, rotating it once
+ * it grows past qlog_max_size.  Should the file fail to open, records
+ * are drained and counted as dropped until a retry succeeds.
+ *
+ * File format: the 8-byte header "DVQL", followed by a 32-bit version
+ * in host byte order (readers use it to detect byte order).  Each
+ * record is the fixed part of struct qlog_rec followed by qname_len
+ * bytes of query name, without a terminating NUL.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+#include <glib.h>
+#include "dnsd.h"
+
+enum {
+	QLOG_RING_SIZE		= 16384,	/* power of two */
+	QLOG_MAX_RINGS		= 64,
+	QLOG_IDLE_USEC		= 5 * 1000,	/* writer sleep when idle */
+	QLOG_KEEP		= 4,		/* rotated files kept */
+	QLOG_RETRY_SEC		= 10,		/* reopen after a failure */
+	QLOG_VERSION		= 1,
+
+	QLOG_CACHE_HIT		= 1 << 0,
+	QLOG_TCP		= 1 << 1,
+};
+
+struct qlog_rec {
+	uint64_t		ts_usec;	/* wall clock, microseconds */
+	uint32_t		latency_usec;
+	uint16_t		qtype;
+	uint8_t			rcode;
+	uint8_t			flags;
+	uint8_t			addr_len;	/* 4 or 16 */
+	uint8_t			qname_len;
+	uint8_t			pad[2];
+	uint8_t			addr[16];
+
+	char			qname[220];	/* truncated, not logged */
+};
+
+#define QLOG_REC_FIXED	offsetof(struct qlog_rec, qname)
+
+struct qlog_ring {
+	volatile gint		head;		/* written by producer */
+	char			pad1[60];
+	volatile gint		tail;		/* written by writer */
+	char			pad2[60];
+
+	struct qlog_rec		recs[QLOG_RING_SIZE];
+};
+
+static struct qlog_ring *rings[QLOG_MAX_RINGS];
+static volatile gint n_rings;
+static GMutex *rings_lock;
+static __thread struct qlog_ring *my_ring;
+
+static GThread *writer;
+static volatile gint writer_stop;
+static FILE *log_f;
+static unsigned long log_size;
+static time_t log_retry;		/* when to try opening again */
+static volatile gint writer_drop;	/* for srvstat, not yet added */
+
+
+static struct qlog_ring *qlog_ring_get(void)
+{
+	struct qlog_ring *ring;
+	gint n;
+
+	if (G_LIKELY(my_ring != NULL))
+		return my_ring;
+
+	g_mutex_lock(rings_lock);
+
+	n = g_atomic_int_get(&n_rings);
+	if (n == QLOG_MAX_RINGS) {
+		g_mutex_unlock(rings_lock);
+		return NULL;
+	}
+
+	ring = g_new0(struct qlog_ring, 1);
+	rings[n] = ring;
+	g_atomic_int_set(&n_rings, n + 1);
+
+	g_mutex_unlock(rings_lock);
+
+	my_ring = ring;
+	return ring;
+}
+
+void qlog_query(const GTimeVal *start, const unsigned char *addr,
+		unsigned int addr_len, const struct dnsres *res,
+		bool tcp, bool cache_hit)
+{
+	const struct dns_msg_hdr *hdr = (const struct dns_msg_hdr *) res->buf;
+	const struct dnsq *q = res->queries ? res->queries->data : NULL;
+	struct qlog_ring *ring;
+	struct qlog_rec *rec;
+	GTimeVal now;
+	guint head, tail;
+	size_t len;
+	gint drop;
+
+	if (!writer)
+		return;
+
+	/* the writer's losses, counted here as srvstat is ours */
+	drop = g_atomic_int_get(&writer_drop);
+	if (G_UNLIKELY(drop)) {
+		g_atomic_int_add(&writer_drop, -drop);
+		srvstat.qlog_drop += drop;
+	}
+
+	ring = qlog_ring_get();
+	if (!ring) {
+		srvstat.qlog_drop++;
+		return;
+	}
+
+	head = (guint) ring->head;
+	tail = (guint) g_atomic_int_get(&ring->tail);
+	if ((head - tail) >= QLOG_RING_SIZE) {
+		srvstat.qlog_drop++;
+		return;
+	}
+
+	g_get_current_time(&now);
+
+	rec = &ring->recs[head & (QLOG_RING_SIZE - 1)];
+	rec->ts_usec = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+	rec->latency_usec = (now.tv_sec - start->tv_sec) * 1000000 +
+			    (now.tv_usec - start->tv_usec);
+	rec->qtype = q ? q->type : 0;
+	rec->rcode = hdr->opts[1] & 0x0f;
+	rec->flags = (cache_hit ? QLOG_CACHE_HIT : 0) | (tcp ? QLOG_TCP : 0);
+	rec->addr_len = addr_len;
+	memcpy(rec->addr, addr, addr_len);
+
+	len = (q && q->name) ? strlen(q->name) : 0;
+	len = MIN(len, sizeof(rec->qname));
+	rec->qname_len = len;
+	memcpy(rec->qname, q ? q->name : "", len);
+
+	/* publish; GLib atomics imply a full barrier */
+	g_atomic_int_set(&ring->head, (gint) (head + 1));
+}
+
+static void qlog_open(void)
+{
+	uint32_t ver = QLOG_VERSION;
+
+	log_f = fopen(qlog_fn, "w");
+	log_size = 0;
+	if (!log_f) {
+		syslog(LOG_ERR, "query log %s: %m", qlog_fn);
+		log_retry = time(NULL) + QLOG_RETRY_SEC;
+		return;
+	}
+
+	fwrite("DVQL", 4, 1, log_f);
+	fwrite(&ver, 4, 1, log_f);
+	log_size = 8;
+}
+
+static void qlog_rotate(void)
+{
+	char old_fn[4200], new_fn[4200];
+	int i;
+
+	if (log_f)
+		fclose(log_f);
+
+	for (i = QLOG_KEEP - 1; i > 0; i--) {
+		sprintf(old_fn, "%s.%d", qlog_fn, i);
+		sprintf(new_fn, "%s.%d", qlog_fn, i + 1);
+		rename(old_fn, new_fn);
+	}
+	sprintf(new_fn, "%s.1", qlog_fn);
+	rename(qlog_fn, new_fn);
+
+	qlog_open();
+}
+
+static unsigned int qlog_drain(struct qlog_ring *ring)
+{
+	guint head, tail, n = 0, lost = 0;
+
+	head = (guint) g_atomic_int_get(&ring->head);
+	tail = (guint) ring->tail;
+
+	while (tail != head) {
+		struct qlog_rec *rec = &ring->recs[tail & (QLOG_RING_SIZE - 1)];
+		size_t len = QLOG_REC_FIXED + rec->qname_len;
+
+		if (log_f && fwrite(rec, len, 1, log_f) == 1)
+			log_size += len;
+		else
+			lost++;
+
+		tail++;
+		n++;
+	}
+
+	/* hand the slots back to the producer */
+	g_atomic_int_set(&ring->tail, (gint) tail);
+
+	if (lost)
+		g_atomic_int_add(&writer_drop, lost);
+
+	if (log_size >= qlog_max_size)
+		qlog_rotate();
+
+	return n;
+}
+
+static void *qlog_writer(void *data)
+{
+	unsigned int i, n;
+
+	cpu_bind_any();		/* any listed CPU, the main loop's too */
+
+	while (1) {
+		bool stop = g_atomic_int_get(&writer_stop);
+
+		if (!log_f && !stop && time(NULL) >= log_retry)
+			qlog_open();
+
+		n = 0;
+		for (i = 0; i < (unsigned int) g_atomic_int_get(&n_rings); i++)
+			n += qlog_drain(rings[i]);
+
+		if (stop)
+			break;
+
+		if (!n) {
+			if (log_f)
+				fflush(log_f);
+			g_usleep(QLOG_IDLE_USEC);
+		}
+	}
+
+	if (log_f)
+		fclose(log_f);
+	return NULL;
+}
+
+void qlog_init(void)
+{
+	if (!qlog_fn[0])
+		return;
+
+	rings_lock = g_mutex_new();
+
+	/* should this fail, the writer retries it */
+	qlog_rotate();
+
+	writer = g_thread_create(qlog_writer, NULL, TRUE, NULL);
+	g_assert(writer != NULL);
+}
+
+void qlog_exit(void)
+{
+	if (!writer)
+		return;
+
+	g_atomic_int_set(&writer_stop, 1);
+	g_thread_join(writer);
+	writer = NULL;
+}
@@ -0,0 +1,1073 @@
+/*
+ * Copyright 2006 Jeff Garzik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * dvdns-replay: feed the DNS queries found in a pcap file to dvdnsd,
+ * over UDP, over TLS, or by calling dns_message() in-process, and
+ * report throughput, latency and cache behaviour.  Responses may be
+ * recorded to a golden file, or compared against one from an earlier
+ * run.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "dvdns-config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <argp.h>
+#include <glib.h>
+#include "dnsd.h"
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#endif
+
+#define PROGRAM_NAME "dvdns-replay"
+
+enum {
+	PCAP_MAGIC_USEC		= 0xa1b2c3d4,
+	PCAP_MAGIC_NSEC		= 0xa1b23c4d,
+
+	LINKTYPE_NULL		= 0,
+	LINKTYPE_ETHERNET	= 1,
+	LINKTYPE_RAW		= 101,
+	LINKTYPE_LINUX_SLL	= 113,
+	LINKTYPE_LINUX_SLL2	= 276,
+
+	MAX_MSG			= 65535,
+	MAX_MISMATCH_REPORT	= 10,
+	UDP_RCVBUF		= 16 * 1024 * 1024,
+};
+
+struct replay_q {
+	double			ts;		/* capture time, seconds */
+	unsigned int		len;
+	char			*buf;
+
+	double			latency;	/* usec, < 0 if unanswered */
+	unsigned int		res_len;
+	char			*res;
+};
+
+/* dnsd.h globals, for in-process mode */
+char db_fn[4096] = "dns.db";
+char backend_name[32] = "sqlite";
+unsigned int backend_workers = 1;
+bool shed_enabled;			/* answer everything */
+GList *minimal_any_zones, *any_hinfo_zones;	/* full ANY */
+char views_fn[4096];
+struct dns_server_stats srvstat;
+
+static char pcap_fn[4096];
+static char golden_fn[4096];
+static bool golden_write;
+static char server[256] = "127.0.0.1";
+static int server_port = 9953;
+static bool in_process;
+static double speed;			/* 0 = as fast as possible */
+static unsigned int window = 256;
+static unsigned int timeout_ms = 2000;
+static unsigned long limit;
+static int dns_port_filter = 53;
+static bool use_tls;
+static unsigned int tls_conns = 1;
+static bool tls_resume = true;
+
+/* answers lost to our own full receive queue, not to the server */
+static unsigned int udp_client_drops;
+
+/* handshake times, usec */
+static GArray *hs_full, *hs_resumed;
+
+static GPtrArray *queries;
+
+static const char doc[] =
+PROGRAM_NAME " - replay captured DNS queries against dvdnsd";
+
+static struct argp_option options[] = {
+	{ "pcap", 'r', "FILE", 0,
+	  "Read queries from pcap FILE" },
+	{ "server", 's', "ADDR", 0,
+	  "Send queries to IPv4 ADDR (default 127.0.0.1)" },
+	{ "port", 'p', "PORT", 0,
+	  "Send queries to PORT (default 9953)" },
+	{ "capture-port", 'c', "PORT", 0,
+	  "Take queries sent to PORT from the capture (default 53)" },
+	{ "in-process", 'i', NULL, 0,
+	  "Call dns_message() directly instead of using UDP" },
+	{ "tls", 'T', NULL, 0,
+	  "Send queries over DNS over TLS instead of UDP" },
+	{ "tls-conns", 'N', "N", 0,
+	  "Spread TLS queries over N successive connections (default 1)" },
+	{ "no-resume", 'Z', NULL, 0,
+	  "Do a full TLS handshake on every connection" },
+	{ "database", 'f', "FILE", 0,
+	  "use sqlite database FILE (in-process mode)" },
+	{ "backend", 'B', "NAME", 0,
+	  "Read FILE with backend NAME, sqlite or lmdb (in-process mode)" },
+	{ "views", 'V', "FILE", 0,
+	  "Answer by the views in FILE, by EDNS Client Subnet only "
+	  "(in-process mode)" },
+	{ "speed", 'x', "FACTOR", 0,
+	  "Replay at FACTOR times recorded speed (default: maximum)" },
+	{ "window", 'w', "N", 0,
+	  "Keep at most N UDP queries outstanding (default 256)" },
+	{ "timeout", 't', "MS", 0,
+	  "Give up on a UDP query after MS milliseconds (default 2000)" },
+	{ "count", 'n', "N", 0,
+	  "Replay only the first N queries" },
+	{ "record", 'R', "FILE", 0,
+	  "Write responses to golden FILE" },
+	{ "compare", 'C', "FILE", 0,
+	  "Compare responses against golden FILE" },
+
+	{ }
+};
+
+static error_t parse_opt (int key, char *arg, struct argp_state *state);
+static const struct argp argp = { options, parse_opt, NULL, doc };
+
+static error_t parse_opt (int key, char *arg, struct argp_state *state)
+{
+	switch(key) {
+	case 'r':
+		strcpy(pcap_fn, arg);
+		break;
+	case 's':
+		strncpy(server, arg, sizeof(server) - 1);
+		break;
+	case 'p':
+		server_port = atoi(arg);
+		break;
+	case 'c':
+		dns_port_filter = atoi(arg);
+		break;
+	case 'i':
+		in_process = true;
+		break;
+	case 'T':
+		use_tls = true;
+		break;
+	case 'N':
+		tls_conns = atoi(arg);
+		if (tls_conns < 1) {
+			fprintf(stderr, "invalid connection count %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'Z':
+		tls_resume = false;
+		break;
+	case 'f':
+		strcpy(db_fn, arg);
+		break;
+	case 'B':
+		if (strlen(arg) < sizeof(backend_name))
+			strcpy(backend_name, arg);
+		else {
+			fprintf(stderr, "invalid backend %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'V':
+		strcpy(views_fn, arg);
+		break;
+	case 'x':
+		speed = atof(arg);
+		break;
+	case 'w':
+		window = atoi(arg);
+		if (window < 1 || window > 32768) {
+			fprintf(stderr, "invalid window %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 't':
+		timeout_ms = atoi(arg);
+		break;
+	case 'n':
+		limit = strtoul(arg, NULL, 10);
+		break;
+	case 'R':
+		strcpy(golden_fn, arg);
+		golden_write = true;
+		break;
+	case 'C':
+		strcpy(golden_fn, arg);
+		golden_write = false;
+		break;
+	case ARGP_KEY_ARG:
+		argp_usage(state);	/* too many args */
+		break;
+	case ARGP_KEY_END:
+		if (!pcap_fn[0])
+			argp_usage(state);
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+static double now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static uint32_t get32(const unsigned char *p, bool swap)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return swap ? GUINT32_SWAP_LE_BE(v) : v;
+}
+
+/*
+ * Find the UDP payload of a DNS query inside one captured frame.
+ * Returns the payload offset, or -1 if the frame is not a query.
+ */
+static int frame_query(const unsigned char *p, unsigned int len,
+		       unsigned int linktype, unsigned int *qlen)
+{
+	unsigned int off = 0, ethertype = 0, proto, iplen;
+	uint16_t dport, ulen;
+
+	switch (linktype) {
+	case LINKTYPE_ETHERNET:
+		if (len < 14)
+			return -1;
+		ethertype = (p[12] << 8) | p[13];
+		off = 14;
+		while (ethertype == 0x8100 || ethertype == 0x88a8) {
+			if (len < off + 4)
+				return -1;
+			ethertype = (p[off + 2] << 8) | p[off + 3];
+			off += 4;
+		}
+		break;
+	case LINKTYPE_LINUX_SLL:
+		if (len < 16)
+			return -1;
+		ethertype = (p[14] << 8) | p[15];
+		off = 16;
+		break;
+	case LINKTYPE_LINUX_SLL2:
+		if (len < 20)
+			return -1;
+		ethertype = (p[0] << 8) | p[1];
+		off = 20;
+		break;
+	case LINKTYPE_NULL:
+		if (len < 4)
+			return -1;
+		off = 4;
+		ethertype = ((p[off] >> 4) == 6) ? 0x86dd : 0x0800;
+		break;
+	case LINKTYPE_RAW:
+		if (len < 1)
+			return -1;
+		ethertype = ((p[0] >> 4) == 6) ? 0x86dd : 0x0800;
+		break;
+	default:
+		return -1;
+	}
+
+	if (ethertype == 0x0800) {
+		if (len < off + 20 || (p[off] >> 4) != 4)
+			return -1;
+		iplen = (p[off] & 0x0f) * 4;
+		proto = p[off + 9];
+		/* skip fragments */
+		if (((p[off + 6] & 0x3f) << 8 | p[off + 7]) != 0)
+			return -1;
+	} else if (ethertype == 0x86dd) {
+		if (len < off + 40)
+			return -1;
+		iplen = 40;
+		proto = p[off + 6];
+	} else
+		return -1;
+
+	if (proto != 17 || len < off + iplen + 8)
+		return -1;
+	off += iplen;
+
+	dport = (p[off + 2] << 8) | p[off + 3];
+	ulen = (p[off + 4] << 8) | p[off + 5];
+	if (dport != dns_port_filter || ulen < 8 + sizeof(struct dns_msg_hdr))
+		return -1;
+
+	ulen -= 8;
+	off += 8;
+	if (len < off + ulen)
+		return -1;
+
+	/* queries only */
+	if (p[off + 2] & hdr_response)
+		return -1;
+
+	*qlen = ulen;
+	return off;
+}
+
+static void load_pcap(void)
+{
+	unsigned char hdr[24], rec[16];
+	unsigned char *frame;
+	unsigned int linktype;
+	uint32_t magic;
+	bool swap, nsec;
+	FILE *f;
+
+	f = fopen(pcap_fn, "r");
+	if (!f) {
+		perror(pcap_fn);
+		exit(1);
+	}
+
+	if (fread(hdr, sizeof(hdr), 1, f) != 1) {
+		fprintf(stderr, "%s: short pcap header\n", pcap_fn);
+		exit(1);
+	}
+
+	memcpy(&magic, hdr, 4);
+	swap = (magic == GUINT32_SWAP_LE_BE(PCAP_MAGIC_USEC) ||
+		magic == GUINT32_SWAP_LE_BE(PCAP_MAGIC_NSEC));
+	magic = get32(hdr, swap);
+	if (magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC) {
+		fprintf(stderr, "%s: not a pcap file\n", pcap_fn);
+		exit(1);
+	}
+	nsec = (magic == PCAP_MAGIC_NSEC);
+	linktype = get32(hdr + 20, swap) & 0xffff;
+
+	frame = g_malloc(MAX_MSG + 256);
+	queries = g_ptr_array_new();
+
+	while (fread(rec, sizeof(rec), 1, f) == 1) {
+		uint32_t caplen = get32(rec + 8, swap);
+		unsigned int qlen;
+		struct replay_q *q;
+		int off;
+
+		if (caplen > MAX_MSG + 256) {
+			fprintf(stderr, "%s: bad record length\n", pcap_fn);
+			exit(1);
+		}
+		if (fread(frame, caplen, 1, f) != 1)
+			break;
+
+		off = frame_query(frame, caplen, linktype, &qlen);
+		if (off < 0)
+			continue;
+
+		q = g_new0(struct replay_q, 1);
+		q->ts = get32(rec, swap) +
+			get32(rec + 4, swap) / (nsec ? 1e9 : 1e6);
+		q->len = qlen;
+		q->buf = g_memdup(frame + off, qlen);
+		q->latency = -1;
+		g_ptr_array_add(queries, q);
+
+		if (limit && queries->len >= limit)
+			break;
+	}
+
+	g_free(frame);
+	fclose(f);
+}
+
+static void store_response(struct replay_q *q, const char *buf,
+			   unsigned int len, double latency)
+{
+	q->latency = latency;
+	q->res_len = len;
+	q->res = g_memdup(buf, len);
+
+	/* golden files ignore the (rewritten) message id */
+	if (len >= 2)
+		q->res[0] = q->res[1] = 0;
+}
+
+static double schedule(unsigned int i, double start)
+{
+	struct replay_q *first = g_ptr_array_index(queries, 0);
+	struct replay_q *q = g_ptr_array_index(queries, i);
+
+	if (speed <= 0)
+		return start;
+	return start + (q->ts - first->ts) * 1e6 / speed;
+}
+
+struct inproc_req {
+	struct replay_q		*q;
+	double			t0;
+	bool			done;
+};
+
+static void inproc_done(struct dnsres *res, bool hit, void *data)
+{
+	struct inproc_req *req = data;
+
+	if (res)
+		store_response(req->q, res->buf, res->buflen,
+			       now_usec() - req->t0);
+	req->done = true;
+}
+
+static void run_in_process(void)
+{
+	double start = now_usec();
+	unsigned int i;
+
+	timer_init();
+	view_init();
+	backend_init();
+	dns_init();
+
+	for (i = 0; i < queries->len; i++) {
+		struct inproc_req req;
+		double due = schedule(i, start);
+
+		req.q = g_ptr_array_index(queries, i);
+		req.done = false;
+
+		req.t0 = now_usec();
+		if (req.t0 < due) {
+			g_usleep(due - req.t0);
+			req.t0 = now_usec();
+		}
+
+		/* one query at a time; misses complete on the main loop */
+		dns_message(req.q->buf, req.q->len, NULL, 0, inproc_done,
+			    &req);
+		while (!req.done)
+			g_main_context_iteration(NULL, TRUE);
+
+		/* run other deferred work, as the daemon would */
+		while (g_main_context_pending(NULL))
+			g_main_context_iteration(NULL, FALSE);
+	}
+
+	backend_exit();
+}
+
+/* recv(), noting the drop count SO_RXQ_OVFL attaches to each datagram */
+static ssize_t udp_recv(int fd, char *buf, size_t len)
+{
+	char ctl[CMSG_SPACE(sizeof(uint32_t))];
+	struct iovec iov = { buf, len };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	ssize_t rc;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl;
+	msg.msg_controllen = sizeof(ctl);
+
+	rc = recvmsg(fd, &msg, 0);
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); rc > 0 && cmsg;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+#ifdef SO_RXQ_OVFL
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SO_RXQ_OVFL)
+			memcpy(&udp_client_drops, CMSG_DATA(cmsg),
+			       sizeof(uint32_t));
+#endif
+	}
+
+	return rc;
+}
+
+static void run_udp(void)
+{
+	struct sockaddr_in sin;
+	unsigned int *inflight, n_inflight = 0, next = 0, oldest = 0;
+	double *sent_at, start;
+	char buf[MAX_MSG];
+	int fd, one = 1, rcvbuf = UDP_RCVBUF;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(server_port);
+	if (inet_pton(AF_INET, server, &sin.sin_addr) != 1) {
+		fprintf(stderr, "invalid server address %s\n", server);
+		exit(1);
+	}
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+		perror("socket");
+		exit(1);
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	/* a large burst should only overflow the server's queue, not ours */
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+#ifdef SO_RXQ_OVFL
+	setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+#endif
+
+	/* message id -> query index + 1, of queries still in flight */
+	inflight = g_new0(unsigned int, 65536);
+	sent_at = g_new0(double, queries->len);
+
+	start = now_usec();
+
+	while (next < queries->len || n_inflight > 0) {
+		double now = now_usec(), wait_us = 10000;
+		struct pollfd pfd;
+		ssize_t rc;
+
+		/* send what is due */
+		while (next < queries->len && n_inflight < window) {
+			struct replay_q *q = g_ptr_array_index(queries, next);
+			double due = schedule(next, start);
+			uint16_t id = next & 0xffff;
+
+			if (due > now) {
+				wait_us = MIN(wait_us, due - now);
+				break;
+			}
+			if (inflight[id])	/* id still taken */
+				break;
+
+			memcpy(buf, q->buf, q->len);
+			buf[0] = id >> 8;
+			buf[1] = id & 0xff;
+
+			sent_at[next] = now_usec();
+			if (send(fd, buf, q->len, 0) < 0 && errno != EAGAIN) {
+				perror("send");
+				exit(1);
+			}
+
+			inflight[id] = next + 1;
+			n_inflight++;
+			next++;
+		}
+
+		/* expire timed out queries, oldest first */
+		while (oldest < next) {
+			uint16_t id = oldest & 0xffff;
+
+			if (inflight[id] == oldest + 1) {
+				if (now - sent_at[oldest] < timeout_ms * 1e3)
+					break;
+				inflight[id] = 0;
+				n_inflight--;
+			}
+			oldest++;
+		}
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, (int) (wait_us / 1000)) < 0 && errno != EINTR) {
+			perror("poll");
+			exit(1);
+		}
+
+		while ((rc = udp_recv(fd, buf, sizeof(buf))) > 0) {
+			uint16_t id;
+			unsigned int idx;
+
+			if (rc < (ssize_t) sizeof(struct dns_msg_hdr))
+				continue;
+
+			id = ((unsigned char) buf[0] << 8) |
+			     (unsigned char) buf[1];
+			idx = inflight[id];
+			if (!idx)
+				continue;	/* late or stray */
+			idx--;
+
+			store_response(g_ptr_array_index(queries, idx), buf,
+				       rc, now_usec() - sent_at[idx]);
+			inflight[id] = 0;
+			n_inflight--;
+		}
+	}
+
+	close(fd);
+	g_free(inflight);
+	g_free(sent_at);
+}
+
+#ifdef HAVE_OPENSSL
+
+static SSL_SESSION *tls_session;	/* latest ticket, to resume with */
+
+/* TLS 1.3 tickets arrive after the handshake */
+static int tls_new_session(SSL *ssl, SSL_SESSION *sess)
+{
+	if (tls_session)
+		SSL_SESSION_free(tls_session);
+	tls_session = sess;
+	return 1;			/* we keep the reference */
+}
+
+static int tls_connect(void)
+{
+	struct sockaddr_in sin;
+	struct timeval tv;
+	int fd, one = 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(server_port);
+	if (inet_pton(AF_INET, server, &sin.sin_addr) != 1) {
+		fprintf(stderr, "invalid server address %s\n", server);
+		exit(1);
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	/* a server that stops answering ends the connection's run */
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	return fd;
+}
+
+/* take whole responses off the front of 'in' */
+static void tls_responses(GString *in, unsigned int *inflight,
+			  unsigned int *n_inflight, const double *sent_at)
+{
+	unsigned int off = 0, len, idx;
+	uint16_t id;
+
+	while (in->len - off >= 2) {
+		len = ((unsigned char) in->str[off] << 8) |
+		      (unsigned char) in->str[off + 1];
+		if (in->len - off - 2 < len)
+			break;
+		off += 2;
+
+		if (len >= sizeof(struct dns_msg_hdr)) {
+			id = ((unsigned char) in->str[off] << 8) |
+			     (unsigned char) in->str[off + 1];
+			idx = inflight[id];
+			if (idx) {
+				idx--;
+				store_response(g_ptr_array_index(queries, idx),
+					       in->str + off, len,
+					       now_usec() - sent_at[idx]);
+				inflight[id] = 0;
+				(*n_inflight)--;
+			}
+		}
+		off += len;
+	}
+
+	g_string_erase(in, 0, off);
+}
+
+/* queries [first, last) over one connection, pipelined */
+static void tls_run_conn(SSL_CTX *ctx, unsigned int first, unsigned int last,
+			 double start, unsigned int *inflight, double *sent_at)
+{
+	unsigned int n_inflight = 0, next = first;
+	char buf[MAX_MSG + 2];
+	GString *in = g_string_new(NULL);
+	double t0, hs, last_io;
+	SSL *ssl;
+	int fd, rc;
+
+	fd = tls_connect();
+	ssl = SSL_new(ctx);
+	SSL_set_fd(ssl, fd);
+	if (tls_resume && tls_session)
+		SSL_set_session(ssl, tls_session);
+
+	t0 = now_usec();
+	if (SSL_connect(ssl) != 1) {
+		fprintf(stderr, "TLS handshake with %s:%d failed\n",
+			server, server_port);
+		exit(1);
+	}
+	hs = now_usec() - t0;
+	g_array_append_val(SSL_session_reused(ssl) ? hs_resumed : hs_full, hs);
+	last_io = now_usec();
+
+	while (next < last || n_inflight > 0) {
+		double now = now_usec(), wait_us = 10000;
+		struct pollfd pfd;
+
+		while (next < last && n_inflight < window) {
+			struct replay_q *q = g_ptr_array_index(queries, next);
+			double due = schedule(next, start);
+			uint16_t id = next & 0xffff;
+
+			if (due > now) {
+				wait_us = MIN(wait_us, due - now);
+				break;
+			}
+			if (inflight[id])	/* id still taken */
+				break;
+
+			buf[0] = q->len >> 8;
+			buf[1] = q->len & 0xff;
+			memcpy(buf + 2, q->buf, q->len);
+			buf[2] = id >> 8;
+			buf[3] = id & 0xff;
+
+			sent_at[next] = now_usec();
+			if (SSL_write(ssl, buf, q->len + 2) <= 0)
+				goto out;
+			last_io = sent_at[next];
+
+			inflight[id] = next + 1;
+			n_inflight++;
+			next++;
+		}
+
+		if (!SSL_pending(ssl)) {
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			rc = poll(&pfd, 1, (int) (wait_us / 1000));
+			if (rc < 0 && errno != EINTR) {
+				perror("poll");
+				exit(1);
+			}
+			if (rc <= 0) {
+				if (n_inflight &&
+				    now_usec() - last_io > timeout_ms * 1e3)
+					goto out;	/* server went quiet */
+				continue;
+			}
+		}
+
+		rc = SSL_read(ssl, buf, sizeof(buf));
+		if (rc <= 0)
+			goto out;
+		g_string_append_len(in, buf, rc);
+		last_io = now_usec();
+		tls_responses(in, inflight, &n_inflight, sent_at);
+	}
+
+out:
+	/* whatever is still outstanding stays unanswered */
+	for (; first < next; first++)
+		if (inflight[first & 0xffff] == first + 1)
+			inflight[first & 0xffff] = 0;
+
+	SSL_shutdown(ssl);
+	SSL_free(ssl);
+	close(fd);
+	g_string_free(in, TRUE);
+}
+
+static void run_tls(void)
+{
+	unsigned int *inflight, i;
+	double *sent_at, start;
+	SSL_CTX *ctx;
+
+	ctx = SSL_CTX_new(TLS_client_method());
+	g_assert(ctx != NULL);
+
+	/* a benchmark, typically against a self-signed certificate */
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+					    SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, tls_new_session);
+
+	inflight = g_new0(unsigned int, 65536);
+	sent_at = g_new0(double, queries->len);
+	hs_full = g_array_new(FALSE, FALSE, sizeof(double));
+	hs_resumed = g_array_new(FALSE, FALSE, sizeof(double));
+
+	start = now_usec();
+	for (i = 0; i < tls_conns; i++)
+		tls_run_conn(ctx, (guint64) queries->len * i / tls_conns,
+			     (guint64) queries->len * (i + 1) / tls_conns,
+			     start, inflight, sent_at);
+
+	if (tls_session)
+		SSL_SESSION_free(tls_session);
+	SSL_CTX_free(ctx);
+	g_free(inflight);
+	g_free(sent_at);
+}
+
+#else /* !HAVE_OPENSSL */
+
+static void run_tls(void)
+{
+	fprintf(stderr, PROGRAM_NAME ": built without OpenSSL\n");
+	exit(1);
+}
+
+#endif /* HAVE_OPENSSL */
+
+static void golden_record(void)
+{
+	unsigned int i;
+	FILE *f = fopen(golden_fn, "w");
+
+	if (!f) {
+		perror(golden_fn);
+		exit(1);
+	}
+
+	for (i = 0; i < queries->len; i++) {
+		struct replay_q *q = g_ptr_array_index(queries, i);
+		uint32_t len = g_htonl(q->res_len);
+
+		fwrite(&len, 4, 1, f);
+		if (q->res_len)
+			fwrite(q->res, q->res_len, 1, f);
+	}
+
+	fclose(f);
+}
+
+static unsigned int golden_compare(void)
+{
+	unsigned int i, mismatch = 0;
+	char *buf = g_malloc(MAX_MSG);
+	FILE *f = fopen(golden_fn, "r");
+
+	if (!f) {
+		perror(golden_fn);
+		exit(1);
+	}
+
+	for (i = 0; i < queries->len; i++) {
+		struct replay_q *q = g_ptr_array_index(queries, i);
+		uint32_t len;
+
+		if (fread(&len, 4, 1, f) != 1) {
+			fprintf(stderr, "%s: ends after %u responses\n",
+				golden_fn, i);
+			mismatch += queries->len - i;
+			break;
+		}
+		len = g_ntohl(len);
+		if (len > MAX_MSG || (len && fread(buf, len, 1, f) != 1)) {
+			fprintf(stderr, "%s: corrupt\n", golden_fn);
+			exit(1);
+		}
+
+		if (len == q->res_len && !memcmp(buf, q->res, len))
+			continue;
+
+		if (mismatch++ < MAX_MISMATCH_REPORT)
+			fprintf(stderr, "query %u: response differs "
+				"(%u bytes, golden %u)\n", i, q->res_len, len);
+	}
+
+	fclose(f);
+	g_free(buf);
+	return mismatch;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void count_append(gpointer key, gpointer val, gpointer data)
+{
+	GArray *arr = data;
+	double d = GPOINTER_TO_UINT(val);
+
+	g_array_append_val(arr, d);
+}
+
+static int cmp_double_desc(const void *a, const void *b)
+{
+	return cmp_double(b, a);
+}
+
+/* share of traffic taken by the most popular 1% of questions */
+static double top_share(unsigned int *n_unique)
+{
+	GHashTable *counts = g_hash_table_new_full(g_str_hash, g_str_equal,
+						   g_free, NULL);
+	GArray *arr = g_array_new(FALSE, FALSE, sizeof(double));
+	unsigned int i, j, top;
+	double sum = 0;
+
+	for (i = 0; i < queries->len; i++) {
+		struct replay_q *q = g_ptr_array_index(queries, i);
+		unsigned int n;
+		GString *k = g_string_sized_new(q->len * 2);
+
+		/* question section, lower-cased and hex encoded, as key */
+		for (j = sizeof(struct dns_msg_hdr); j < q->len; j++)
+			g_string_append_printf(k, "%02x",
+				(unsigned char) g_ascii_tolower(q->buf[j]));
+
+		n = GPOINTER_TO_UINT(g_hash_table_lookup(counts, k->str));
+		g_hash_table_replace(counts, g_string_free(k, FALSE),
+				     GUINT_TO_POINTER(n + 1));
+	}
+
+	g_hash_table_foreach(counts, count_append, arr);
+	g_array_sort(arr, cmp_double_desc);
+
+	*n_unique = arr->len;
+	top = MAX(1, arr->len / 100);
+	for (i = 0; i < top && i < arr->len; i++)
+		sum += g_array_index(arr, double, i);
+
+	g_array_free(arr, TRUE);
+	g_hash_table_destroy(counts);
+
+	return sum / queries->len;
+}
+
+static double average(const GArray *arr)
+{
+	unsigned int i;
+	double sum = 0;
+
+	for (i = 0; i < arr->len; i++)
+		sum += g_array_index(arr, double, i);
+
+	return arr->len ? sum / arr->len : 0;
+}
+
+static void report(double elapsed)
+{
+	GArray *lat = g_array_new(FALSE, FALSE, sizeof(double));
+	unsigned int i, answered, n_unique, n_trunc = 0;
+	double share;
+
+	for (i = 0; i < queries->len; i++) {
+		struct replay_q *q = g_ptr_array_index(queries, i);
+		if (q->latency >= 0)
+			g_array_append_val(lat, q->latency);
+		if (q->res_len > 2 && (q->res[2] & hdr_trunc))
+			n_trunc++;
+	}
+	g_array_sort(lat, cmp_double);
+	answered = lat->len;
+
+	share = top_share(&n_unique);
+
+	printf("queries:     %u\n", queries->len);
+	printf("answered:    %u\n", answered);
+	printf("truncated:   %u\n", n_trunc);
+	printf("elapsed:     %.3f s\n", elapsed / 1e6);
+	printf("throughput:  %.0f qps\n",
+	       elapsed > 0 ? answered / (elapsed / 1e6) : 0);
+	if (!in_process && !use_tls)
+		printf("lost:        %u (%u dropped here)\n",
+		       queries->len - answered, udp_client_drops);
+
+	if (answered) {
+#define PCT(p) g_array_index(lat, double, (unsigned int) ((answered - 1) * (p)))
+		printf("latency us:  p50 %.1f  p90 %.1f  p99 %.1f  "
+		       "p99.9 %.1f  max %.1f\n",
+		       PCT(0.50), PCT(0.90), PCT(0.99), PCT(0.999), PCT(1.0));
+#undef PCT
+	}
+
+	printf("questions:   %u unique, top 1%% = %.1f%% of traffic\n",
+	       n_unique, share * 100);
+
+	if (use_tls)
+		printf("handshakes:  %u full, avg %.1f us; %u resumed, "
+		       "avg %.1f us\n", hs_full->len, average(hs_full),
+		       hs_resumed->len, average(hs_resumed));
+
+	if (in_process && (srvstat.mc_hit + srvstat.mc_miss))
+		printf("cache:       %.1f%% hit (%lu hit, %lu miss, "
+		       "%lu refresh, %lu sql)\n",
+		       100.0 * srvstat.mc_hit /
+			       (srvstat.mc_hit + srvstat.mc_miss),
+		       srvstat.mc_hit, srvstat.mc_miss, srvstat.mc_refresh,
+		       srvstat.sql_q);
+
+	g_array_free(lat, TRUE);
+}
+
+int main (int argc, char *argv[])
+{
+	unsigned int mismatch = 0;
+	double start, elapsed;
+	error_t rc;
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	rc = argp_parse(&argp, argc, argv, 0, NULL, NULL);
+	if (rc) {
+		fprintf(stderr, "argp_parse failed: %s\n", strerror(rc));
+		return 1;
+	}
+
+	load_pcap();
+	if (!queries->len) {
+		fprintf(stderr, "%s: no DNS queries found\n", pcap_fn);
+		return 1;
+	}
+
+	start = now_usec();
+	if (in_process)
+		run_in_process();
+	else if (use_tls)
+		run_tls();
+	else
+		run_udp();
+	elapsed = now_usec() - start;
+
+	report(elapsed);
+
+	if (golden_fn[0]) {
+		if (golden_write)
+			golden_record();
+		else {
+			mismatch = golden_compare();
+			printf("golden:      %u mismatches\n", mismatch);
+		}
+	}
+
+	return mismatch ? 1 : 0;
+}
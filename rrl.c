@@ -0,0 +1,154 @@
+/*
+ * Copyright 2006 Jeff Garzik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Response rate limiting for UDP.
+ *
+ * Each (client prefix, response class) pair owns a token bucket
+ * holding rrl_rate tokens, topped up every second.  Buckets live in a
+ * fixed size table; a key may hash to one of two adjacent slots, and
+ * when neither matches, the least recently refilled slot is recycled.
+ * A forgotten key simply starts again with a full bucket.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <glib.h>
+#include "dnsd.h"
+
+enum {
+	RRL_BUCKETS		= 1 << 16,	/* power of two */
+
+	RRL_V4_PREFIX		= 3,		/* bytes: /24 */
+	RRL_V6_PREFIX		= 7,		/* bytes: /56 */
+};
+
+enum rrl_class {
+	rrl_answer,
+	rrl_nodata,
+	rrl_nxdomain,
+	rrl_error,
+};
+
+struct rrl_bucket {
+	uint32_t		tag;		/* full key hash */
+	uint32_t		stamp;		/* last refill, in seconds */
+	int32_t			tokens;
+	uint32_t		n_limited;	/* responses over limit */
+};
+
+static struct rrl_bucket *rrl_table;
+static uint32_t rrl_seed;
+
+
+static enum rrl_class rrl_classify(const struct dnsres *res)
+{
+	const struct dns_msg_hdr *hdr = (const struct dns_msg_hdr *) res->buf;
+	unsigned int rcode = hdr->opts[1] & 0x0f;
+
+	if (rcode == rcode_nxdomain)
+		return rrl_nxdomain;
+	if (rcode != 0)
+		return rrl_error;
+	if (res->n_answers == 0)
+		return rrl_nodata;
+	return rrl_answer;
+}
+
+/* FNV-1a, seeded so that collisions cannot be chosen from outside */
+static uint32_t rrl_hash(const unsigned char *buf, unsigned int buflen,
+			 uint32_t hash)
+{
+	while (buflen-- > 0) {
+		hash ^= *buf++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static struct rrl_bucket *rrl_bucket_get(uint32_t hash, uint32_t now)
+{
+	struct rrl_bucket *b = &rrl_table[hash & (RRL_BUCKETS - 2)];
+
+	if (b[0].tag == hash)
+		return &b[0];
+	if (b[1].tag == hash)
+		return &b[1];
+
+	/* recycle the slot that has been idle longest */
+	if (b[1].stamp < b[0].stamp)
+		b++;
+
+	b->tag = hash;
+	b->stamp = now;
+	b->tokens = rrl_rate;
+	b->n_limited = 0;
+
+	return b;
+}
+
+enum rrl_action rrl_check(const unsigned char *addr, unsigned int addr_len,
+			  const struct dnsres *res)
+{
+	struct rrl_bucket *b;
+	unsigned char class;
+	uint32_t hash, now;
+
+	if (!rrl_table)
+		return rrl_send;
+
+	class = rrl_classify(res);
+
+	hash = rrl_hash(addr, addr_len == 4 ? RRL_V4_PREFIX : RRL_V6_PREFIX,
+			rrl_seed);
+	hash = rrl_hash(&class, 1, hash);
+
+	now = clock_now;
+	b = rrl_bucket_get(hash, now);
+
+	/* refill once per second; unused credit does not carry over */
+	if (now != b->stamp) {
+		b->tokens = rrl_rate;
+		b->stamp = now;
+	}
+
+	if (b->tokens > 0) {
+		b->tokens--;
+		return rrl_send;
+	}
+
+	b->n_limited++;
+	if (rrl_slip_ratio && (b->n_limited % rrl_slip_ratio) == 0)
+		return rrl_slip;
+
+	return rrl_drop;
+}
+
+void rrl_init(void)
+{
+	if (!rrl_rate)
+		return;
+
+	rrl_table = g_new0(struct rrl_bucket, RRL_BUCKETS);
+	g_assert(rrl_table != NULL);
+
+	rrl_seed = 2166136261U ^ (uint32_t) time(NULL) ^ (getpid() << 16);
+}
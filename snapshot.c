@@ -0,0 +1,382 @@
+/*
+ * Copyright 2006 Jeff Garzik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Message cache snapshots, so that a restarted server does not send
+ * its whole query load to the database at once.
+ *
+ * The cache is saved at shutdown, and every snap_interval seconds if
+ * set, and loaded back at startup.  Entries keep their remaining
+ * lifetime.  The SOA serial of every zone is saved too; an entry is
+ * only loaded if its question still falls in the same zone, at the
+ * same serial.
+ *
+ * File format, in host byte order:
+ *	"DVMC", uint32 version, uint64 save time (seconds)
+ *	uint32 zone count, then for each zone:
+ *		uint8 name length, name, uint32 serial
+ *	then entries, to the end of the file:
+ *		uint32 ttl, uint32 hits, uint16 key length,
+ *		uint16 response length, key, response
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <glib.h>
+#include "dnsd.h"
+
+enum {
+	SNAP_VERSION		= 1,
+	SNAP_HDR_LEN		= 16,
+	SNAP_ENT_LEN		= 12,		/* fixed part of an entry */
+};
+
+static GThread *saver;
+static volatile gint saving;
+static GHashTable *saving_zones;	/* serials, from a worker */
+
+
+static void put_zone(gpointer key, gpointer val, gpointer data)
+{
+	GString *s = data;
+	const char *name = key;
+	uint32_t serial = GPOINTER_TO_UINT(val);
+	uint8_t len = strlen(name);	/* names are at most 253 chars */
+
+	g_string_append_len(s, (char *) &len, 1);
+	g_string_append_len(s, name, len);
+	g_string_append_len(s, (char *) &serial, 4);
+}
+
+static void put_entry(const struct dnsres *res, unsigned int ttl, void *data)
+{
+	GString *s = data;
+	uint32_t ttl32 = ttl, hits = res->n_hits;
+	uint16_t key_len = res->key_len, buf_len = res->buflen;
+	gsize off;
+
+	if (res->key_len > 0xffff || res->buflen > 0xffff)
+		return;
+
+	g_string_append_len(s, (char *) &ttl32, 4);
+	g_string_append_len(s, (char *) &hits, 4);
+	g_string_append_len(s, (char *) &key_len, 2);
+	g_string_append_len(s, (char *) &buf_len, 2);
+	g_string_append_len(s, res->key, key_len);
+
+	/* the message id is that of the last requester; clear it */
+	off = s->len;
+	g_string_append_len(s, res->buf, buf_len);
+	s->str[off] = s->str[off + 1] = 0;
+}
+
+static GString *snapshot_build(GHashTable *zones)
+{
+	uint32_t ver = SNAP_VERSION, n_zones = 0;
+	uint64_t now = time(NULL);
+	GString *s;
+
+	s = g_string_new(NULL);
+	g_string_append_len(s, "DVMC", 4);
+	g_string_append_len(s, (char *) &ver, 4);
+	g_string_append_len(s, (char *) &now, 8);
+
+	n_zones = g_hash_table_size(zones);
+	g_string_append_len(s, (char *) &n_zones, 4);
+	g_hash_table_foreach(zones, put_zone, s);
+
+	dns_cache_foreach(put_entry, s);
+
+	return s;
+}
+
+/* write to a temporary file first, so a crash never leaves half a file */
+static void snapshot_write(GString *s)
+{
+	char tmp_fn[4200];
+	FILE *f;
+
+	sprintf(tmp_fn, "%s.tmp", snap_fn);
+
+	f = fopen(tmp_fn, "w");
+	if (!f) {
+		syslog(LOG_ERR, "cache snapshot %s: %m", tmp_fn);
+		return;
+	}
+
+	if (fwrite(s->str, s->len, 1, f) != 1 || fflush(f) ||
+	    fsync(fileno(f)) < 0) {
+		syslog(LOG_ERR, "cache snapshot %s: %m", tmp_fn);
+		fclose(f);
+		unlink(tmp_fn);
+		return;
+	}
+	fclose(f);
+
+	if (rename(tmp_fn, snap_fn) < 0)
+		syslog(LOG_ERR, "cache snapshot %s: %m", snap_fn);
+}
+
+static void *snapshot_writer(void *data)
+{
+	GString *s = data;
+
+	cpu_bind_any();
+	snapshot_write(s);
+	g_string_free(s, TRUE);
+
+	g_atomic_int_set(&saving, 0);
+	return NULL;
+}
+
+/* on a worker: a scan of every SOA, which may take a while */
+static void snapshot_serials(struct backend_db *db, void *data,
+			     unsigned long *n_q)
+{
+	GHashTable **zones = data;
+
+	if (db)
+		*zones = backend_zone_serials(db, n_q);
+}
+
+/* back on the main loop: copy the cache, and have a thread write it */
+static void snapshot_copy(void *data)
+{
+	GHashTable **zones = data;
+	GString *s;
+
+	if (!*zones) {
+		g_atomic_int_set(&saving, 0);
+		return;
+	}
+
+	s = snapshot_build(*zones);
+	g_hash_table_destroy(*zones);
+	*zones = NULL;
+
+	saver = g_thread_create(snapshot_writer, s, TRUE, NULL);
+	g_assert(saver != NULL);
+}
+
+/*
+ * Periodic save.  The zone serials are read on a worker, the cache is
+ * then copied on the main loop, which is quick, and the file written
+ * by a thread, which may not be.  Serials first: a zone that changes
+ * before the copy leaves entries that look older than they are, and
+ * are dropped at load, rather than stale ones that look current.
+ */
+static gboolean snapshot_poll(void *data)
+{
+	if (g_atomic_int_get(&saving))
+		return TRUE;		/* still busy with the last one */
+
+	if (saver)
+		g_thread_join(saver);
+	saver = NULL;
+
+	g_atomic_int_set(&saving, 1);
+	backend_run(snapshot_serials, snapshot_copy, &saving_zones);
+
+	return TRUE;
+}
+
+/* enclosing zone of 'name', if any, with its serial */
+static const char *zone_of(GHashTable *zones, const char *name,
+			   unsigned int *serial)
+{
+	gpointer key, val;
+
+	while (1) {
+		if (g_hash_table_lookup_extended(zones, name, &key, &val)) {
+			*serial = GPOINTER_TO_UINT(val);
+			return key;
+		}
+
+		name = strchr(name, '.');
+		if (!name)
+			return NULL;
+		name++;
+	}
+}
+
+static bool snapshot_valid(const struct dnsres *res, GHashTable *old_zones,
+			   GHashTable *zones)
+{
+	const char *old_zone, *zone;
+	unsigned int old_serial = 0, serial = 0;
+	GList *tmp;
+
+	for (tmp = res->queries; tmp; tmp = tmp->next) {
+		const struct dnsq *q = tmp->data;
+
+		old_zone = zone_of(old_zones, q->name, &old_serial);
+		zone = zone_of(zones, q->name, &serial);
+
+		if (!old_zone || !zone || strcmp(old_zone, zone) ||
+		    old_serial != serial)
+			return false;
+	}
+
+	return true;
+}
+
+static void snapshot_load(void)
+{
+	GHashTable *old_zones, *zones;
+	gchar *buf;
+	gsize len, off;
+	uint32_t ver, n_zones, i, n_loaded = 0, n_dropped = 0;
+	uint64_t saved;
+	time_t age;
+
+	if (!g_file_get_contents(snap_fn, &buf, &len, NULL))
+		return;			/* first start: nothing to load */
+
+	if (len < SNAP_HDR_LEN + 4 || memcmp(buf, "DVMC", 4)) {
+		syslog(LOG_ERR, "cache snapshot %s: bad header", snap_fn);
+		g_free(buf);
+		return;
+	}
+
+	memcpy(&ver, buf + 4, 4);
+	memcpy(&saved, buf + 8, 8);
+	if (ver != SNAP_VERSION) {
+		syslog(LOG_ERR, "cache snapshot %s: version %u not supported",
+		       snap_fn, ver);
+		g_free(buf);
+		return;
+	}
+
+	age = time(NULL) - (time_t) saved;
+	if (age < 0)
+		age = 0;
+
+	old_zones = g_hash_table_new_full(g_str_hash, g_str_equal,
+					  g_free, NULL);
+	g_assert(old_zones != NULL);
+
+	off = SNAP_HDR_LEN;
+	memcpy(&n_zones, buf + off, 4);
+	off += 4;
+
+	for (i = 0; i < n_zones; i++) {
+		unsigned int name_len;
+		uint32_t serial;
+
+		if (off >= len)
+			goto bad_file;
+		name_len = (unsigned char) buf[off];
+		if ((off + 1 + name_len + 4) > len)
+			goto bad_file;
+
+		memcpy(&serial, buf + off + 1 + name_len, 4);
+		g_hash_table_insert(old_zones,
+				    g_strndup(buf + off + 1, name_len),
+				    GUINT_TO_POINTER(serial));
+
+		off += 1 + name_len + 4;
+	}
+
+	zones = backend_zone_serials(NULL, NULL);
+
+	while (off < len) {
+		struct dnsres *res;
+		const char *key;
+		uint32_t ttl, hits;
+		uint16_t key_len, buf_len;
+
+		if ((off + SNAP_ENT_LEN) > len)
+			break;
+
+		memcpy(&ttl, buf + off, 4);
+		memcpy(&hits, buf + off + 4, 4);
+		memcpy(&key_len, buf + off + 8, 2);
+		memcpy(&buf_len, buf + off + 10, 2);
+		off += SNAP_ENT_LEN;
+
+		if ((off + key_len + buf_len) > len)
+			break;
+
+		key = buf + off;
+		off += key_len + buf_len;
+
+		if (ttl <= age)
+			continue;	/* expired while we were down */
+
+		res = dns_cache_entry(key, key_len, key + key_len, buf_len);
+		if (!res)
+			continue;
+
+		if (!snapshot_valid(res, old_zones, zones)) {
+			dnsres_unref(res);
+			n_dropped++;
+			continue;
+		}
+
+		dns_cache_insert(key, key_len, res, ttl - age, hits);
+		dnsres_unref(res);
+		n_loaded++;
+	}
+
+	syslog(LOG_INFO, "cache snapshot: loaded %u entries, %u stale",
+	       n_loaded, n_dropped);
+
+	g_hash_table_destroy(zones);
+	g_hash_table_destroy(old_zones);
+	g_free(buf);
+	return;
+
+bad_file:
+	syslog(LOG_ERR, "cache snapshot %s: truncated", snap_fn);
+	g_hash_table_destroy(old_zones);
+	g_free(buf);
+}
+
+void snapshot_init(void)
+{
+	if (!snap_fn[0])
+		return;
+
+	snapshot_load();
+
+	if (snap_interval)
+		g_timeout_add(snap_interval * 1000, snapshot_poll, NULL);
+}
+
+void snapshot_exit(void)
+{
+	GHashTable *zones;
+	GString *s;
+
+	if (!snap_fn[0])
+		return;
+
+	if (saver)
+		g_thread_join(saver);
+	saver = NULL;
+
+	zones = backend_zone_serials(NULL, NULL);
+	s = snapshot_build(zones);
+	g_hash_table_destroy(zones);
+	snapshot_write(s);
+	g_string_free(s, TRUE);
+}
@@ -18,71 +18,437 @@
  *
  */
 
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#ifdef SO_MEMINFO
+#include <linux/sock_diag.h>
+#endif
 #include <glib.h>
 #include <gnet.h>
 #include "dnsd.h"
 
+enum {
+	XFR_MAX_WRITES		= 2,	/* xfr messages queued per conn */
+
+	UDP_RING		= 8192,	/* datagrams a --low-latency buffer holds */
+	UDP_TRUESIZE		= 1536,	/* kernel memory per small datagram */
+	UDP_BUSY_POLL_US	= 50,
+	UDP_DROP_CHECK_MS	= 1000,
+};
+
 enum client_state {
 	idle,
 	msglen,
 	msg,
+	shut,		/* reads no more; closes on the next tick */
 };
 
 struct client {
-	GConn			 *conn;
+	GConn			 *conn;		/* plain TCP, or */
+	struct tls_conn		*tls;		/* DNS over TLS */
+	GInetAddr		*addr;
 	enum client_state	state;
+
+	unsigned int		n_writes;	/* writes not yet sent */
+	struct xfr		*xfr;		/* outbound zone transfer */
+
+	unsigned int		n_refs;		/* conn + queries in flight */
+	bool			closed;
+	struct timer		idle;		/* closes a quiet connection */
+};
+
+/* a query waiting for its answer */
+struct dns_req {
+	GTimeVal		start;
+	GInetAddr		*src;		/* UDP */
+	struct client		*cli;		/* TCP */
 };
 
 static GUdpSocket *udpsock;
+static int udp_fd;
+static uint32_t udp_drops;			/* kernel's count, last seen */
+static GList *xfr_allow;			/* of GInetAddr */
+static GList *update_allow;			/* of GInetAddr */
 
 
-static void udp_message(GUdpSocket *sock, const GInetAddr *src,
-			const char *buf, unsigned int buflen)
+/* raw client address; IPv4-mapped IPv6 is reduced to plain IPv4 */
+static unsigned int client_addr(const GInetAddr *addr, unsigned char *buf)
 {
-	struct dnsres *res = dns_message(buf, buflen);
+	static const unsigned char v4mapped[12] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+	};
+	unsigned int len = gnet_inetaddr_get_length(addr);
+
+	gnet_inetaddr_get_bytes(addr, (gchar *) buf);
+	if (len == 16 && !memcmp(buf, v4mapped, sizeof(v4mapped))) {
+		memmove(buf, buf + 12, 4);
+		len = 4;
+	}
 
-	srvstat.udp_q++;
+	return len;
+}
+
+/* localhost, or a peer listed in 'allow' */
+static bool peer_allowed(const GList *allow, const GInetAddr *addr)
+{
+	const GList *tmp;
+
+	if (gnet_inetaddr_is_loopback(addr))
+		return true;
+
+	for (tmp = allow; tmp; tmp = tmp->next)
+		if (gnet_inetaddr_noport_equal(tmp->data, addr))
+			return true;
+
+	return false;
+}
+
+/* largest UDP response the requester accepts (RFC 6891, 6.2.5) */
+static unsigned int udp_limit(const struct dnsres *res)
+{
+	if (!res->edns)
+		return udp_max_plain;
+
+	return CLAMP(res->udp_size, udp_max_plain, edns_udp_size);
+}
+
+static void udp_send_tc(const struct dnsres *res, const GInetAddr *dest)
+{
+	char tc[2048];
+	unsigned int len;
 
-	if (res) {
-		gnet_udp_socket_send(sock, res->buf, res->buflen, src);
-		dnsres_unref(res);
+	len = dns_truncate(res, tc, sizeof(tc));
+	if (len)
+		gnet_udp_socket_send(udpsock, tc, len, dest);
+}
+
+static void udp_done(struct dnsres *res, bool hit, void *data)
+{
+	struct dns_req *req = data;
+	enum rrl_action action = rrl_send;
+	unsigned char addr[16];
+	unsigned int addr_len = 0;
+
+	if (!res)
+		goto out;
+
+	/* zone transfers are TCP-only */
+	if (res->xfr)
+		dns_set_rcode(res, rcode_notimpl);
+
+	/* an update is answered once committed; 'done' is us again */
+	if (res->update) {
+		if (peer_allowed(update_allow, req->src)) {
+			update_submit(res, udp_done, req);
+			return;
+		}
+		dns_set_rcode(res, rcode_refused);
+	}
+
+	if (rrl_rate || qlog_fn[0])
+		addr_len = client_addr(req->src, addr);
+
+	if (rrl_rate)
+		action = rrl_check(addr, addr_len, res);
+
+	switch (action) {
+	case rrl_send:
+		/* too large for the requester: have it retry over TCP */
+		if (res->buflen > udp_limit(res)) {
+			srvstat.udp_trunc++;
+			udp_send_tc(res, req->src);
+		} else
+			gnet_udp_socket_send(udpsock, res->buf, res->buflen,
+					     req->src);
+		break;
+
+	case rrl_slip:
+		srvstat.rrl_slip++;
+		udp_send_tc(res, req->src);
+		break;
+
+	case rrl_drop:
+		srvstat.rrl_drop++;
+		break;
 	}
+
+	if (qlog_fn[0])
+		qlog_query(&req->start, addr, addr_len, res, false, hit);
+
+out:
+	gnet_inetaddr_unref(req->src);
+	g_slice_free(struct dns_req, req);
 }
 
+/* takes over the caller's reference to 'src' */
+static void udp_message(struct dns_msg_in *m, GInetAddr *src)
+{
+	struct dns_req *req;
+
+	srvstat.udp_q++;
+
+	req = g_slice_new0(struct dns_req);
+	g_assert(req != NULL);
+
+	req->src = src;
+	if (qlog_fn[0])
+		g_get_current_time(&req->start);
+
+	m->udp = true;
+	m->addr_len = views_fn[0] ? client_addr(src, m->addr) : 0;
+	m->done = udp_done;
+	m->data = req;
+}
+
+/*
+ * Drain whatever datagrams are already waiting, up to a batch, and
+ * hand them to dns_message_batch() together so their cache lookups
+ * overlap.  Under light load the batch is a single request.
+ */
 static gboolean udp_rx (GIOChannel *source, GIOCondition condition,
                                              void *data)
 {
-	char buf[2048];
+	static char bufs[dns_batch_max][2048];
+	struct dns_msg_in msgs[dns_batch_max];
+	unsigned int n = 0;
 	int bytes;
-	GInetAddr *src = NULL;
+	GInetAddr *src;
+
+	do {
+		src = NULL;
+		bytes = gnet_udp_socket_receive(udpsock, bufs[n],
+						sizeof(bufs[n]), &src);
+		g_assert (bytes > 0);
+		g_assert (src != NULL);
 
-	bytes = gnet_udp_socket_receive(udpsock, buf, sizeof(buf), &src);
-	g_assert (bytes > 0);
-	g_assert (src != NULL);
+		msgs[n].buf = bufs[n];
+		msgs[n].buflen = bytes;
+		udp_message(&msgs[n], src);
+		n++;
+	} while (n < dns_batch_max && gnet_udp_socket_has_packet(udpsock));
 
-	udp_message(udpsock, src, buf, bytes);
+	dns_message_batch(msgs, n);
 
 	return TRUE; /* poll again */
 }
 
-static void tcp_message(struct client *cli, const char *buf, unsigned int buflen)
+static void cli_readn(struct client *cli, unsigned int n)
+{
+	if (cli->tls)
+		tls_conn_readn(cli->tls, n);
+	else
+		gnet_conn_readn(cli->conn, n);
+}
+
+static void cli_write_msg(struct client *cli, const struct dnsres *res)
+{
+	char *buf = g_malloc(res->buflen + 2);
+	uint16_t msglen = g_htons(res->buflen);
+
+	/* length prefix and message go out as a single write (TLS record) */
+	memcpy(buf, &msglen, 2);
+	memcpy(buf + 2, res->buf, res->buflen);
+
+	if (cli->tls)
+		tls_conn_write(cli->tls, buf, res->buflen + 2);
+	else
+		gnet_conn_write(cli->conn, buf, res->buflen + 2);
+	cli->n_writes++;
+
+	g_free(buf);
+}
+
+/*
+ * Have the next zone transfer message built, as long as the client
+ * keeps draining its write queue.  Called again from GNET_CONN_WRITE
+ * and as each message comes back from the backend, so a large zone
+ * is interleaved with other work on the main loop.
+ */
+static void cli_xfr_pump(struct client *cli)
 {
-	struct dnsres *res = dns_message(buf, buflen);
+	if (cli->xfr && !xfr_busy(cli->xfr) &&
+	    cli->n_writes < XFR_MAX_WRITES)
+		xfr_next(cli->xfr);
+}
 
-	srvstat.tcp_q++;
+static void cli_xfr_msg(struct dnsres *msg, void *data)
+{
+	struct client *cli = data;
 
-	if (res) {
-		uint16_t msglen = g_htons(res->buflen);
-		gnet_conn_write(cli->conn, (gchar *) &msglen, 2);
-		gnet_conn_write(cli->conn, res->buf, res->buflen);
-		dnsres_unref(res);
+	if (!msg) {
+		xfr_end(cli->xfr);
+		cli->xfr = NULL;
+		return;
+	}
+
+	cli_write_msg(cli, msg);
+	cli_xfr_pump(cli);
+}
+
+
+static void tcp_xfr_start(struct client *cli, struct dnsres *res)
+{
+	if (cli->xfr || !peer_allowed(xfr_allow, cli->addr)) {
+		dns_set_rcode(res, rcode_refused);
+		cli_write_msg(cli, res);
+		return;
 	}
+
+	/* the first message says NOTAUTH if the zone is not ours */
+	cli->xfr = xfr_begin(res, cli_xfr_msg, cli);
+	cli_xfr_pump(cli);
+}
+
+static void cli_put(struct client *cli)
+{
+	g_assert(cli->n_refs > 0);
+
+	if (--cli->n_refs == 0) {
+		gnet_inetaddr_unref(cli->addr);
+		g_slice_free(struct client, cli);
+	}
+}
+
+static void tcp_done(struct dnsres *res, bool hit, void *data)
+{
+	struct dns_req *req = data;
+	struct client *cli = req->cli;
+	unsigned char addr[16];
+
+	/* the connection may have gone away during the lookup */
+	if (!res || cli->closed)
+		goto out;
+
+	if (res->xfr)
+		tcp_xfr_start(cli, res);
+	else if (res->update && peer_allowed(update_allow, cli->addr)) {
+		update_submit(res, tcp_done, req);
+		return;
+	} else {
+		if (res->update)
+			dns_set_rcode(res, rcode_refused);
+		cli_write_msg(cli, res);
+	}
+
+	if (qlog_fn[0])
+		qlog_query(&req->start, addr,
+			   client_addr(cli->addr, addr),
+			   res, true, hit);
+
+out:
+	cli_put(cli);
+	g_slice_free(struct dns_req, req);
+}
+
+static void tcp_message(struct client *cli, const char *buf, unsigned int buflen)
+{
+	struct dns_req *req;
+	unsigned char addr[16];
+	unsigned int addr_len = 0;
+
+	if (cli->tls)
+		srvstat.tls_q++;
+	else
+		srvstat.tcp_q++;
+
+	req = g_slice_new0(struct dns_req);
+	g_assert(req != NULL);
+
+	req->cli = cli;
+	cli->n_refs++;
+	if (qlog_fn[0])
+		g_get_current_time(&req->start);
+
+	if (views_fn[0])
+		addr_len = client_addr(cli->addr, addr);
+
+	dns_message(buf, buflen, addr, addr_len, tcp_done, req);
 }
 
 static void cli_close(struct client *cli)
 {
-	gnet_conn_unref(cli->conn);
-	g_slice_free(struct client, cli);
+	timer_del(&cli->idle);
+
+	if (cli->xfr)
+		xfr_end(cli->xfr);
+	cli->xfr = NULL;
+	cli->closed = true;
+
+	if (cli->tls)
+		tls_conn_unref(cli->tls);
+	else
+		gnet_conn_unref(cli->conn);
+	cli_put(cli);
+}
+
+static void cli_busy(struct client *cli)
+{
+	if (tcp_timeout && cli->state != shut)
+		timer_add(&cli->idle, tcp_timeout * 1000);
+}
+
+/*
+ * Neither read from nor written to for tcp_timeout seconds.  A lookup
+ * still at the backend is ours to finish; a client that has stopped
+ * reading its answers, or its zone transfer, is not waited for.  Nor
+ * is one that sent an empty message.
+ */
+static void cli_idle(struct timer *t, void *data)
+{
+	struct client *cli = data;
+
+	if (cli->state == shut) {
+		cli_close(cli);
+		return;
+	}
+
+	if (cli->n_refs > 1) {
+		cli_busy(cli);
+		return;
+	}
+
+	srvstat.tcp_idle++;
+	cli_close(cli);
+}
+
+static void cli_written(struct client *cli)
+{
+	cli_busy(cli);
+
+	if (cli->n_writes > 0)
+		cli->n_writes--;
+	cli_xfr_pump(cli);
+}
+
+static void cli_read(struct client *cli, const char *buf, unsigned int len)
+{
+	cli_busy(cli);
+
+	if (cli->state == msglen) {
+		/* TLS hands over unaligned buffers */
+		int msglen = ((unsigned char) buf[0] << 8) |
+			     (unsigned char) buf[1];
+
+		/* no message to answer: close, outside this callback */
+		if (!msglen) {
+			cli->state = shut;
+			timer_add(&cli->idle, 0);
+			return;
+		}
+
+		cli_readn(cli, msglen);
+		cli->state = msg;
+	}
+	else if (cli->state == msg) {
+		tcp_message(cli, buf, len);
+
+		cli_readn(cli, 2);
+		cli->state = msglen;
+	}
 }
 
 static void tcp_conn (GConn *conn, GConnEvent *event, void *user_data)
@@ -96,22 +462,11 @@ static void tcp_conn (GConn *conn, GConnEvent *event, void *user_data)
 		break;
 
 	case GNET_CONN_WRITE:
+		cli_written(cli);
 		break;
 
 	case GNET_CONN_READ:
-		if (cli->state == msglen) {
-			unsigned short *s = (unsigned short *) event->buffer;
-			int msglen = g_ntohs(*s);
-
-			gnet_conn_readn(cli->conn, msglen);
-			cli->state = msg;
-		}
-		else if (cli->state == msg) {
-			tcp_message(cli, event->buffer, event->length);
-
-			gnet_conn_readn(cli->conn, 2);
-			cli->state = msglen;
-		}
+		cli_read(cli, event->buffer, event->length);
 		break;
 
 	default:
@@ -120,17 +475,51 @@ static void tcp_conn (GConn *conn, GConnEvent *event, void *user_data)
 	}
 }
 
-static void tcp_accept (GServer *server, GConn *client, void *data)
+static void dot_conn(struct tls_conn *tc, enum tls_event ev,
+		     const char *buf, unsigned int len, void *data)
 {
-	struct client *cli;
+	struct client *cli = data;
 
-	g_assert(client != NULL);	/* socket error */
+	switch (ev) {
+	case tls_ev_close:
+		cli_close(cli);
+		break;
+	case tls_ev_write:
+		cli_written(cli);
+		break;
+	case tls_ev_read:
+		cli_read(cli, buf, len);
+		break;
+	}
+}
+
+static struct client *cli_new(GInetAddr *addr)
+{
+	struct client *cli;
 
 	cli = g_slice_new0(struct client);
 	g_assert(cli != NULL);
 
-	cli->conn = client;
+	cli->addr = addr;
 	cli->state = idle;
+	cli->n_refs = 1;
+
+	/* also bounds a TLS handshake that never finishes */
+	timer_setup(&cli->idle, cli_idle, cli);
+	cli_busy(cli);
+
+	return cli;
+}
+
+static void tcp_accept (GServer *server, GConn *client, void *data)
+{
+	struct client *cli;
+
+	g_assert(client != NULL);	/* socket error */
+
+	gnet_inetaddr_ref(client->inetaddr);
+	cli = cli_new(client->inetaddr);
+	cli->conn = client;
 
 	gnet_conn_set_callback(client, tcp_conn, cli);
 
@@ -138,20 +527,138 @@ static void tcp_accept (GServer *server, GConn *client, void *data)
 	cli->state = msglen;
 }
 
+static void dot_accept(struct tls_conn *tc, GInetAddr *addr, void *data)
+{
+	struct client *cli = cli_new(addr);
+
+	cli->tls = tc;
+
+	tls_conn_set_callback(tc, dot_conn, cli);
+
+	tls_conn_readn(tc, 2);
+	cli->state = msglen;
+}
+
+/* root may go past net.core.[rw]mem_max; anyone else is held to it */
+static void udp_bufsize(int opt_force, int opt, const char *what,
+			const char *sysctl)
+{
+	int size = UDP_RING * UDP_TRUESIZE, got = 0;
+	socklen_t len = sizeof(got);
+
+	if (setsockopt(udp_fd, SOL_SOCKET, opt_force, &size, sizeof(size)) < 0)
+		setsockopt(udp_fd, SOL_SOCKET, opt, &size, sizeof(size));
+
+	/* the kernel reports twice what it was given, for overhead */
+	getsockopt(udp_fd, SOL_SOCKET, opt, &got, &len);
+	if (got / 2 < size)
+		syslog(LOG_WARNING, "UDP %s buffer %d KB, wanted %d KB: "
+		       "raise net.core.%s", what, got / 2 / 1024,
+		       size / 1024, sysctl);
+}
+
+/*
+ * --low-latency: buffers deep enough to ride out a burst of UDP_RING
+ * datagrams while the main loop is busy, and, where the kernel has
+ * them, busy polling of the device queue whenever the main loop does
+ * wait on the socket.  The main loop spins as well; see main.c.
+ */
+static void udp_tune(void)
+{
+	int val;
+
+	udp_bufsize(SO_RCVBUFFORCE, SO_RCVBUF, "receive", "rmem_max");
+	udp_bufsize(SO_SNDBUFFORCE, SO_SNDBUF, "send", "wmem_max");
+
+#ifdef SO_BUSY_POLL
+	val = UDP_BUSY_POLL_US;
+	if (setsockopt(udp_fd, SOL_SOCKET, SO_BUSY_POLL, &val,
+		       sizeof(val)) < 0)
+		syslog(LOG_WARNING, "SO_BUSY_POLL: %s", strerror(errno));
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+	val = 1;
+	setsockopt(udp_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &val,
+		   sizeof(val));
+#endif
+#ifdef SO_BUSY_POLL_BUDGET
+	val = dns_batch_max;
+	setsockopt(udp_fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &val,
+		   sizeof(val));
+#endif
+}
+
+/*
+ * Datagrams the kernel dropped because the receive queue was full.
+ * This is the count SO_RXQ_OVFL would attach to every datagram, but
+ * GNet receives without control messages, so read it once a second.
+ */
+static gboolean udp_drop_poll(void *data)
+{
+#ifdef SO_MEMINFO
+	uint32_t mem[SK_MEMINFO_VARS], n;
+	socklen_t len = sizeof(mem);
+
+	if (getsockopt(udp_fd, SOL_SOCKET, SO_MEMINFO, mem, &len) < 0)
+		return FALSE;		/* older kernel: stop asking */
+
+	n = mem[SK_MEMINFO_DROPS] - udp_drops;
+	if (n) {
+		syslog(LOG_WARNING, "UDP receive queue overflowed, "
+		       "%u queries dropped", n);
+		srvstat.udp_drop += n;
+		udp_drops = mem[SK_MEMINFO_DROPS];
+	}
+
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+static GList *init_acl(GList *peers, const char *what)
+{
+	GList *tmp, *allow = NULL;
+
+	for (tmp = peers; tmp; tmp = tmp->next) {
+		GInetAddr *addr = gnet_inetaddr_new(tmp->data, 0);
+		if (!addr) {
+			syslog(LOG_ERR, "invalid %s peer %s", what,
+			       (char *) tmp->data);
+			continue;
+		}
+
+		allow = g_list_append(allow, addr);
+	}
+
+	return allow;
+}
+
 void init_net(void)
 {
 	GIOChannel *udpchan;
 	GServer *tcpsrv;
 
+	xfr_allow = init_acl(xfr_acl, "zone transfer");
+	update_allow = init_acl(update_acl, "update");
+
 	udpsock = gnet_udp_socket_new_with_port (dns_port);
 	g_assert(udpsock != NULL);
 
 	udpchan = gnet_udp_socket_get_io_channel (udpsock);
 	g_assert(udpchan != NULL);
 
+	udp_fd = g_io_channel_unix_get_fd(udpchan);
+	if (low_latency)
+		udp_tune();
+	g_timeout_add(UDP_DROP_CHECK_MS, udp_drop_poll, NULL);
+
 	g_io_add_watch(udpchan, G_IO_IN, udp_rx, NULL);
 
 	tcpsrv = gnet_server_new(NULL, dns_port, tcp_accept, NULL);
 	g_assert(tcpsrv != NULL);
+
+	if (tls_cert_fn[0] && !tls_listen(tls_port, dot_accept, NULL))
+		exit(1);
 }
 
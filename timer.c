@@ -0,0 +1,251 @@
+/*
+ * Copyright 2006 Jeff Garzik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Coarse clock and timers, for the main loop.
+ *
+ * The clock is read once per main loop iteration, just after poll
+ * returns, rather than once per request.  Anything on the main loop
+ * may take clock_now as the current time.
+ *
+ * Timers sit in a hierarchical wheel: TIMER_LEVELS levels of
+ * TIMER_SLOTS slots, one tick per slot at level 0, each further level
+ * TIMER_SLOTS times coarser.  Adding or deleting a timer is O(1).  A
+ * distant timer is moved down a level whenever the level below wraps,
+ * at most TIMER_LEVELS - 1 times over its life.  Timers are embedded
+ * in what they time out; none of this is thread safe.
+ */
+
+#include <glib.h>
+#include "dnsd.h"
+
+enum {
+	TIMER_TICK_MS		= 100,
+	TIMER_BITS		= 6,
+	TIMER_SLOTS		= 1 << TIMER_BITS,
+	TIMER_MASK		= TIMER_SLOTS - 1,
+	TIMER_LEVELS		= 4,		/* range: 2^24 ticks, 19 days */
+};
+
+time_t clock_now;
+
+static GTimeVal clock_start;
+static unsigned long clock_ticks;		/* since clock_start */
+static unsigned long timer_ticks;		/* next tick to run */
+static unsigned int n_timers;
+static struct timer *wheel[TIMER_LEVELS][TIMER_SLOTS];
+
+
+void clock_update(void)
+{
+	GTimeVal now;
+	long ms;
+
+	g_get_current_time(&now);
+	clock_now = now.tv_sec;
+
+	ms = (now.tv_sec - clock_start.tv_sec) * 1000 +
+	     (now.tv_usec - clock_start.tv_usec) / 1000;
+
+	/* the wall clock may be set back; the ticks never are */
+	if (ms > 0 && (unsigned long) ms / TIMER_TICK_MS > clock_ticks)
+		clock_ticks = ms / TIMER_TICK_MS;
+}
+
+static void timer_link(struct timer *t)
+{
+	unsigned long idx = t->expires - timer_ticks;
+	unsigned int level = 0;
+	struct timer **slot;
+
+	if ((long) idx < 0) {
+		t->expires = timer_ticks;
+		idx = 0;
+	} else if (idx >= (1UL << (TIMER_BITS * TIMER_LEVELS))) {
+		idx = (1UL << (TIMER_BITS * TIMER_LEVELS)) - 1;
+		t->expires = timer_ticks + idx;
+	}
+
+	while (idx >= (1UL << (TIMER_BITS * (level + 1))))
+		level++;
+
+	slot = &wheel[level][(t->expires >> (TIMER_BITS * level)) & TIMER_MASK];
+	t->next = *slot;
+	if (t->next)
+		t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+static void timer_unlink(struct timer *t)
+{
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+void timer_setup(struct timer *t, timer_fn fn, void *data)
+{
+	t->next = NULL;
+	t->pprev = NULL;
+	t->fn = fn;
+	t->data = data;
+}
+
+/* (re)arm 't' to fire no sooner than 'ms' from now */
+void timer_add(struct timer *t, unsigned int ms)
+{
+	if (timer_pending(t))
+		timer_unlink(t);
+	else
+		n_timers++;
+
+	t->expires = clock_ticks + 1 + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	timer_link(t);
+}
+
+void timer_del(struct timer *t)
+{
+	if (!timer_pending(t))
+		return;
+
+	timer_unlink(t);
+	n_timers--;
+}
+
+/* move the timers of one slot a level down; true if the level wrapped */
+static bool timer_cascade(unsigned int level)
+{
+	unsigned int idx = (timer_ticks >> (TIMER_BITS * level)) & TIMER_MASK;
+	struct timer *t, *next;
+
+	t = wheel[level][idx];
+	wheel[level][idx] = NULL;
+
+	for (; t; t = next) {
+		next = t->next;
+		timer_link(t);
+	}
+
+	return idx == 0;
+}
+
+static void timer_run(void)
+{
+	struct timer *list, *t;
+	unsigned int level;
+
+	while (timer_ticks <= clock_ticks) {
+		unsigned int idx = timer_ticks & TIMER_MASK;
+
+		if (idx == 0)
+			for (level = 1; level < TIMER_LEVELS; level++)
+				if (!timer_cascade(level))
+					break;
+
+		/* take the slot, so timers re-added while it runs wait */
+		list = wheel[0][idx];
+		wheel[0][idx] = NULL;
+		if (list)
+			list->pprev = &list;
+		timer_ticks++;
+
+		while (list) {
+			t = list;
+			timer_unlink(t);
+			n_timers--;
+
+			t->fn(t, t->data);
+		}
+	}
+}
+
+/*
+ * The next tick that has anything to do: the first occupied slot of
+ * level 0, or else the next time level 0 wraps, when timers may be
+ * moved down into it.
+ */
+static unsigned long timer_next(void)
+{
+	unsigned long tick = timer_ticks;
+
+	do {
+		if (wheel[0][tick & TIMER_MASK])
+			return tick;
+		tick++;
+	} while (tick & TIMER_MASK);
+
+	return tick;
+}
+
+static gboolean clock_prepare(GSource *src, gint *timeout)
+{
+	unsigned long next;
+
+	if (!n_timers) {
+		*timeout = -1;
+		return FALSE;
+	}
+
+	/* wake up in time for the next tick with timers due */
+	next = timer_next();
+	*timeout = next > clock_ticks ?
+		   (next - clock_ticks) * TIMER_TICK_MS : 0;
+	return FALSE;
+}
+
+static gboolean clock_check(GSource *src)
+{
+	clock_update();
+
+	if (!n_timers)
+		timer_ticks = clock_ticks + 1;	/* nothing to catch up on */
+
+	return timer_ticks <= clock_ticks;
+}
+
+static gboolean clock_dispatch(GSource *src, GSourceFunc fn, gpointer data)
+{
+	timer_run();
+	return TRUE;
+}
+
+static GSourceFuncs clock_funcs = {
+	clock_prepare,
+	clock_check,
+	clock_dispatch,
+	NULL,
+};
+
+void timer_init(void)
+{
+	GSource *src;
+
+	g_get_current_time(&clock_start);
+	clock_update();
+	timer_ticks = clock_ticks;
+
+	src = g_source_new(&clock_funcs, sizeof(GSource));
+	g_assert(src != NULL);
+
+	g_source_attach(src, NULL);
+	g_source_unref(src);
+}
@@ -0,0 +1,449 @@
+/*
+ * Copyright 2006 Jeff Garzik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * DNS over TLS (RFC 7858).
+ *
+ * Connections are driven from the main loop, non-blocking, and look
+ * much like a GConn to socket.c: it asks for N bytes with
+ * tls_conn_readn(), queues writes with tls_conn_write(), and is told
+ * when a read completes, when queued writes have gone out, and when
+ * the peer goes away.  Framing and pipelining are socket.c's, shared
+ * with plain TCP.
+ *
+ * Clients that reconnect resume with a TLS 1.3 session ticket, which
+ * skips the certificate and key exchange.  Where the kernel and
+ * OpenSSL support it, record encryption is handed to the kernel
+ * (kTLS) after the handshake, and responses are written to the socket
+ * with plain send().
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "dvdns-config.h"
+#endif
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <glib.h>
+#include <gnet.h>
+#include "dnsd.h"
+
+#ifdef HAVE_OPENSSL
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+enum {
+	TLS_READ_CHUNK		= 16384,	/* one TLS record */
+	TLS_TICKETS		= 2,		/* sent per handshake */
+	TLS_SESSION_SECS	= 2 * 60 * 60,	/* ticket lifetime */
+};
+
+struct tls_conn {
+	GTcpSocket		*sock;
+	int			fd;
+	SSL			*ssl;
+
+	guint			watch;
+	GIOCondition		watch_cond;
+
+	bool			ready;		/* handshake done */
+	bool			ktls_send;	/* kernel encrypts writes */
+
+	GString			*in;		/* decrypted, not yet read */
+	unsigned int		in_off;
+	unsigned int		want;		/* readn() size, 0 if none */
+
+	GString			*out;		/* not yet on the socket */
+	unsigned int		n_writes;	/* writes queued in 'out' */
+
+	tls_conn_fn		fn;
+	void			*data;
+};
+
+static SSL_CTX *ctx;
+static GTcpSocket *listener;
+static tls_accept_fn accept_fn;
+static void *accept_data;
+
+static const unsigned char alpn_dot[] = { 3, 'd', 'o', 't' };
+
+
+static void tls_log_errors(const char *what)
+{
+	unsigned long e;
+	char buf[256];
+
+	while ((e = ERR_get_error()) != 0) {
+		ERR_error_string_n(e, buf, sizeof(buf));
+		syslog(LOG_ERR, "%s: %s", what, buf);
+	}
+}
+
+/* negotiate "dot" if offered; clients that offer nothing are fine too */
+static int tls_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+		    const unsigned char *in, unsigned int inlen, void *arg)
+{
+	unsigned char *sel;
+
+	if (SSL_select_next_proto(&sel, outlen, alpn_dot, sizeof(alpn_dot),
+				  in, inlen) != OPENSSL_NPN_NEGOTIATED)
+		return SSL_TLSEXT_ERR_NOACK;
+
+	*out = sel;
+	return SSL_TLSEXT_ERR_OK;
+}
+
+static bool tls_ctx_init(void)
+{
+	ctx = SSL_CTX_new(TLS_server_method());
+	if (!ctx) {
+		tls_log_errors("SSL_CTX_new");
+		return false;
+	}
+
+	/* RFC 8310 section 9 */
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION);
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+			      SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	/* stateless tickets, so resumption costs us no memory */
+	SSL_CTX_set_num_tickets(ctx, TLS_TICKETS);
+	SSL_CTX_set_timeout(ctx, TLS_SESSION_SECS);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+
+	SSL_CTX_set_alpn_select_cb(ctx, tls_alpn, NULL);
+
+	if (SSL_CTX_use_certificate_chain_file(ctx, tls_cert_fn) != 1) {
+		tls_log_errors(tls_cert_fn);
+		return false;
+	}
+	if (SSL_CTX_use_PrivateKey_file(ctx, tls_key_fn[0] ? tls_key_fn :
+					tls_cert_fn, SSL_FILETYPE_PEM) != 1 ||
+	    SSL_CTX_check_private_key(ctx) != 1) {
+		tls_log_errors(tls_key_fn[0] ? tls_key_fn : tls_cert_fn);
+		return false;
+	}
+
+	return true;
+}
+
+static gboolean tls_io(GIOChannel *chan, GIOCondition cond, void *data);
+
+static void tls_watch(struct tls_conn *tc, GIOCondition cond)
+{
+	GIOChannel *chan;
+
+	if (tc->watch && tc->watch_cond == cond)
+		return;
+
+	if (tc->watch)
+		g_source_remove(tc->watch);
+
+	chan = gnet_tcp_socket_get_io_channel(tc->sock);
+	tc->watch = g_io_add_watch(chan, cond | G_IO_HUP | G_IO_ERR,
+				   tls_io, tc);
+	tc->watch_cond = cond;
+}
+
+/* tell socket.c the connection is gone; it answers with unref */
+static void tls_close_event(struct tls_conn *tc)
+{
+	if (tc->watch)
+		g_source_remove(tc->watch);
+	tc->watch = 0;
+
+	tc->fn(tc, tls_ev_close, NULL, 0, tc->data);
+}
+
+/* push out queued data; false if the connection failed */
+static bool tls_flush(struct tls_conn *tc)
+{
+	unsigned int n;
+	int rc;
+
+	while (tc->out->len > 0) {
+		if (tc->ktls_send) {
+			rc = send(tc->fd, tc->out->str, tc->out->len,
+				  MSG_NOSIGNAL);
+			if (rc < 0) {
+				if (errno == EAGAIN || errno == EINTR)
+					return true;
+				return false;
+			}
+		} else {
+			rc = SSL_write(tc->ssl, tc->out->str, tc->out->len);
+			if (rc <= 0)
+				return SSL_get_error(tc->ssl, rc) ==
+				       SSL_ERROR_WANT_WRITE;
+		}
+
+		g_string_erase(tc->out, 0, rc);
+	}
+
+	/* all written: report each write, as GConn does */
+	n = tc->n_writes;
+	tc->n_writes = 0;
+	while (n--)
+		tc->fn(tc, tls_ev_write, NULL, 0, tc->data);
+
+	return true;
+}
+
+/* hand complete reads to socket.c, for as long as it asks for more */
+static void tls_deliver(struct tls_conn *tc)
+{
+	unsigned int want;
+
+	while (tc->want && (tc->in->len - tc->in_off) >= tc->want) {
+		want = tc->want;
+		tc->want = 0;
+
+		/* dns.c reads the message header in place */
+		if (tc->in_off & 3) {
+			g_string_erase(tc->in, 0, tc->in_off);
+			tc->in_off = 0;
+		}
+
+		tc->fn(tc, tls_ev_read, tc->in->str + tc->in_off, want,
+		       tc->data);
+		tc->in_off += want;
+	}
+
+	g_string_erase(tc->in, 0, tc->in_off);
+	tc->in_off = 0;
+}
+
+/*
+ * False if the connection is done with.  Reads a record at a time, so
+ * that no more than one message and a record are ever held, and stops
+ * once socket.c no longer asks for anything.
+ */
+static bool tls_read(struct tls_conn *tc)
+{
+	char buf[TLS_READ_CHUNK];
+	int rc, err;
+
+	while (tc->want) {
+		rc = SSL_read(tc->ssl, buf, sizeof(buf));
+		if (rc <= 0) {
+			/* nothing is delivered in between to change it */
+			err = SSL_get_error(tc->ssl, rc);
+
+			/* anything else means closed, or failed */
+			return err == SSL_ERROR_WANT_READ ||
+			       err == SSL_ERROR_WANT_WRITE;
+		}
+
+		g_string_append_len(tc->in, buf, rc);
+		tls_deliver(tc);
+	}
+
+	return false;
+}
+
+static bool tls_handshake(struct tls_conn *tc)
+{
+	int rc = SSL_accept(tc->ssl);
+
+	if (rc <= 0) {
+		switch (SSL_get_error(tc->ssl, rc)) {
+		case SSL_ERROR_WANT_READ:
+			tls_watch(tc, G_IO_IN);
+			return true;
+		case SSL_ERROR_WANT_WRITE:
+			tls_watch(tc, G_IO_OUT);
+			return true;
+		default:
+			ERR_clear_error();	/* port scanners, mostly */
+			return false;
+		}
+	}
+
+	tc->ready = true;
+	srvstat.tls_hs++;
+	if (SSL_session_reused(tc->ssl))
+		srvstat.tls_resumed++;
+
+#ifdef BIO_get_ktls_send
+	tc->ktls_send = BIO_get_ktls_send(SSL_get_wbio(tc->ssl));
+	if (tc->ktls_send)
+		srvstat.tls_ktls++;
+#endif
+
+	return true;
+}
+
+static gboolean tls_io(GIOChannel *chan, GIOCondition cond, void *data)
+{
+	struct tls_conn *tc = data;
+
+	if (!tc->ready) {
+		if (!tls_handshake(tc))
+			goto closed;
+		if (!tc->ready)
+			return TRUE;
+	}
+
+	if (!tls_read(tc) || !tls_flush(tc))
+		goto closed;
+
+	tls_watch(tc, tc->out->len ? (G_IO_IN | G_IO_OUT) : G_IO_IN);
+	return TRUE;
+
+closed:
+	tls_close_event(tc);
+	return FALSE;
+}
+
+static void tls_accept(GTcpSocket *server, GTcpSocket *client, void *data)
+{
+	struct tls_conn *tc;
+	int one = 1;
+
+	if (!client)
+		return;			/* socket error */
+
+	tc = g_slice_new0(struct tls_conn);
+	g_assert(tc != NULL);
+
+	tc->sock = client;
+	tc->fd = g_io_channel_unix_get_fd(
+			gnet_tcp_socket_get_io_channel(client));
+	fcntl(tc->fd, F_SETFL, fcntl(tc->fd, F_GETFL) | O_NONBLOCK);
+
+	/* each response is a record of its own; do not hold them back */
+	setsockopt(tc->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	tc->ssl = SSL_new(ctx);
+	g_assert(tc->ssl != NULL);
+	SSL_set_fd(tc->ssl, tc->fd);
+
+	tc->in = g_string_sized_new(TLS_READ_CHUNK);
+	tc->out = g_string_new(NULL);
+
+	accept_fn(tc, gnet_tcp_socket_get_remote_inetaddr(client),
+		  accept_data);
+
+	tls_watch(tc, G_IO_IN);
+}
+
+bool tls_listen(int port, tls_accept_fn fn, void *data)
+{
+	if (!tls_ctx_init())
+		return false;
+
+	listener = gnet_tcp_socket_server_new_with_port(port);
+	if (!listener) {
+		syslog(LOG_ERR, "DNS over TLS: cannot listen on port %d",
+		       port);
+		return false;
+	}
+
+	accept_fn = fn;
+	accept_data = data;
+	gnet_tcp_socket_server_accept_async(listener, tls_accept, NULL);
+
+	return true;
+}
+
+void tls_conn_set_callback(struct tls_conn *tc, tls_conn_fn fn, void *data)
+{
+	tc->fn = fn;
+	tc->data = data;
+}
+
+void tls_conn_readn(struct tls_conn *tc, unsigned int n)
+{
+	/*
+	 * called from the read callback; tls_deliver() does the rest.
+	 * Not calling it there closes the connection.
+	 */
+	tc->want = n;
+}
+
+void tls_conn_write(struct tls_conn *tc, const char *buf, unsigned int len)
+{
+	g_string_append_len(tc->out, buf, len);
+	tc->n_writes++;
+
+	/* wait for the handshake, or for room in a full socket */
+	if (!tc->ready || (tc->watch_cond & G_IO_OUT))
+		return;
+
+	if (!tls_flush(tc)) {
+		tls_watch(tc, G_IO_IN);	/* the error shows up as a read */
+		return;
+	}
+
+	if (tc->out->len)
+		tls_watch(tc, G_IO_IN | G_IO_OUT);
+}
+
+void tls_conn_unref(struct tls_conn *tc)
+{
+	if (tc->watch)
+		g_source_remove(tc->watch);
+
+	if (tc->ready)
+		SSL_shutdown(tc->ssl);	/* best effort close_notify */
+	SSL_free(tc->ssl);
+	gnet_tcp_socket_delete(tc->sock);
+
+	g_string_free(tc->in, TRUE);
+	g_string_free(tc->out, TRUE);
+	g_slice_free(struct tls_conn, tc);
+}
+
+#else /* !HAVE_OPENSSL */
+
+bool tls_listen(int port, tls_accept_fn fn, void *data)
+{
+	syslog(LOG_ERR, "DNS over TLS: built without OpenSSL");
+	return false;
+}
+
+void tls_conn_set_callback(struct tls_conn *tc, tls_conn_fn fn, void *data)
+{
+}
+
+void tls_conn_readn(struct tls_conn *tc, unsigned int n)
+{
+}
+
+void tls_conn_write(struct tls_conn *tc, const char *buf, unsigned int len)
+{
+}
+
+void tls_conn_unref(struct tls_conn *tc)
+{
+}
+
+#endif /* HAVE_OPENSSL */
@@ -0,0 +1,1257 @@
+/*
+ * Copyright 2006 Jeff Garzik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Dynamic updates (RFC 2136).
+ *
+ * A single writer thread applies UPDATE requests to the SQLite store,
+ * through a connection of its own.  Whatever queued up
+ * while it was busy goes into one transaction, each request under a
+ * savepoint of its own, so that a burst costs one commit rather than
+ * one per request, and a request that fails is rolled back alone.
+ * The database is put in write-ahead log mode, so that the workers'
+ * reads never wait for the writer.
+ *
+ * Once the transaction commits, the main loop drops the cached
+ * answers for each name changed, marks the name stale in the name
+ * table, and only then answers the requester.  The writer's
+ * data_version goes along with each batch, and is sent when idle too:
+ * as our own commits leave it be, the name table (names.c) learns from
+ * it of changes made by anyone else.
+ *
+ * Records are written in view 0.  Signed zones are refused: nothing
+ * here could keep their NSEC chains and signatures current.  Access
+ * is by client address (--allow-update), as for zone transfers.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sqlite3.h>
+#include "dnsd.h"
+
+enum {
+	UPDATE_BATCH_MAX	= 1024,		/* requests per transaction */
+	UPDATE_BUSY_MS		= 5000,		/* wait on other writers */
+	UPDATE_VER_MS		= 5000,		/* data_version, when idle */
+	UPDATE_NAME_MAX		= 255,		/* wire form, RFC 1035 */
+	UPDATE_MAX_PTRS		= 32,		/* compression pointers */
+	UPDATE_RR_MIN		= 11,		/* root name, no rdata */
+	UPDATE_SOA_FIXED	= 20,		/* SOA rdata after the names */
+};
+
+enum update_stmt_indices {
+	us_label,
+	us_soa,
+	us_types,
+	us_count,
+	us_has_rr,
+	us_add_label,
+	us_add_rr,
+	us_set_ttl,
+	us_set_soa,
+	us_del_rrset,
+	us_del_name,
+	us_del_rr,
+	us_drop_label,
+
+	us_last = us_drop_label
+};
+
+static const char *update_stmt_text[] = {
+	/* us_label */
+	"select id from labels where name = ?1",
+
+	/* us_soa */
+	"select rowid, rdata from rrs where domain = ?1 and type = 6 and "
+	"view = 0",
+
+	/* us_types */
+	"select type from rrs where domain = ?1 and view = 0",
+
+	/* us_count */
+	"select count(*) from rrs where domain = ?1 and type = ?2 and "
+	"class = ?3 and view = 0",
+
+	/* us_has_rr */
+	"select 1 from rrs where domain = ?1 and type = ?2 and class = ?3 "
+	"and rdata = ?4 and view = 0",
+
+	/* us_add_label */
+	"insert into labels (name, id, ckey) values "
+	"(?1, (select coalesce(max(id), 0) + 1 from labels), ?2)",
+
+	/* us_add_rr */
+	"insert into rrs (domain, type, class, ttl, rdata, view) "
+	"values (?1, ?2, ?3, ?5, ?4, 0)",
+
+	/* us_set_ttl: an RR added again */
+	"update rrs set ttl = ?5 where domain = ?1 and type = ?2 and "
+	"class = ?3 and rdata = ?4 and view = 0 and ttl != ?5",
+
+	/* us_set_soa: a null TTL keeps the old one */
+	"update rrs set ttl = coalesce(?2, ttl), rdata = ?3 where rowid = ?1",
+
+	/* us_del_rrset */
+	"delete from rrs where domain = ?1 and type = ?2 and view = 0",
+
+	/* us_del_name: ?2 set at the apex, whose SOA and NS stay */
+	"delete from rrs where domain = ?1 and view = 0 and "
+	"(?2 = 0 or type not in (2, 6))",
+
+	/* us_del_rr */
+	"delete from rrs where domain = ?1 and type = ?2 and class = ?3 "
+	"and rdata = ?4 and view = 0",
+
+	/* us_drop_label: once no view has records there */
+	"delete from labels where id = ?1 and "
+	"not exists (select 1 from rrs where domain = ?1)",
+};
+
+/* types whose rdata holds names: octets before the first, and count */
+static const struct {
+	unsigned int		type;
+	unsigned int		skip;
+	unsigned int		n_names;
+} rdata_names[] = {
+	{ 2, 0, 1 },		/* NS */
+	{ 3, 0, 1 },		/* MD */
+	{ 4, 0, 1 },		/* MF */
+	{ 5, 0, 1 },		/* CNAME */
+	{ 6, 0, 2 },		/* SOA */
+	{ 7, 0, 1 },		/* MB */
+	{ 8, 0, 1 },		/* MG */
+	{ 9, 0, 1 },		/* MR */
+	{ 12, 0, 1 },		/* PTR */
+	{ 14, 0, 2 },		/* MINFO */
+	{ 15, 2, 1 },		/* MX */
+	{ 17, 0, 2 },		/* RP */
+	{ 18, 2, 1 },		/* AFSDB */
+	{ 21, 2, 1 },		/* RT */
+	{ 26, 2, 2 },		/* PX */
+	{ 33, 6, 1 },		/* SRV */
+	{ 36, 2, 1 },		/* KX */
+	{ 39, 0, 1 },		/* DNAME */
+};
+
+struct update_req {
+	struct dnsres		*res;		/* the answer, bar its rcode;
+						   NULL for 'ver' alone */
+	dns_done_fn		done;
+	void			*data;
+
+	char			*msg;		/* the request */
+	unsigned int		msg_len;
+
+	unsigned int		rcode;
+	GList			*changed;	/* names, to invalidate */
+	bool			commit;		/* last of its transaction */
+
+	bool			has_ver;	/* last of its batch */
+	gint64			ver;		/* writer's data_version */
+};
+
+/* a prerequisite or update RR, owner and rdata in canonical form */
+struct update_rr {
+	char			name[UPDATE_NAME_MAX];
+	unsigned int		type;
+	unsigned int		class;
+	uint32_t		ttl;
+	unsigned char		*rdata;
+	unsigned int		rdata_len;
+};
+
+/* the zone a request updates */
+struct update_zone {
+	char			name[UPDATE_NAME_MAX];
+	unsigned int		class;
+	sqlite3_int64		id;		/* of its apex label */
+};
+
+static bool update_enabled;
+static GThread *update_writer;
+static GAsyncQueue *update_q;		/* to the writer */
+static GAsyncQueue *update_done_q;	/* back to the main loop */
+static int update_pipe[2];
+static struct update_req stop_req;	/* tells the writer to exit */
+
+/* writer only, once started */
+static sqlite3 *update_db;
+static sqlite3_stmt *update_stmts[us_last + 1];
+static sqlite3_stmt *update_ver_stmt;
+static bool update_db_err;		/* in the current request */
+
+
+/*
+ * Read the name at 'off', following compression pointers, into 'out'
+ * as an uncompressed, lowercased wire-format name.  Returns the offset
+ * just past the name where it sits, or 0 if it is malformed.  Neither
+ * the name nor any pointer may reach 'len'.
+ */
+static unsigned int update_name(const unsigned char *msg, unsigned int len,
+				unsigned int off, unsigned char *out,
+				unsigned int *out_len)
+{
+	unsigned int end = 0, n = 0, n_ptrs = 0, label_len, i;
+
+	while (off < len) {
+		label_len = msg[off];
+
+		if ((label_len & 0xc0) == 0xc0) {
+			if (off + 1 >= len || ++n_ptrs > UPDATE_MAX_PTRS)
+				return 0;
+			if (!end)
+				end = off + 2;
+			off = ((label_len & 0x3f) << 8) | msg[off + 1];
+			continue;
+		}
+		if (label_len & 0xc0)
+			return 0;
+		if (off + 1 + label_len > len ||
+		    n + 1 + label_len > UPDATE_NAME_MAX)
+			return 0;
+
+		out[n++] = label_len;
+		for (i = 0; i < label_len; i++)
+			out[n++] = g_ascii_tolower(msg[off + 1 + i]);
+		off += 1 + label_len;
+
+		if (label_len == 0) {
+			*out_len = n;
+			return end ? end : off;
+		}
+	}
+
+	return 0;
+}
+
+/* wire-format name to presentation form, as labels.name holds it */
+static bool update_name_str(const unsigned char *wire, char *out)
+{
+	unsigned int n = 0;
+
+	while (*wire) {
+		unsigned int label_len = *wire++;
+
+		/* a dot or NUL within a label cannot be stored */
+		if (memchr(wire, '.', label_len) || memchr(wire, 0, label_len))
+			return false;
+
+		if (n)
+			out[n++] = '.';
+		memcpy(out + n, wire, label_len);
+		n += label_len;
+		wire += label_len;
+	}
+	out[n] = 0;
+
+	return true;
+}
+
+/*
+ * Copy rdata at 'off' as import-zone.pl stores it: names decompressed
+ * and lowercased (RFC 4034, 6.2), the rest as it is.
+ */
+static bool update_rdata(const unsigned char *msg, unsigned int off,
+			 unsigned int rdlen, struct update_rr *rr)
+{
+	unsigned int end = off + rdlen, n, i, k, name_len;
+	unsigned char *buf;
+	int idx = -1;
+
+	for (i = 0; i < G_N_ELEMENTS(rdata_names); i++)
+		if (rdata_names[i].type == rr->type)
+			idx = i;
+
+	/* nothing to rewrite; updates deleting records carry no rdata */
+	if (idx < 0 || rdlen == 0) {
+		rr->rdata = g_memdup(msg + off, rdlen);
+		rr->rdata_len = rdlen;
+		return true;
+	}
+
+	if (rdata_names[idx].skip > rdlen)
+		return false;
+
+	buf = g_malloc(rdlen + rdata_names[idx].n_names * UPDATE_NAME_MAX);
+	n = rdata_names[idx].skip;
+	memcpy(buf, msg + off, n);
+	off += n;
+
+	for (k = 0; k < rdata_names[idx].n_names; k++) {
+		off = update_name(msg, end, off, buf + n, &name_len);
+		if (!off) {
+			g_free(buf);
+			return false;
+		}
+		n += name_len;
+	}
+
+	memcpy(buf + n, msg + off, end - off);
+	n += end - off;
+
+	rr->rdata = buf;
+	rr->rdata_len = n;
+	return true;
+}
+
+/* parse the RR at 'off'; returns the offset past it, or 0 */
+static unsigned int update_parse_rr(const unsigned char *msg,
+				    unsigned int len, unsigned int off,
+				    struct update_rr *rr)
+{
+	unsigned char wire[UPDATE_NAME_MAX];
+	unsigned int wire_len, rdlen;
+
+	off = update_name(msg, len, off, wire, &wire_len);
+	if (!off || off + 10 > len || !update_name_str(wire, rr->name))
+		return 0;
+
+	rr->type = (msg[off] << 8) | msg[off + 1];
+	rr->class = (msg[off + 2] << 8) | msg[off + 3];
+	rr->ttl = (msg[off + 4] << 24) | (msg[off + 5] << 16) |
+		  (msg[off + 6] << 8) | msg[off + 7];
+	rdlen = (msg[off + 8] << 8) | msg[off + 9];
+	off += 10;
+
+	if (off + rdlen > len || !update_rdata(msg, off, rdlen, rr))
+		return 0;
+
+	return off + rdlen;
+}
+
+static void update_rrs_free(struct update_rr *rrs, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		g_free(rrs[i].rdata);
+	g_free(rrs);
+}
+
+/* QTYPE-only and pseudo types, never found in a zone */
+static bool type_is_meta(unsigned int type)
+{
+	return type == qtype_opt || (type >= 128 && type <= 255);
+}
+
+/* records a signer would have to keep current */
+static bool type_is_dnssec(unsigned int type)
+{
+	return type == qtype_rrsig || type == qtype_nsec ||
+	       type == qtype_dnskey || type == qtype_nsec3 ||
+	       type == 51;			/* NSEC3PARAM */
+}
+
+/* step a statement once, then reset it; its step result */
+static int update_step(sqlite3_stmt *stmt)
+{
+	int rc = sqlite3_step(stmt);
+
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		syslog(LOG_ERR, "update failed: %s", sqlite3_errmsg(update_db));
+		update_db_err = true;
+	}
+
+	return rc;
+}
+
+/* statement 'idx', its parameters bound from 'rr' and 'id' */
+static sqlite3_stmt *update_stmt(unsigned int idx, sqlite3_int64 id,
+				 const struct update_rr *rr)
+{
+	sqlite3_stmt *stmt = update_stmts[idx];
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	sqlite3_bind_int64(stmt, 1, id);
+	if (!rr)
+		return stmt;
+
+	if (sqlite3_bind_parameter_count(stmt) >= 2)
+		sqlite3_bind_int(stmt, 2, rr->type);
+	if (sqlite3_bind_parameter_count(stmt) >= 3)
+		sqlite3_bind_int(stmt, 3, rr->class);
+	if (sqlite3_bind_parameter_count(stmt) >= 4) {
+		if (rr->rdata_len)
+			sqlite3_bind_blob(stmt, 4, rr->rdata, rr->rdata_len,
+					  SQLITE_STATIC);
+		else
+			sqlite3_bind_zeroblob(stmt, 4, 0);
+	}
+	if (sqlite3_bind_parameter_count(stmt) >= 5)
+		sqlite3_bind_int64(stmt, 5, rr->ttl);
+
+	return stmt;
+}
+
+/* run a statement for its effect; rows changed */
+static int update_write(sqlite3_stmt *stmt)
+{
+	int changes = 0;
+
+	if (update_step(stmt) == SQLITE_DONE)
+		changes = sqlite3_changes(update_db);
+	sqlite3_reset(stmt);
+
+	return changes;
+}
+
+static bool update_exec(const char *sql)
+{
+	if (sqlite3_exec(update_db, sql, NULL, NULL, NULL) == SQLITE_OK)
+		return true;
+
+	syslog(LOG_ERR, "update %s failed: %s", sql,
+	       sqlite3_errmsg(update_db));
+	return false;
+}
+
+/* label id of 'name', or 0 */
+static sqlite3_int64 label_id(const char *name)
+{
+	sqlite3_stmt *stmt = update_stmts[us_label];
+	sqlite3_int64 id = 0;
+
+	sqlite3_reset(stmt);
+	sqlite3_bind_text(stmt, 1, name, strlen(name), SQLITE_STATIC);
+	if (update_step(stmt) == SQLITE_ROW)
+		id = sqlite3_column_int64(stmt, 0);
+	sqlite3_reset(stmt);
+
+	return id;
+}
+
+static sqlite3_int64 label_add(const char *name)
+{
+	sqlite3_stmt *stmt = update_stmts[us_add_label];
+	char key[UPDATE_NAME_MAX * 2];
+	unsigned int key_len;
+
+	key_len = backend_canon_key(name, key);
+
+	sqlite3_reset(stmt);
+	sqlite3_bind_text(stmt, 1, name, strlen(name), SQLITE_STATIC);
+	sqlite3_bind_blob(stmt, 2, key, key_len, SQLITE_STATIC);
+	update_write(stmt);
+
+	return label_id(name);
+}
+
+/* the first integer column of a statement's first row, or 0 */
+static sqlite3_int64 update_int(sqlite3_stmt *stmt)
+{
+	sqlite3_int64 val = 0;
+
+	if (update_step(stmt) == SQLITE_ROW)
+		val = sqlite3_column_int64(stmt, 0);
+	sqlite3_reset(stmt);
+
+	return val;
+}
+
+/* records of 'rr's type and class at label 'id' */
+static unsigned int rrset_count(sqlite3_int64 id, const struct update_rr *rr)
+{
+	return id ? update_int(update_stmt(us_count, id, rr)) : 0;
+}
+
+/* 'rr' itself is at label 'id' */
+static bool rr_exists(sqlite3_int64 id, const struct update_rr *rr)
+{
+	return id && update_int(update_stmt(us_has_rr, id, rr));
+}
+
+/* records at label 'id': whether any, any CNAME, any other type */
+static bool name_types(sqlite3_int64 id, bool *cname, bool *other)
+{
+	sqlite3_stmt *stmt;
+	bool any = false;
+
+	*cname = *other = false;
+	if (!id)
+		return false;
+
+	stmt = update_stmt(us_types, id, NULL);
+	while (update_step(stmt) == SQLITE_ROW) {
+		any = true;
+		if (sqlite3_column_int(stmt, 0) == qtype_cname)
+			*cname = true;
+		else
+			*other = true;
+	}
+	sqlite3_reset(stmt);
+
+	return any;
+}
+
+/* SOA serial at 'off' in SOA rdata, after MNAME and RNAME */
+static unsigned int soa_serial_off(const unsigned char *p, unsigned int len)
+{
+	unsigned int off = 0, i;
+
+	for (i = 0; i < 2; i++) {
+		while (off < len && p[off])
+			off += p[off] + 1;
+		off++;
+	}
+
+	return off + UPDATE_SOA_FIXED <= len ? off : 0;
+}
+
+static uint32_t soa_serial(const unsigned char *p, unsigned int off)
+{
+	return (p[off] << 24) | (p[off + 1] << 16) | (p[off + 2] << 8) |
+	       p[off + 3];
+}
+
+/* 'a' is after 'b' in serial number arithmetic (RFC 1982) */
+static bool serial_gt(uint32_t a, uint32_t b)
+{
+	return a != b && (int32_t) (a - b) > 0;
+}
+
+/* DNSKEY, NSEC or NSEC3PARAM at the apex */
+static bool zone_signed(const struct update_zone *z)
+{
+	static const unsigned int types[] = { qtype_dnskey, qtype_nsec, 51 };
+	struct update_rr rr;
+	unsigned int i;
+
+	memset(&rr, 0, sizeof(rr));
+	rr.class = z->class;
+
+	for (i = 0; i < G_N_ELEMENTS(types); i++) {
+		rr.type = types[i];
+		if (rrset_count(z->id, &rr))
+			return true;
+	}
+
+	return false;
+}
+
+/* note 'name' as changed by 'u' */
+static void update_changed(struct update_req *u, const char *name)
+{
+	if (!g_list_find_custom(u->changed, name, (GCompareFunc) strcmp))
+		u->changed = g_list_prepend(u->changed, g_strdup(name));
+}
+
+/* 'rr', rdata and all, among the first 'n' entries of 'list' */
+static bool rr_listed(const struct update_rr *list, unsigned int n,
+		      const struct update_rr *rr)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		if (list[i].class == rr->class && list[i].type == rr->type &&
+		    !strcmp(list[i].name, rr->name) &&
+		    list[i].rdata_len == rr->rdata_len &&
+		    !memcmp(list[i].rdata, rr->rdata, rr->rdata_len))
+			return true;
+
+	return false;
+}
+
+/* RFC 2136, 3.2: every prerequisite must hold */
+static unsigned int update_prereqs(const struct update_zone *z,
+				   const struct update_rr *pr, unsigned int n)
+{
+	struct update_rr set;
+	unsigned int i, j, n_rdata;
+	sqlite3_int64 id;
+	bool cname, other, *done;
+	unsigned int rcode = 0;
+
+	for (i = 0; i < n && !rcode; i++) {
+		const struct update_rr *rr = &pr[i];
+
+		if (rr->ttl != 0)
+			return rcode_formerr;
+		if (!backend_in_zone(rr->name, z->name))
+			return rcode_notzone;
+
+		id = label_id(rr->name);
+
+		if (rr->class == class_any) {
+			if (rr->rdata_len)
+				return rcode_formerr;
+			if (rr->type == qtype_all) {
+				if (!name_types(id, &cname, &other))
+					rcode = rcode_nxdomain;
+			} else {
+				set = *rr;
+				set.class = z->class;
+				if (!rrset_count(id, &set))
+					rcode = rcode_nxrrset;
+			}
+		} else if (rr->class == class_none) {
+			if (rr->rdata_len)
+				return rcode_formerr;
+			if (rr->type == qtype_all) {
+				if (name_types(id, &cname, &other))
+					rcode = rcode_yxdomain;
+			} else {
+				set = *rr;
+				set.class = z->class;
+				if (rrset_count(id, &set))
+					rcode = rcode_yxrrset;
+			}
+		} else if (rr->class != z->class)
+			return rcode_formerr;
+	}
+	if (rcode)
+		return rcode;
+
+	/* value-dependent: the RRset must be exactly these records */
+	done = g_new0(bool, n);
+	for (i = 0; i < n && !rcode; i++) {
+		if (done[i] || pr[i].class != z->class ||
+		    pr[i].type == qtype_all)
+			continue;
+
+		id = label_id(pr[i].name);
+		n_rdata = 0;
+
+		for (j = i; j < n && !rcode; j++) {
+			const struct update_rr *rr = &pr[j];
+
+			if (done[j] || rr->class != z->class ||
+			    rr->type != pr[i].type || strcmp(rr->name, pr[i].name))
+				continue;
+			done[j] = true;
+
+			if (rr_listed(&pr[i], j - i, rr))
+				continue;
+			if (!rr_exists(id, rr))
+				rcode = rcode_nxrrset;
+			else
+				n_rdata++;
+		}
+
+		/* each record once, so as many as there are records */
+		if (!rcode && n_rdata != rrset_count(id, &pr[i]))
+			rcode = rcode_nxrrset;
+	}
+	g_free(done);
+
+	/* a zone-class prerequisite of type ANY is malformed */
+	for (i = 0; i < n && !rcode; i++)
+		if (pr[i].class == z->class && pr[i].type == qtype_all)
+			rcode = rcode_formerr;
+
+	return rcode;
+}
+
+/* RFC 2136, 3.4.1: check every update before applying any */
+static unsigned int update_prescan(const struct update_zone *z,
+				   const struct update_rr *up, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		const struct update_rr *rr = &up[i];
+
+		if (!backend_in_zone(rr->name, z->name))
+			return rcode_notzone;
+
+		if (rr->class == z->class) {
+			if (type_is_meta(rr->type))
+				return rcode_formerr;
+		} else if (rr->class == class_any) {
+			if (rr->ttl || rr->rdata_len ||
+			    (type_is_meta(rr->type) && rr->type != qtype_all))
+				return rcode_formerr;
+		} else if (rr->class == class_none) {
+			if (rr->ttl || type_is_meta(rr->type))
+				return rcode_formerr;
+		} else
+			return rcode_formerr;
+
+		if (type_is_dnssec(rr->type))
+			return rcode_refused;
+	}
+
+	return 0;
+}
+
+/* an update adding 'rr' to the zone */
+static void update_add(struct update_req *u, const struct update_zone *z,
+		       sqlite3_int64 id, const struct update_rr *rr,
+		       bool *soa_set)
+{
+	sqlite3_stmt *stmt;
+	bool cname, other;
+	uint32_t serial;
+	unsigned int off, new_off;
+
+	if (rr->type == qtype_soa) {
+		/* only at the apex, and only forward */
+		if (strcmp(rr->name, z->name))
+			return;
+
+		stmt = update_stmt(us_soa, z->id, NULL);
+		if (update_step(stmt) == SQLITE_ROW) {
+			const unsigned char *old = sqlite3_column_blob(stmt, 1);
+			unsigned int old_len = sqlite3_column_bytes(stmt, 1);
+			sqlite3_int64 rowid = sqlite3_column_int64(stmt, 0);
+
+			off = soa_serial_off(old, old_len);
+			new_off = soa_serial_off(rr->rdata, rr->rdata_len);
+			serial = off ? soa_serial(old, off) : 0;
+			sqlite3_reset(stmt);
+
+			if (new_off && serial_gt(soa_serial(rr->rdata, new_off),
+						 serial)) {
+				stmt = update_stmts[us_set_soa];
+				sqlite3_reset(stmt);
+				sqlite3_bind_int64(stmt, 1, rowid);
+				sqlite3_bind_int64(stmt, 2, rr->ttl);
+				sqlite3_bind_blob(stmt, 3, rr->rdata,
+						  rr->rdata_len, SQLITE_STATIC);
+				if (update_write(stmt)) {
+					*soa_set = true;
+					update_changed(u, z->name);
+				}
+			}
+		}
+		sqlite3_reset(stmt);
+		return;
+	}
+
+	if (!id)
+		id = label_add(rr->name);
+	if (!id)
+		return;
+
+	/* a CNAME stands alone, and replaces any other CNAME */
+	name_types(id, &cname, &other);
+	if ((rr->type == qtype_cname && other) ||
+	    (rr->type != qtype_cname && cname))
+		return;
+	if (rr->type == qtype_cname && cname && !rr_exists(id, rr))
+		update_write(update_stmt(us_del_rrset, id, rr));
+
+	/* an RR already present gets the new TTL */
+	if (rr_exists(id, rr)) {
+		if (update_write(update_stmt(us_set_ttl, id, rr)))
+			update_changed(u, rr->name);
+		return;
+	}
+
+	if (update_write(update_stmt(us_add_rr, id, rr)))
+		update_changed(u, rr->name);
+}
+
+/* an update deleting an RRset, every RRset at a name, or an RR */
+static void update_delete(struct update_req *u, const struct update_zone *z,
+			  sqlite3_int64 id, const struct update_rr *rr)
+{
+	bool apex = !strcmp(rr->name, z->name);
+	struct update_rr one;
+	sqlite3_stmt *stmt;
+	int changes = 0;
+
+	if (!id)
+		return;
+
+	if (rr->class == class_any && rr->type == qtype_all) {
+		stmt = update_stmt(us_del_name, id, NULL);
+		sqlite3_bind_int(stmt, 2, apex);
+		changes = update_write(stmt);
+	} else if (rr->class == class_any) {
+		if (apex && (rr->type == qtype_soa || rr->type == qtype_ns))
+			return;
+		changes = update_write(update_stmt(us_del_rrset, id, rr));
+	} else {
+		/* class NONE: the one RR, of the zone's class */
+		one = *rr;
+		one.class = z->class;
+		if (rr->type == qtype_soa)
+			return;
+		if (apex && rr->type == qtype_ns && rrset_count(id, &one) <= 1)
+			return;
+		changes = update_write(update_stmt(us_del_rr, id, &one));
+	}
+
+	if (changes) {
+		update_changed(u, rr->name);
+		update_write(update_stmt(us_drop_label, id, NULL));
+	}
+}
+
+/* RFC 2136, 3.6: a change not made by a new SOA bumps the serial */
+static void update_bump_serial(struct update_req *u,
+			       const struct update_zone *z)
+{
+	sqlite3_stmt *stmt = update_stmt(us_soa, z->id, NULL);
+	unsigned char *rdata;
+	unsigned int off, len;
+	sqlite3_int64 rowid;
+	uint32_t serial;
+
+	if (update_step(stmt) != SQLITE_ROW) {
+		sqlite3_reset(stmt);
+		return;
+	}
+
+	rowid = sqlite3_column_int64(stmt, 0);
+	len = sqlite3_column_bytes(stmt, 1);
+	rdata = g_memdup(sqlite3_column_blob(stmt, 1), len);
+	sqlite3_reset(stmt);
+
+	off = soa_serial_off(rdata, len);
+	if (off) {
+		serial = soa_serial(rdata, off) + 1;
+		rdata[off] = serial >> 24;
+		rdata[off + 1] = serial >> 16;
+		rdata[off + 2] = serial >> 8;
+		rdata[off + 3] = serial;
+
+		stmt = update_stmts[us_set_soa];
+		sqlite3_reset(stmt);
+		sqlite3_bind_int64(stmt, 1, rowid);
+		sqlite3_bind_null(stmt, 2);
+		sqlite3_bind_blob(stmt, 3, rdata, len, SQLITE_STATIC);
+		update_write(stmt);
+		update_changed(u, z->name);
+	}
+
+	g_free(rdata);
+}
+
+/* apply one UPDATE request; its rcode */
+static unsigned int update_apply(struct update_req *u)
+{
+	const unsigned char *msg = (const unsigned char *) u->msg;
+	unsigned int len = u->msg_len, off = sizeof(struct dns_msg_hdr);
+	unsigned int n_zo, n_pr, n_up, i, name_len, rcode = 0;
+	unsigned char wire[UPDATE_NAME_MAX];
+	struct update_rr *pr = NULL, *up = NULL;
+	struct update_zone z;
+	bool soa_set = false;
+
+	if (len < off)
+		return rcode_formerr;
+
+	n_zo = (msg[4] << 8) | msg[5];
+	n_pr = (msg[6] << 8) | msg[7];
+	n_up = (msg[8] << 8) | msg[9];
+
+	/* zone section: the one SOA question */
+	if (n_zo != 1)
+		return rcode_formerr;
+	off = update_name(msg, len, off, wire, &name_len);
+	if (!off || off + 4 > len || !update_name_str(wire, z.name))
+		return rcode_formerr;
+	if (((msg[off] << 8) | msg[off + 1]) != qtype_soa)
+		return rcode_formerr;
+	z.class = (msg[off + 2] << 8) | msg[off + 3];
+	off += 4;
+
+	z.id = label_id(z.name);
+	if (!z.id || !update_int(update_stmt(us_soa, z.id, NULL)) ||
+	    update_db_err)
+		return update_db_err ? rcode_servfail : rcode_notauth;
+
+	if ((n_pr + n_up) * UPDATE_RR_MIN > len - off)
+		return rcode_formerr;
+
+	pr = g_new0(struct update_rr, n_pr + 1);
+	up = g_new0(struct update_rr, n_up + 1);
+	for (i = 0; i < n_pr && off; i++)
+		off = update_parse_rr(msg, len, off, &pr[i]);
+	for (i = 0; i < n_up && off; i++)
+		off = update_parse_rr(msg, len, off, &up[i]);
+	if (!off) {
+		rcode = rcode_formerr;
+		goto out;
+	}
+
+	if (zone_signed(&z)) {
+		rcode = rcode_refused;
+		goto out;
+	}
+
+	rcode = update_prereqs(&z, pr, n_pr);
+	if (!rcode)
+		rcode = update_prescan(&z, up, n_up);
+	if (rcode)
+		goto out;
+
+	for (i = 0; i < n_up && !update_db_err; i++) {
+		const struct update_rr *rr = &up[i];
+		sqlite3_int64 id = label_id(rr->name);
+
+		if (rr->class == z.class)
+			update_add(u, &z, id, rr, &soa_set);
+		else
+			update_delete(u, &z, id, rr);
+	}
+
+	if (u->changed && !soa_set)
+		update_bump_serial(u, &z);
+
+out:
+	update_rrs_free(pr, n_pr);
+	update_rrs_free(up, n_up);
+	return update_db_err ? rcode_servfail : rcode;
+}
+
+/* one request, under its own savepoint */
+static void update_one(struct update_req *u)
+{
+	update_db_err = false;
+
+	if (!update_exec("savepoint dvdns_update")) {
+		u->rcode = rcode_servfail;
+		return;
+	}
+
+	u->rcode = update_apply(u);
+
+	if (u->rcode) {
+		update_exec("rollback to dvdns_update");
+		g_list_foreach(u->changed, (GFunc) g_free, NULL);
+		g_list_free(u->changed);
+		u->changed = NULL;
+	}
+	update_exec("release dvdns_update");
+}
+
+/* the whole batch failed to commit */
+static void update_fail(GList *batch)
+{
+	GList *tmp;
+
+	for (tmp = batch; tmp; tmp = tmp->next) {
+		struct update_req *u = tmp->data;
+
+		u->rcode = rcode_servfail;
+		g_list_foreach(u->changed, (GFunc) g_free, NULL);
+		g_list_free(u->changed);
+		u->changed = NULL;
+	}
+}
+
+/* data_version of our connection: unchanged by our own commits */
+static gint64 update_version(void)
+{
+	gint64 ver = -1;
+
+	if (sqlite3_step(update_ver_stmt) == SQLITE_ROW)
+		ver = sqlite3_column_int64(update_ver_stmt, 0);
+	sqlite3_reset(update_ver_stmt);
+
+	return ver;
+}
+
+static void update_wake(void)
+{
+	char c = 0;
+
+	/* pipe full means the main loop is already due to wake */
+	if (write(update_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+		syslog(LOG_ERR, "update wakeup: %m");
+}
+
+/* tell the main loop of data_version, with no batch to go with it */
+static void update_send_ver(gint64 ver)
+{
+	struct update_req *u;
+
+	u = g_slice_new0(struct update_req);
+	g_assert(u != NULL);
+
+	u->has_ver = true;
+	u->ver = ver;
+	g_async_queue_push(update_done_q, u);
+	update_wake();
+}
+
+/*
+ * Group commit: take one request, waiting if need be, then whatever
+ * else is already queued, and commit them together.
+ */
+static void *update_thread(void *data)
+{
+	struct update_req *u;
+	bool stop = false, begun, committed;
+	GList *batch, *tmp;
+	unsigned int n;
+	gint64 ver, idle_ver;
+	GTimeVal end;
+
+	cpu_bind_any();
+
+	ver = update_version();
+	update_send_ver(ver);
+
+	while (!stop) {
+		g_get_current_time(&end);
+		g_time_val_add(&end, UPDATE_VER_MS * 1000);
+
+		u = g_async_queue_timed_pop(update_q, &end);
+		if (u == &stop_req)
+			break;
+		if (!u) {
+			/* idle: only another writer can have changed it */
+			idle_ver = update_version();
+			if (idle_ver != ver) {
+				ver = idle_ver;
+				update_send_ver(ver);
+			}
+			continue;
+		}
+
+		batch = NULL;
+		n = 0;
+
+		begun = update_exec("begin immediate");
+
+		while (u) {
+			if (begun)
+				update_one(u);
+			else
+				u->rcode = rcode_servfail;
+			batch = g_list_prepend(batch, u);
+
+			if (++n == UPDATE_BATCH_MAX)
+				break;
+			u = g_async_queue_try_pop(update_q);
+			if (u == &stop_req) {
+				stop = true;
+				u = NULL;
+			}
+		}
+
+		committed = begun && update_exec("commit");
+		if (begun && !committed) {
+			update_exec("rollback");
+			update_fail(batch);
+		}
+		((struct update_req *) batch->data)->commit = committed;
+
+		ver = update_version();
+		((struct update_req *) batch->data)->has_ver = true;
+		((struct update_req *) batch->data)->ver = ver;
+
+		/* answered in arrival order */
+		batch = g_list_reverse(batch);
+		for (tmp = batch; tmp; tmp = tmp->next)
+			g_async_queue_push(update_done_q, tmp->data);
+		g_list_free(batch);
+
+		update_wake();
+	}
+
+	return NULL;
+}
+
+/* invalidate what 'u' changed, then answer it; main loop */
+static void update_finish(struct update_req *u)
+{
+	GList *tmp;
+
+	for (tmp = u->changed; tmp; tmp = tmp->next) {
+		dns_cache_invalidate(tmp->data);
+		names_touch(tmp->data);
+		g_free(tmp->data);
+	}
+	g_list_free(u->changed);
+
+	if (u->has_ver)
+		names_writer_version(u->ver);
+
+	if (!u->res) {
+		g_slice_free(struct update_req, u);
+		return;
+	}
+
+	if (u->commit)
+		srvstat.update_commits++;
+
+	dns_set_rcode(u->res, u->rcode);
+	u->done(u->res, false, u->data);
+
+	dnsres_unref(u->res);
+	g_free(u->msg);
+	g_slice_free(struct update_req, u);
+}
+
+static gboolean update_done(GIOChannel *source, GIOCondition condition,
+			    void *data)
+{
+	struct update_req *u;
+	char buf[256];
+
+	while (read(update_pipe[0], buf, sizeof(buf)) > 0)
+		;
+
+	while ((u = g_async_queue_try_pop(update_done_q)) != NULL)
+		update_finish(u);
+
+	return TRUE;	/* poll again */
+}
+
+/*
+ * Apply the UPDATE request 'res' was parsed from, and answer it with
+ * done(res, false, data) once committed, or refused.  The request
+ * moves out of 'res'.
+ */
+void update_submit(struct dnsres *res, dns_done_fn done, void *data)
+{
+	struct update_req *u;
+
+	srvstat.update_q++;
+
+	u = g_slice_new0(struct update_req);
+	g_assert(u != NULL);
+
+	u->res = dnsres_ref(res);
+	u->done = done;
+	u->data = data;
+	u->msg = res->update;
+	u->msg_len = res->update_len;
+	res->update = NULL;
+
+	if (!update_enabled) {
+		u->rcode = rcode_notimpl;
+		update_finish(u);
+		return;
+	}
+
+	g_async_queue_push(update_q, u);
+}
+
+/* the store is ours to write, with the columns updates need */
+static bool update_open(void)
+{
+	const char *mode = NULL;
+	sqlite3_stmt *stmt;
+	unsigned int i;
+
+	if (strcmp(backend_name, "sqlite")) {
+		syslog(LOG_INFO, "updates need the sqlite backend");
+		return false;
+	}
+
+	if (sqlite3_open_v2(db_fn, &update_db, SQLITE_OPEN_READWRITE,
+			    NULL) != SQLITE_OK) {
+		sqlite3_close(update_db);
+		update_db = NULL;
+		return false;
+	}
+
+	if (sqlite3_db_readonly(update_db, "main")) {
+		syslog(LOG_INFO, "%s is read-only, updates disabled", db_fn);
+		return false;
+	}
+
+	sqlite3_busy_timeout(update_db, UPDATE_BUSY_MS);
+
+	for (i = 0; i <= us_last; i++)
+		if (sqlite3_prepare(update_db, update_stmt_text[i], -1,
+				    &update_stmts[i], NULL) != SQLITE_OK) {
+			syslog(LOG_WARNING, "%s lacks labels.ckey or rrs.view, "
+			       "re-run import-zone.pl for updates", db_fn);
+			return false;
+		}
+
+	if (sqlite3_prepare(update_db, "pragma data_version", -1,
+			    &update_ver_stmt, NULL) != SQLITE_OK) {
+		syslog(LOG_WARNING, "sqlite3 lacks data_version, "
+		       "updates disabled");
+		return false;
+	}
+
+	if (sqlite3_prepare(update_db, "pragma journal_mode = wal", -1,
+			    &stmt, NULL) == SQLITE_OK) {
+		if (sqlite3_step(stmt) == SQLITE_ROW)
+			mode = (const char *) sqlite3_column_text(stmt, 0);
+		if (!mode || g_ascii_strcasecmp(mode, "wal"))
+			syslog(LOG_WARNING, "%s not in WAL mode, queries will "
+			       "wait on update commits", db_fn);
+		sqlite3_finalize(stmt);
+	}
+
+	return true;
+}
+
+static void update_close(void)
+{
+	unsigned int i;
+
+	for (i = 0; i <= us_last; i++) {
+		sqlite3_finalize(update_stmts[i]);
+		update_stmts[i] = NULL;
+	}
+	sqlite3_finalize(update_ver_stmt);
+	update_ver_stmt = NULL;
+
+	sqlite3_close(update_db);
+	update_db = NULL;
+}
+
+/* after backend_init(), which starts names.c */
+void update_init(void)
+{
+	GIOChannel *chan;
+	int rc;
+
+	if (!update_open()) {
+		update_close();
+		return;
+	}
+
+	update_q = g_async_queue_new();
+	update_done_q = g_async_queue_new();
+	g_assert(update_q != NULL && update_done_q != NULL);
+
+	rc = pipe(update_pipe);
+	g_assert(rc == 0);
+	fcntl(update_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(update_pipe[1], F_SETFL, O_NONBLOCK);
+
+	chan = g_io_channel_unix_new(update_pipe[0]);
+	g_assert(chan != NULL);
+	g_io_add_watch(chan, G_IO_IN, update_done, NULL);
+
+	update_writer = g_thread_create(update_thread, NULL, TRUE, NULL);
+	g_assert(update_writer != NULL);
+
+	update_enabled = true;
+}
+
+/* before backend_exit(); requests not yet answered are dropped */
+void update_exit(void)
+{
+	if (!update_enabled)
+		return;
+
+	g_async_queue_push(update_q, &stop_req);
+	g_thread_join(update_writer);
+	update_writer = NULL;
+	update_enabled = false;
+
+	update_close();
+}
@@ -0,0 +1,454 @@
+/*
+ * Copyright 2006 Jeff Garzik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Views: which set of answers a client gets, by its address or the
+ * EDNS Client Subnet it is asking for.  --views FILE lists prefixes,
+ * one per line with the view they map to:
+ *
+ *	# comment
+ *	192.0.2.0/24	1
+ *	2001:db8::/32	2
+ *
+ * Records carry a view number (rrs.view); an RRset tagged with the
+ * client's view replaces the view 0 RRset of the same type.
+ *
+ * The prefixes are read into a binary trie, then compiled into a
+ * poptrie (Asai and Ohara, SIGCOMM 2015) per address family: the top
+ * LPM_TOP_BITS of an address index a flat array, and each further
+ * LPM_STRIDE bits a node of two 64-bit maps, so that its children and
+ * leaves sit packed in two arrays, found by counting bits.  An IPv4
+ * lookup touches at most four words of the table; the binary trie is
+ * thrown away once compiled.
+ *
+ * Each leaf also holds the scope of its answer: how many leading
+ * address bits every client sharing them would get the same view
+ * for.  That is what a response's ECS SCOPE PREFIX-LENGTH tells
+ * resolvers (RFC 7871, 7.2.1).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+#include "dnsd.h"
+
+#ifdef __GNUC__
+#define popcount64(x) __builtin_popcountll(x)
+#else
+static unsigned int popcount64(uint64_t x)
+{
+	unsigned int n = 0;
+
+	for (; x; x &= x - 1)
+		n++;
+	return n;
+}
+#endif
+
+enum {
+	LPM_TOP_BITS		= 16,
+	LPM_STRIDE		= 6,		/* 64 slots: one uint64_t map */
+	LPM_SLOTS		= 1 << LPM_STRIDE,
+
+	LPM_NODE		= 1U << 31,	/* top entry is a node index */
+	LPM_SCOPE_SHIFT		= 16,		/* leaf: view, then scope */
+
+	VIEW_MAX		= 0xffff,
+	TRIE_NONE		= 0,		/* no child; node 0 is root */
+};
+
+/* one step of the binary trie, used while building */
+struct trie_node {
+	uint32_t		child[2];
+	int			view;		/* -1 if no prefix ends here */
+};
+
+struct lpm_node {
+	uint64_t		vector;		/* slots holding a child */
+	uint64_t		leafvec;	/* slots starting a run of leaves */
+	uint32_t		base0;		/* first leaf */
+	uint32_t		base1;		/* first child */
+};
+
+struct lpm {
+	unsigned int		bits;		/* address length */
+	uint32_t		top[1 << LPM_TOP_BITS];
+
+	struct lpm_node		*nodes;
+	unsigned int		n_nodes;
+	unsigned int		nodes_alloc;
+
+	uint32_t		*leaves;
+	unsigned int		n_leaves;
+	unsigned int		leaves_alloc;
+
+	/* building */
+	GArray			*trie;		/* of struct trie_node */
+	unsigned int		n_prefixes;
+};
+
+/* where a walk down the binary trie stopped */
+struct trie_walk {
+	uint32_t		node;
+	unsigned int		depth;
+	int			best;		/* longest match so far */
+	bool			stopped;	/* before the end of the bits */
+};
+
+static struct lpm lpm4 = { .bits = 32 };
+static struct lpm lpm6 = { .bits = 128 };
+static unsigned int n_views;
+
+
+static struct trie_node *trie_at(struct lpm *t, uint32_t idx)
+{
+	return &g_array_index(t->trie, struct trie_node, idx);
+}
+
+static uint32_t trie_new(struct lpm *t)
+{
+	struct trie_node n = { { TRIE_NONE, TRIE_NONE }, -1 };
+
+	g_array_append_val(t->trie, n);
+	return t->trie->len - 1;
+}
+
+static unsigned int addr_bit(const unsigned char *addr, unsigned int i)
+{
+	return (addr[i / 8] >> (7 - (i % 8))) & 1;
+}
+
+static void trie_insert(struct lpm *t, const unsigned char *addr,
+			unsigned int plen, unsigned int view)
+{
+	uint32_t node = 0;
+	unsigned int i;
+
+	if (!t->trie) {
+		t->trie = g_array_new(FALSE, FALSE, sizeof(struct trie_node));
+		trie_new(t);			/* the root */
+	}
+
+	for (i = 0; i < plen; i++) {
+		unsigned int b = addr_bit(addr, i);
+		uint32_t next = trie_at(t, node)->child[b];
+
+		if (next == TRIE_NONE) {
+			next = trie_new(t);
+			trie_at(t, node)->child[b] = next;
+		}
+		node = next;
+	}
+
+	trie_at(t, node)->view = view;
+	t->n_prefixes++;
+}
+
+/* follow the 'n' bits of 'val' down from w->node */
+static void trie_walk(struct lpm *t, struct trie_walk *w, unsigned int val,
+		      unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		struct trie_node *tn = trie_at(t, w->node);
+		uint32_t next = tn->child[(val >> (n - 1 - i)) & 1];
+
+		if (next == TRIE_NONE) {
+			w->stopped = true;
+			return;
+		}
+
+		w->node = next;
+		w->depth++;
+		if (trie_at(t, next)->view >= 0)
+			w->best = trie_at(t, next)->view;
+	}
+
+	w->stopped = false;
+}
+
+static bool trie_has_children(struct lpm *t, uint32_t node)
+{
+	struct trie_node *tn = trie_at(t, node);
+
+	return tn->child[0] != TRIE_NONE || tn->child[1] != TRIE_NONE;
+}
+
+/*
+ * A leaf for a walk that ends here.  Every address sharing the bits
+ * walked, plus the one that found no child (if any child there is),
+ * comes to the same place.
+ */
+static uint32_t trie_leaf(struct lpm *t, const struct trie_walk *w)
+{
+	unsigned int scope = w->depth;
+
+	if (trie_has_children(t, w->node))
+		scope++;
+
+	return (w->best > 0 ? w->best : 0) |
+	       (MIN(scope, t->bits) << LPM_SCOPE_SHIFT);
+}
+
+static uint32_t lpm_add_node(struct lpm *t)
+{
+	if (t->n_nodes == t->nodes_alloc) {
+		t->nodes_alloc = t->nodes_alloc ? t->nodes_alloc * 2 : 64;
+		t->nodes = g_renew(struct lpm_node, t->nodes, t->nodes_alloc);
+	}
+
+	memset(&t->nodes[t->n_nodes], 0, sizeof(struct lpm_node));
+	return t->n_nodes++;
+}
+
+static void lpm_add_leaf(struct lpm *t, uint32_t leaf)
+{
+	if (t->n_leaves == t->leaves_alloc) {
+		t->leaves_alloc = t->leaves_alloc ? t->leaves_alloc * 2 : 256;
+		t->leaves = g_renew(uint32_t, t->leaves, t->leaves_alloc);
+	}
+
+	t->leaves[t->n_leaves++] = leaf;
+}
+
+/* fill in node 'idx', for the trie below w->node */
+static void lpm_compile_node(struct lpm *t, uint32_t idx,
+			     const struct trie_walk *from)
+{
+	struct trie_walk w[LPM_SLOTS];
+	uint64_t vector = 0, leafvec = 0;
+	uint32_t base0, base1, prev_leaf = 0;
+	bool have_leaf = false;
+	unsigned int i, child;
+
+	base0 = t->n_leaves;
+	for (i = 0; i < LPM_SLOTS; i++) {
+		uint32_t leaf;
+
+		w[i] = *from;
+		trie_walk(t, &w[i], i, LPM_STRIDE);
+
+		if (!w[i].stopped && trie_has_children(t, w[i].node)) {
+			vector |= 1ULL << i;
+			continue;
+		}
+
+		/* consecutive leaves alike are stored once */
+		leaf = trie_leaf(t, &w[i]);
+		if (!have_leaf || leaf != prev_leaf) {
+			lpm_add_leaf(t, leaf);
+			leafvec |= 1ULL << i;
+			prev_leaf = leaf;
+			have_leaf = true;
+		}
+	}
+
+	/* children sit together, in slot order */
+	base1 = t->n_nodes;
+	for (i = 0; i < popcount64(vector); i++)
+		lpm_add_node(t);
+
+	t->nodes[idx].vector = vector;
+	t->nodes[idx].leafvec = leafvec;
+	t->nodes[idx].base0 = base0;
+	t->nodes[idx].base1 = base1;
+
+	for (i = 0, child = base1; i < LPM_SLOTS; i++)
+		if (vector & (1ULL << i))
+			lpm_compile_node(t, child++, &w[i]);
+}
+
+static void lpm_compile(struct lpm *t)
+{
+	unsigned int i;
+
+	for (i = 0; i < (1 << LPM_TOP_BITS); i++) {
+		struct trie_walk w = { 0, 0, -1, false };
+		uint32_t idx;
+
+		if (!t->trie) {
+			t->top[i] = 0;		/* view 0, for everyone */
+			continue;
+		}
+
+		if (trie_at(t, 0)->view >= 0)
+			w.best = trie_at(t, 0)->view;
+		trie_walk(t, &w, i, LPM_TOP_BITS);
+
+		if (w.stopped || !trie_has_children(t, w.node)) {
+			t->top[i] = trie_leaf(t, &w);
+			continue;
+		}
+
+		idx = lpm_add_node(t);
+		t->top[i] = LPM_NODE | idx;
+		lpm_compile_node(t, idx, &w);
+	}
+
+	if (t->trie) {
+		g_array_free(t->trie, TRUE);
+		t->trie = NULL;
+	}
+}
+
+/* LPM_STRIDE bits of a 128-bit address, from bit 'pos' on */
+static unsigned int lpm_bits(uint64_t hi, uint64_t lo, unsigned int pos)
+{
+	if (pos + LPM_STRIDE <= 64)
+		return (hi >> (64 - LPM_STRIDE - pos)) & (LPM_SLOTS - 1);
+	if (pos + LPM_STRIDE <= 128)
+		return (lo >> (128 - LPM_STRIDE - pos)) & (LPM_SLOTS - 1);
+
+	/* past the end: zeroes */
+	return (lo << (pos + LPM_STRIDE - 128)) & (LPM_SLOTS - 1);
+}
+
+static uint32_t lpm_lookup(const struct lpm *t, uint64_t hi, uint64_t lo)
+{
+	uint32_t e = t->top[hi >> (64 - LPM_TOP_BITS)];
+	unsigned int pos = LPM_TOP_BITS;
+
+	while (e & LPM_NODE) {
+		const struct lpm_node *n = &t->nodes[e & ~LPM_NODE];
+		unsigned int idx = lpm_bits(hi, lo, pos);
+		uint64_t below = (2ULL << idx) - 1;	/* slots 0..idx */
+
+		if (!(n->vector & (1ULL << idx)))
+			return t->leaves[n->base0 +
+					 popcount64(n->leafvec & below) - 1];
+
+		e = LPM_NODE | (n->base1 + popcount64(n->vector & below) - 1);
+		pos += LPM_STRIDE;
+	}
+
+	return e;
+}
+
+static uint64_t load64(const unsigned char *p)
+{
+	uint64_t v = 0;
+	unsigned int i;
+
+	for (i = 0; i < 8; i++)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+/*
+ * The view for a client address (4 or 16 bytes), and in *scope the
+ * number of leading bits that decided it.
+ */
+unsigned int view_lookup(const unsigned char *addr, unsigned int addr_len,
+			 unsigned int *scope)
+{
+	uint32_t leaf;
+
+	if (addr_len == 4)
+		leaf = lpm_lookup(&lpm4, load64(addr) & 0xffffffff00000000ULL,
+				  0);
+	else if (addr_len == 16)
+		leaf = lpm_lookup(&lpm6, load64(addr), load64(addr + 8));
+	else {
+		*scope = 0;
+		return 0;
+	}
+
+	*scope = leaf >> LPM_SCOPE_SHIFT;
+	return leaf & VIEW_MAX;
+}
+
+/* "192.0.2.0/24 1" */
+static bool view_parse_line(char *line)
+{
+	unsigned char addr[16];
+	char *pfx, *len_s, *view_s, *end;
+	unsigned long plen, view;
+	struct lpm *t;
+
+	pfx = strtok(line, " \t\r\n");
+	if (!pfx || *pfx == '#')
+		return true;
+
+	view_s = strtok(NULL, " \t\r\n");
+	if (!view_s)
+		return false;
+
+	len_s = strchr(pfx, '/');
+	if (len_s)
+		*len_s++ = 0;
+
+	if (inet_pton(AF_INET, pfx, addr) == 1)
+		t = &lpm4;
+	else if (inet_pton(AF_INET6, pfx, addr) == 1)
+		t = &lpm6;
+	else
+		return false;
+
+	plen = t->bits;
+	if (len_s) {
+		plen = strtoul(len_s, &end, 10);
+		if (*end || plen > t->bits)
+			return false;
+	}
+
+	view = strtoul(view_s, &end, 10);
+	if (*end || view > VIEW_MAX)
+		return false;
+
+	trie_insert(t, addr, plen, view);
+	if (view >= n_views)
+		n_views = view + 1;
+	return true;
+}
+
+void view_init(void)
+{
+	char line[512];
+	unsigned int lineno = 0;
+	FILE *f;
+
+	if (!views_fn[0])
+		return;
+
+	f = fopen(views_fn, "r");
+	if (!f) {
+		syslog(LOG_ERR, "%s: %m", views_fn);
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (!view_parse_line(line)) {
+			syslog(LOG_ERR, "%s line %u: expected PREFIX VIEW",
+			       views_fn, lineno);
+			exit(1);
+		}
+	}
+
+	fclose(f);
+
+	syslog(LOG_INFO, "views: %u IPv4 and %u IPv6 prefixes, %u views",
+	       lpm4.n_prefixes, lpm6.n_prefixes, n_views);
+
+	lpm_compile(&lpm4);
+	lpm_compile(&lpm6);
+}
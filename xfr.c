@@ -0,0 +1,231 @@
+/*
+ * Copyright 2006 Jeff Garzik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Outbound zone transfers (AXFR, RFC 5936).
+ *
+ * Each message is built on a backend worker and handed back to the
+ * main loop, so memory use does not depend on zone size and no
+ * database read ever holds up other clients.  The transport only asks
+ * for the next message once its write queue has drained.
+ *
+ * There is no journal to serve differences from, so IXFR is answered
+ * with a full transfer, as permitted by RFC 1995.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include "dnsd.h"
+
+enum {
+	XFR_MSG_TARGET		= 16000,	/* close message past this size */
+	XFR_MSG_MAX		= 65535,
+};
+
+enum xfr_state {
+	xfr_first_soa,
+	xfr_body,
+	xfr_last_soa,
+	xfr_done,
+};
+
+struct xfr {
+	struct dnsres		*query;		/* hdr + question template */
+	struct backend_xfr	*cur;
+	enum xfr_state		state;
+	unsigned int		class;
+
+	struct backend_rr	soa;
+
+	struct backend_rr	row;		/* fetched, not yet sent */
+	bool			have_row;
+
+	/* main loop */
+	xfr_msg_fn		fn;
+	void			*data;
+	struct dnsres		*msg;		/* built by a worker */
+	bool			busy;		/* ... which has it now */
+	bool			ended;
+	bool			counted;	/* in srvstat.xfr_out */
+};
+
+static unsigned int rr_max_len(const struct backend_rr *rr)
+{
+	return strlen((const char *) rr->domain) + 2 + 10 + rr->rdata_len;
+}
+
+struct xfr *xfr_begin(struct dnsres *query, xfr_msg_fn fn, void *data)
+{
+	const struct dnsq *q = query->queries->data;
+	struct xfr *xfr;
+
+	xfr = g_slice_new0(struct xfr);
+	g_assert(xfr != NULL);
+
+	xfr->cur = backend_xfr_new(q->name);
+	xfr->query = dnsres_ref(query);
+	xfr->class = q->class;
+	xfr->state = xfr_first_soa;
+	xfr->fn = fn;
+	xfr->data = data;
+
+	return xfr;
+}
+
+/* abort the transfer with an error rcode (RFC 5936, 2.2) */
+static struct dnsres *xfr_error(struct xfr *xfr, struct dnsres *res,
+				int rcode)
+{
+	dnsres_unref(res);
+	res = dnsres_clone_hdrq(xfr->query);
+	dns_set_rcode(res, rcode);
+	dns_finalize(res);
+	xfr->state = xfr_done;
+	return res;
+}
+
+/* build the next message, on a worker */
+static void xfr_build(struct backend_db *db, void *data, unsigned long *n_q)
+{
+	struct xfr *xfr = data;
+	struct dnsres *res;
+	int rc;
+
+	res = dnsres_clone_hdrq(xfr->query);
+
+	rc = db ? backend_xfr_open(db, xfr->cur, &xfr->soa, n_q) : -1;
+	if (rc <= 0) {
+		bool first = xfr->state == xfr_first_soa;
+
+		xfr->msg = xfr_error(xfr, res, (rc == 0 && first) ?
+				     rcode_notauth : rcode_servfail);
+		return;
+	}
+
+	if (xfr->state == xfr_first_soa) {
+		dns_push_rr(res, &xfr->soa);
+		xfr->state = xfr_body;
+	}
+
+	while (xfr->state == xfr_body) {
+		if (!xfr->have_row) {
+			rc = backend_xfr_next(xfr->cur, &xfr->row);
+			if (rc < 0) {
+				backend_xfr_close(xfr->cur);
+				xfr->msg = xfr_error(xfr, res, rcode_servfail);
+				return;
+			}
+			if (rc == 0) {
+				xfr->state = xfr_last_soa;
+				break;
+			}
+			if (xfr->row.class != xfr->class)
+				continue;
+
+			xfr->have_row = true;
+		}
+
+		/* leave the record for the next message if it won't fit */
+		if (res->n_answers &&
+		    (res->buflen + rr_max_len(&xfr->row)) > XFR_MSG_MAX)
+			break;
+
+		dns_push_rr(res, &xfr->row);
+		xfr->have_row = false;
+
+		if (res->buflen >= XFR_MSG_TARGET)
+			break;
+	}
+
+	backend_xfr_close(xfr->cur);
+
+	if (xfr->state == xfr_last_soa &&
+	    (res->buflen + rr_max_len(&xfr->soa)) <= XFR_MSG_MAX) {
+		dns_push_rr(res, &xfr->soa);
+		xfr->state = xfr_done;
+	}
+
+	dns_finalize(res);
+	xfr->msg = res;
+}
+
+static void xfr_free(struct xfr *xfr)
+{
+	if (xfr->msg)
+		dnsres_unref(xfr->msg);
+	backend_xfr_free(xfr->cur);
+	dnsres_unref(xfr->query);
+	g_slice_free(struct xfr, xfr);
+}
+
+static void xfr_built(void *data)
+{
+	struct xfr *xfr = data;
+	struct dnsres *msg = xfr->msg;
+
+	xfr->busy = false;
+	xfr->msg = NULL;
+
+	if (xfr->ended) {
+		dnsres_unref(msg);
+		xfr_free(xfr);
+		return;
+	}
+
+	/* authoritative: the opening SOA went out */
+	if (!xfr->counted && xfr->soa.rdata) {
+		xfr->counted = true;
+		srvstat.xfr_out++;
+	}
+
+	xfr->fn(msg, xfr->data);
+	dnsres_unref(msg);
+}
+
+/*
+ * Have the next message built and handed to the xfr_msg_fn, on the
+ * main loop; it is handed NULL once the closing SOA has gone out.
+ */
+void xfr_next(struct xfr *xfr)
+{
+	g_assert(!xfr->busy);
+
+	if (xfr->state == xfr_done) {
+		xfr->fn(NULL, xfr->data);
+		return;
+	}
+
+	xfr->busy = true;
+	backend_run(xfr_build, xfr_built, xfr);
+}
+
+/* a message is being built */
+bool xfr_busy(const struct xfr *xfr)
+{
+	return xfr->busy;
+}
+
+void xfr_end(struct xfr *xfr)
+{
+	/* the worker still has it; xfr_built() frees it */
+	if (xfr->busy)
+		xfr->ended = true;
+	else
+		xfr_free(xfr);
+}